@@ -0,0 +1,88 @@
+#include <pthread.h>
+
+#include "arena.h"
+#include "capture.h"
+#include "jit.h"
+#include "trace.h"
+
+struct arena_s {
+	chip8_t *machines;
+	int size;
+
+	// Indexes of the machines not in use
+	pthread_mutex_t lock;
+	int *free;
+	int free_count;
+};
+
+/* Allocate the given number of machines */
+arena_t *arena_create(int size)
+{
+	arena_t *arena = calloc(1, sizeof(arena_t));
+	int i;
+
+	arena->machines = aligned_alloc(_Alignof(chip8_t), size * sizeof(chip8_t));
+	arena->size = size;
+	arena->free = malloc(size * sizeof(int));
+	pthread_mutex_init(&arena->lock, NULL);
+
+	// Hand out the first machines first
+	for (i = 0; i < size; i++) {
+		init_chip(&arena->machines[i]);
+		arena->free[i] = size - 1 - i;
+	}
+
+	arena->free_count = size;
+	return arena;
+}
+
+/* Take a freshly reset machine, NULL if all of them are in use */
+chip8_t *arena_get(arena_t *arena)
+{
+	chip8_t *cpu = NULL;
+
+	pthread_mutex_lock(&arena->lock);
+
+	if (arena->free_count > 0)
+		cpu = &arena->machines[arena->free[--arena->free_count]];
+
+	pthread_mutex_unlock(&arena->lock);
+
+	// Machines are reset on the way out, outside of the lock
+	if (cpu)
+		reset_chip(cpu);
+
+	return cpu;
+}
+
+/* Give a machine back. Its trace and capture are closed, the JIT is kept
+ * for the next user */
+void arena_put(arena_t *arena, chip8_t *cpu)
+{
+	trace_close(cpu->trace);
+	cpu->trace = NULL;
+	capture_close(cpu->capture);
+	cpu->capture = NULL;
+	cpu->frames = NULL;
+
+	pthread_mutex_lock(&arena->lock);
+	arena->free[arena->free_count++] = cpu - arena->machines;
+	pthread_mutex_unlock(&arena->lock);
+}
+
+/* Free every machine and their attachments */
+void arena_free(arena_t *arena)
+{
+	int i;
+
+	for (i = 0; i < arena->size; i++) {
+		jit_free(arena->machines[i].jit);
+		trace_close(arena->machines[i].trace);
+		capture_close(arena->machines[i].capture);
+	}
+
+	pthread_mutex_destroy(&arena->lock);
+	free(arena->machines);
+	free(arena->free);
+	free(arena);
+}
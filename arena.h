@@ -0,0 +1,28 @@
+#ifndef ARENA_H_
+#define ARENA_H_
+
+#include "chip8.h"
+
+/*
+ * A fixed number of machines in one allocation, for runs which start and
+ * stop lots of short lived machines. Machines are reset when handed out
+ * and keep their JIT between uses, so code caches aren't mapped and
+ * unmapped for every run.
+ */
+
+typedef struct arena_s arena_t;
+
+/* Allocate the given number of machines */
+arena_t *arena_create(int);
+
+/* Take a freshly reset machine, NULL if all of them are in use */
+chip8_t *arena_get(arena_t *);
+
+/* Give a machine back. Its trace and capture are closed, the JIT is kept
+ * for the next user */
+void arena_put(arena_t *, chip8_t *);
+
+/* Free every machine and their attachments */
+void arena_free(arena_t *);
+
+#endif
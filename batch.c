@@ -0,0 +1,351 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "arena.h"
+#include "batch.h"
+#include "capture.h"
+#include "chip8.h"
+#include "jit.h"
+#include "lockstep.h"
+#include "pack.h"
+#include "pool.h"
+#include "trace.h"
+
+/* One line of the manifest and the result of running it */
+typedef struct {
+	int line; // Line number in the manifest
+	char *rom;
+	uint64_t budget; // Instructions to run, if set
+	uint64_t frame_budget; // Frames to run, if set
+	uint32_t ips; // Instructions per second
+	char *trace; // Where to write a trace, if set
+	char *capture; // Where to record the frames, if set
+	int lanes; // Copies to run in lockstep, if set
+	uint64_t seed; // Seed of the random numbers
+	int quirks; // Quirk profile, -1 if not set
+	int default_quirks; // Quirk profile unless it's set or in the pack
+	pack_t *pack; // Where the ROM is, if set
+	arena_t *arena; // Where the machine comes from
+
+	// Results
+	const char *status;
+	uint64_t cycles;
+	uint64_t frames;
+	uint64_t hash;
+	double wall_ms;
+} job_t;
+
+/* Parse a key=value option of a job. Returns 0 if it was understood */
+static int parse_option(job_t *job, char *option)
+{
+	char *value = strchr(option, '=');
+
+	if (!value)
+		return -1;
+
+	*value++ = '\0';
+
+	if (strcmp(option, "cycles") == 0)
+		job->budget = strtoull(value, NULL, 0);
+	else if (strcmp(option, "frames") == 0)
+		job->frame_budget = strtoull(value, NULL, 0);
+	else if (strcmp(option, "ips") == 0)
+		job->ips = strtoul(value, NULL, 0);
+	else if (strcmp(option, "trace") == 0)
+		job->trace = strdup(value);
+	else if (strcmp(option, "capture") == 0)
+		job->capture = strdup(value);
+	else if (strcmp(option, "seed") == 0)
+		job->seed = strtoull(value, NULL, 0);
+	else if (strcmp(option, "quirks") == 0)
+		return (job->quirks = parse_quirks(value)) < 0 ? -1 : 0;
+	else if (strcmp(option, "lanes") == 0)
+		job->lanes = strtoul(value, NULL, 0);
+	else
+		return -1;
+
+	return 0;
+}
+
+/* Read the manifest. Returns the number of jobs, -1 on errors */
+static int read_manifest(char *manifest, uint64_t seed, int quirks, job_t **jobs)
+{
+	FILE *file = fopen(manifest, "r");
+	char buffer[1024];
+	int count = 0, capacity = 64, line = 0;
+
+	if (!file) {
+		log_error("Couldn't open the manifest '%s'.\n", manifest);
+		return -1;
+	}
+
+	*jobs = malloc(capacity * sizeof(job_t));
+
+	while (fgets(buffer, sizeof(buffer), file)) {
+		char *save, *token;
+		line++;
+
+		token = strtok_r(buffer, " \t\r\n", &save);
+
+		// Skip blank lines and comments
+		if (!token || token[0] == '#')
+			continue;
+
+		if (count == capacity) {
+			capacity *= 2;
+			*jobs = realloc(*jobs, capacity * sizeof(job_t));
+		}
+
+		job_t *job = &(*jobs)[count++];
+		memset(job, 0, sizeof(job_t));
+		job->line = line;
+		job->rom = strdup(token);
+		job->seed = seed;
+		job->quirks = -1;
+		job->default_quirks = quirks;
+
+		while ((token = strtok_r(NULL, " \t\r\n", &save))) {
+			if (parse_option(job, token) != 0) {
+				log_error("%s:%i: Unknown option '%s'.\n", manifest, line, token);
+				fclose(file);
+				return -1;
+			}
+		}
+
+		if (job->budget == 0 && job->frame_budget == 0) {
+			log_error("%s:%i: Missing cycles= or frames=.\n", manifest, line);
+			fclose(file);
+			return -1;
+		}
+
+		if (job->lanes > 1 && (job->budget || !job->frame_budget || job->trace
+					|| job->capture)) {
+			log_error("%s:%i: lanes= needs frames= and no cycles=, trace= or capture=.\n",
+					manifest, line);
+			fclose(file);
+			return -1;
+		}
+	}
+
+	fclose(file);
+	return count;
+}
+
+static double now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/* Set up a machine for the job and load its ROM, from the pack if there is
+ * one. The manifest overrides the pack, which overrides the defaults.
+ * Returns 0 on success */
+static int load_job(job_t *job, chip8_t *cpu)
+{
+	set_quirks(cpu, job->default_quirks);
+
+	if (job->pack) {
+		const pack_entry_t *entry = pack_find(job->pack, job->rom);
+
+		if (!entry) {
+			log_error("'%s' isn't in the pack.\n", job->rom);
+			return -1;
+		}
+
+		pack_load(job->pack, entry, cpu);
+	} else if (load_file(cpu, job->rom) != 0) {
+		return -1;
+	}
+
+	if (job->quirks >= 0)
+		set_quirks(cpu, job->quirks);
+
+	if (job->ips)
+		cpu->ips = job->ips;
+
+	return 0;
+}
+
+/* Run the copies of a lanes= job together until the frame budget */
+static void run_lanes(job_t *job)
+{
+	double start = now_ms();
+	chip8_t **machines = malloc(job->lanes * sizeof(chip8_t *));
+	int i, loaded = 0;
+
+	for (i = 0; i < job->lanes; i++) {
+		machines[i] = chip8_new();
+		chip8_seed(machines[i], job->seed + i);
+
+		if (load_job(job, machines[i]) == 0)
+			loaded++;
+	}
+
+	if (loaded == job->lanes) {
+		lockstep_t *ls = lockstep_create(machines, job->lanes);
+		uint64_t frame;
+
+		for (frame = 0; frame < job->frame_budget; frame++)
+			if (lockstep_run_frame(ls) == 0)
+				break;
+
+		lockstep_free(ls);
+
+		job->status = "ok";
+		job->frames = machines[0]->frame;
+		job->hash = display_hash(machines[0]);
+
+		for (i = 0; i < job->lanes; i++) {
+			job->cycles += machines[i]->cycles;
+
+			if (machines[i]->halted)
+				job->status = "halted";
+		}
+	} else {
+		job->status = "error";
+	}
+
+	for (i = 0; i < job->lanes; i++)
+		free_chip(machines[i]);
+
+	free(machines);
+	job->wall_ms = now_ms() - start;
+}
+
+/* Run one job to the end of its budget */
+static void run_job(void *arg)
+{
+	job_t *job = arg;
+
+	if (job->lanes > 1) {
+		run_lanes(job);
+		return;
+	}
+
+	double start = now_ms();
+
+	// At most one job per worker runs at a time, so there's always one
+	chip8_t *cpu = arena_get(job->arena);
+
+	// Machines keep their code cache between jobs
+	if (!cpu->jit)
+		cpu->jit = jit_create();
+
+	chip8_seed(cpu, job->seed);
+
+	if (job->trace && !(cpu->trace = trace_open(job->trace))) {
+		job->status = "error";
+		arena_put(job->arena, cpu);
+		return;
+	}
+
+	// Nothing waits on a batch job, so every frame is kept
+	if (job->capture && !(cpu->capture = capture_open(job->capture, CAPTURE_BLOCK))) {
+		job->status = "error";
+		arena_put(job->arena, cpu);
+		return;
+	}
+
+	if (load_job(job, cpu) != 0) {
+		job->status = "error";
+		arena_put(job->arena, cpu);
+		return;
+	}
+
+	// Run whole frames, and end a cycle budget part way into the last one
+	while (!cpu->halted) {
+		if (job->frame_budget && cpu->frame >= job->frame_budget)
+			break;
+
+		if (job->budget && (cpu->frame + 1) * cpu->ips / 60 > job->budget) {
+			run_cycles(cpu, job->budget - cpu->cycles);
+			break;
+		}
+
+		run_frame(cpu);
+	}
+
+	job->status = cpu->halted ? "halted" : "ok";
+	job->cycles = cpu->cycles;
+	job->frames = cpu->frame;
+	job->hash = display_hash(cpu);
+	job->wall_ms = now_ms() - start;
+
+	arena_put(job->arena, cpu);
+}
+
+/* Run every job in the manifest on the given number of threads (0 for one
+ * per core) and write the results to out (stdout if NULL). ROMs are looked
+ * up in the pack if one is given. Jobs without a seed= use the given seed,
+ * and ones without a quirks= which the pack doesn't give a profile either
+ * use the given one. Returns 0 if every job ran */
+int run_batch(char *manifest, char *out, int threads, uint64_t seed, int quirks,
+		char *pack_file)
+{
+	pack_t *pack = NULL;
+	job_t *jobs;
+	int count, i, failed = 0;
+
+	// One mapping serves every job
+	if (pack_file && !(pack = pack_open(pack_file)))
+		return 1;
+
+	count = read_manifest(manifest, seed, quirks, &jobs);
+	if (count < 0) {
+		if (pack)
+			pack_close(pack);
+		return 1;
+	}
+
+	pool_t *pool = pool_create(threads);
+	arena_t *arena = arena_create(pool_size(pool));
+
+	for (i = 0; i < count; i++) {
+		jobs[i].arena = arena;
+		jobs[i].pack = pack;
+		pool_submit(pool, run_job, &jobs[i]);
+	}
+
+	pool_wait(pool);
+	pool_free(pool);
+	arena_free(arena);
+
+	if (pack)
+		pack_close(pack);
+
+	FILE *file = out ? fopen(out, "w") : stdout;
+
+	if (!file) {
+		log_error("Couldn't open '%s' for the results.\n", out);
+		return 1;
+	}
+
+	fprintf(file, "job\trom\tstatus\tcycles\tframes\thash\twall_ms\n");
+
+	for (i = 0; i < count; i++) {
+		job_t *job = &jobs[i];
+
+		fprintf(file, "%i\t%s\t%s\t%llu\t%llu\t%016llx\t%.3f\n",
+				job->line, job->rom, job->status,
+				(unsigned long long)job->cycles,
+				(unsigned long long)job->frames,
+				(unsigned long long)job->hash, job->wall_ms);
+
+		if (strcmp(job->status, "error") == 0)
+			failed = 1;
+
+		free(job->rom);
+		free(job->trace);
+		free(job->capture);
+	}
+
+	if (file != stdout)
+		fclose(file);
+
+	free(jobs);
+	return failed;
+}
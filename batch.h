@@ -0,0 +1,40 @@
+#ifndef BATCH_H_
+#define BATCH_H_
+
+#include <stdint.h>
+
+/*
+ * Headless batch runs. A manifest lists one job per line, a ROM followed
+ * by options:
+ *
+ *   # rom                 budget
+ *   programs/pong2.c8     cycles=1000000
+ *   programs/tetris.c8    frames=600
+ *
+ * cycles=N runs N instructions, frames=N runs N timer frames, and ips=N
+ * sets the instructions per second (600 by default). trace=FILE records a
+ * binary execution trace of the job, capture=FILE records its frames (see
+ * capture.h), seed=N seeds its random numbers and quirks=NAME picks the
+ * quirk profile (vip, chip48, schip or xochip). lanes=N runs N copies of
+ * the ROM in lockstep, which needs frames=; copy i is seeded with seed + i,
+ * their cycles are added up and the hash is the one of the first copy.
+ * Blank lines and lines starting with '#' are skipped.
+ *
+ * With a ROM pack the ROM is a name or hash in the pack, and ips= and
+ * quirks= override the ones the pack has for it.
+ *
+ * Jobs are spread over a thread pool and one tab separated line is written
+ * per job, in manifest order:
+ *
+ *   job rom status cycles frames hash wall_ms
+ */
+
+/* Run every job in the manifest on the given number of threads (0 for one
+ * per core) and write the results to out (stdout if NULL). ROMs are looked
+ * up in the pack if one is given. Jobs without a seed= use the given seed,
+ * and ones without a quirks= which the pack doesn't give a profile either
+ * use the given one. Returns 0 if every job ran */
+int run_batch(char *manifest, char *out, int threads, uint64_t seed, int quirks,
+		char *);
+
+#endif
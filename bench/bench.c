@@ -0,0 +1,373 @@
+#include <getopt.h>
+#include <glob.h>
+#include <time.h>
+
+#include "../chip8.h"
+#include "../jit.h"
+#include "../monitor.h"
+
+/*
+ * Repeatable benchmarks of the core and the renderer, built and run with
+ * `make bench`.
+ *
+ *   c8bench [--frames N] [--cycles N] [FILTER...]
+ *
+ * Scenarios are small generated programs looping over one class of
+ * instructions, a sprite heavy drawing loop, every ROM in programs/ run
+ * for a fixed number of instructions, and draw_monitor() into a surface
+ * which is never shown. Only scenarios whose name contains one of the
+ * filters are run.
+ *
+ * The results are JSON, one object per line: first the settings, then one
+ * line per scenario with the instructions per second and the wall time of
+ * a frame as percentiles, in nanoseconds.
+ */
+
+/* Instructions per second the programs run at, 10000 per frame */
+#define BENCH_IPS 600000
+
+/* Frames timed per scenario, after some to warm up the caches */
+#define BENCH_FRAMES 600
+#define WARMUP_FRAMES 30
+
+/* Instructions the ROMs in programs/ run for */
+#define ROM_CYCLES 2000000
+
+/* Where the generated programs keep their data and a subroutine which
+ * only returns */
+#define DATA_ADDR 0xE00
+#define SUB_ADDR 0xF00
+
+/* A generated program: the setup is run once, then the body forever */
+typedef struct {
+	const char *name;
+	const uint16_t setup[8];
+	const uint16_t body[16];
+} program_t;
+
+static const program_t programs[] = {
+	{ "alu", { 0x6B03 },
+		{ 0x6A05, 0x7A01, 0x8AB0, 0x8AB1, 0x8AB2, 0x8AB3, 0x8AB4, 0x8AB6 } },
+	// Half of the skips are taken
+	{ "skip", { 0x6A01, 0x6B02 },
+		{ 0x3A01, 0x7C01, 0x4A00, 0x7C01, 0x5AB0, 0x7C01, 0x9AB0, 0x7C01 } },
+	{ "memory", { 0x6A7B },
+		{ 0xAE00, 0xFA33, 0xF265, 0xAE10, 0xF255, 0xF265 } },
+	{ "flow", { 0 },
+		{ 0x2F00, 0x2F00 } },
+	{ "timer", { 0 },
+		{ 0x6A3C, 0xFA15, 0xFB07, 0xFA18 } },
+	{ "random", { 0 },
+		{ 0xCAFF, 0xCB0F } },
+	// Font sprites all over the screen, clearing it now and then
+	{ "draw", { 0x6000 },
+		{ 0xF029, 0x7105, 0x7203, 0xD125, 0x7001, 0xD125, 0x700F, 0xF029,
+		  0x7107, 0xD12F, 0x00E0 } },
+	// The same in high resolution with large digits and 16x16 sprites,
+	// scrolling the screen around
+	{ "draw_hires", { 0x00FF, 0x6000 },
+		{ 0xF030, 0x7105, 0x7203, 0xD12A, 0x7001, 0xD120, 0x00C2, 0x00FB,
+		  0x700F, 0xF030, 0x7107, 0xD12A, 0x00FC, 0x00E0 } },
+	{ NULL }
+};
+
+/* What a scenario measured */
+typedef struct {
+	const char *name;
+	const char *kind;
+	const char *status;
+	uint64_t instructions;
+	uint64_t bytes; // Written to the surface, for the renderer
+	double *samples; // Nanoseconds per frame
+	int count;
+} result_t;
+
+static int frames = BENCH_FRAMES;
+static uint64_t rom_cycles = ROM_CYCLES;
+static char **filters;
+static int filter_count;
+
+static struct option options[] = {
+	{ "frames", required_argument, NULL, 'f' },
+	{ "cycles", required_argument, NULL, 'c' },
+	{ NULL, 0, NULL, 0 }
+};
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* The p-th percentile of sorted samples, nearest rank */
+static double percentile(const double *sorted, int count, double p)
+{
+	int rank = (int)(p / 100.0 * count + 0.999999);
+
+	if (rank < 1)
+		rank = 1;
+
+	return sorted[rank - 1];
+}
+
+/* Whether the scenario was asked for */
+static int wanted(const char *name)
+{
+	int i;
+
+	if (filter_count == 0)
+		return 1;
+
+	for (i = 0; i < filter_count; i++)
+		if (strstr(name, filters[i]))
+			return 1;
+
+	return 0;
+}
+
+/* Write the line of a scenario */
+static void report(result_t *r)
+{
+	double total = 0;
+	int i;
+
+	for (i = 0; i < r->count; i++)
+		total += r->samples[i];
+
+	qsort(r->samples, r->count, sizeof(double), compare_doubles);
+
+	printf("{\"scenario\":\"%s\",\"kind\":\"%s\",\"status\":\"%s\","
+			"\"frames\":%i,\"instructions\":%llu,",
+			r->name, r->kind, r->status, r->count,
+			(unsigned long long)r->instructions);
+
+	if (r->instructions && total > 0)
+		printf("\"ips\":%.0f,", r->instructions / (total / 1e9));
+
+	if (r->bytes && total > 0)
+		printf("\"bytes_per_sec\":%.0f,", r->bytes / (total / 1e9));
+
+	if (r->count > 0)
+		printf("\"ns_per_frame\":{\"mean\":%.0f,\"p50\":%.0f,\"p90\":%.0f,"
+				"\"p99\":%.0f,\"max\":%.0f}}\n",
+				total / r->count,
+				percentile(r->samples, r->count, 50),
+				percentile(r->samples, r->count, 90),
+				percentile(r->samples, r->count, 99),
+				r->samples[r->count - 1]);
+	else
+		printf("\"ns_per_frame\":null}\n");
+
+	fflush(stdout);
+}
+
+/* Run warmup frames, then time frames of a machine until it has run
+ * max_frames frames or cycles instructions, or halts */
+static void time_frames(chip8_t *cpu, result_t *r, int warmup, int max_frames,
+		uint64_t cycles)
+{
+	int i;
+
+	for (i = 0; i < warmup && !cpu->halted; i++)
+		run_frame(cpu);
+
+	uint64_t start = cpu->cycles;
+
+	r->samples = malloc(max_frames * sizeof(double));
+	r->count = 0;
+
+	while (r->count < max_frames && !cpu->halted
+			&& (!cycles || cpu->cycles - start < cycles)) {
+		double t = now_ns();
+		run_frame(cpu);
+		r->samples[r->count++] = now_ns() - t;
+	}
+
+	r->instructions = cpu->cycles - start;
+	r->status = cpu->halted ? "halted" : "ok";
+}
+
+/* Write a generated program into a fresh machine */
+static void load_program(chip8_t *cpu, const program_t *p)
+{
+	uint16_t addr = 0x200, loop;
+	int i;
+
+	for (i = 0; i < 8 && p->setup[i]; i++, addr += 2) {
+		cpu->memory[addr] = p->setup[i] >> 8;
+		cpu->memory[addr + 1] = p->setup[i];
+	}
+
+	// Unroll the body so the jump back is a small part of the loop
+	loop = addr;
+
+	while (addr < DATA_ADDR - 64) {
+		for (i = 0; i < 16 && p->body[i]; i++, addr += 2) {
+			cpu->memory[addr] = p->body[i] >> 8;
+			cpu->memory[addr + 1] = p->body[i];
+		}
+	}
+
+	cpu->memory[addr] = 0x10 | (loop >> 8);
+	cpu->memory[addr + 1] = loop;
+
+	cpu->memory[SUB_ADDR] = 0x00;
+	cpu->memory[SUB_ADDR + 1] = 0xEE;
+
+	invalidate_decoded(cpu, 0, 4096);
+}
+
+static void bench_programs(void)
+{
+	const program_t *p;
+
+	for (p = programs; p->name; p++) {
+		if (!wanted(p->name))
+			continue;
+
+		chip8_t *cpu = chip8_new();
+		result_t r = { p->name, "opcodes" };
+
+		cpu->jit = jit_create();
+		cpu->ips = BENCH_IPS;
+		load_program(cpu, p);
+
+		time_frames(cpu, &r, WARMUP_FRAMES, frames, 0);
+		report(&r);
+
+		free(r.samples);
+		free_chip(cpu);
+	}
+}
+
+static void bench_roms(void)
+{
+	glob_t roms;
+	size_t i;
+
+	if (glob("programs/*.c8", 0, NULL, &roms) != 0)
+		return;
+
+	for (i = 0; i < roms.gl_pathc; i++) {
+		char *rom = roms.gl_pathv[i];
+
+		if (!wanted(rom))
+			continue;
+
+		chip8_t *cpu = chip8_new();
+		result_t r = { rom, "rom" };
+
+		cpu->jit = jit_create();
+		cpu->ips = BENCH_IPS;
+
+		// The start up of a ROM is part of the run, so no warming up
+		if (load_file(cpu, rom) == 0) {
+			time_frames(cpu, &r, 0, rom_cycles / (BENCH_IPS / 60) + 1,
+					rom_cycles);
+		} else {
+			r.status = "error";
+		}
+
+		report(&r);
+		free(r.samples);
+		free_chip(cpu);
+	}
+
+	globfree(&roms);
+}
+
+/* Redraw the given rows of a changing display of the given geometry,
+ * frames times */
+static void bench_render(const char *name, int hires, uint64_t dirty)
+{
+	SDL_Surface *surface;
+	uint64_t display[DISPLAY_WORDS(HIRES)], x = 0x9E3779B97F4A7C15ULL;
+	render_stats_t stats;
+	result_t r = { name, "render", "ok" };
+	int i, word;
+
+	if (!wanted(name))
+		return;
+
+	if (!(surface = create_offscreen())) {
+		r.status = "error";
+		report(&r);
+		return;
+	}
+
+	r.samples = malloc(frames * sizeof(double));
+
+	for (i = 0; i < WARMUP_FRAMES + frames; i++) {
+		// New pixels in every row, so nothing is cached
+		for (word = 0; word < DISPLAY_WORDS(hires); word++) {
+			x ^= x << 13;
+			x ^= x >> 7;
+			x ^= x << 17;
+			display[word] = x;
+		}
+
+		double t = now_ns();
+		draw_monitor(surface, display, hires, dirty, &stats);
+		t = now_ns() - t;
+
+		if (i >= WARMUP_FRAMES) {
+			r.samples[r.count++] = t;
+			r.bytes += stats.bytes;
+		}
+	}
+
+	report(&r);
+	free(r.samples);
+	SDL_FreeSurface(surface);
+}
+
+int main(int argc, char *argv[])
+{
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+		switch (opt)
+		{
+			case 'f': frames = atoi(optarg); break;
+			case 'c': rom_cycles = strtoull(optarg, NULL, 0); break;
+			default:
+				printf("Usage: c8bench [--frames N] [--cycles N] [FILTER...]\n");
+				return 1;
+		}
+	}
+
+	if (frames <= 0 || rom_cycles == 0) {
+		printf("--frames and --cycles need to be above 0.\n");
+		return 1;
+	}
+
+	filters = &argv[optind];
+	filter_count = argc - optind;
+
+	// Halting ROMs are part of the results, not worth a warning
+	g_log_level = LOG_ERROR;
+
+	jit_t *jit = jit_create();
+	printf("{\"bench\":\"c8bench\",\"jit\":%s,\"ips\":%i,\"frames\":%i,"
+			"\"rom_cycles\":%llu}\n", jit ? "true" : "false", BENCH_IPS,
+			frames, (unsigned long long)rom_cycles);
+	jit_free(jit);
+
+	bench_programs();
+	bench_roms();
+	bench_render("render_full", LORES, 0xFFFFFFFF);
+	bench_render("render_row", LORES, 0x00010000);
+	bench_render("render_full_hires", HIRES, ~0ULL);
+	bench_render("render_row_hires", HIRES, 0x0000000100000000ULL);
+
+	return 0;
+}
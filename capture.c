@@ -0,0 +1,444 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "capture.h"
+
+/* Size of one block written to the file */
+#define BLOCK_SIZE (1024 * 1024)
+
+/* Bytes of coded frames the queue holds, a power of two */
+#define QUEUE_SIZE (256 * 1024)
+
+/* Bytes queued before the writer is woken up. Less waits for it to wake up
+ * on its own, every FLUSH_NS */
+#define WAKE_AT (QUEUE_SIZE / 4)
+
+/* How often the writer looks at the queue by itself, and how long it holds
+ * on to a partly filled block once frames stop coming */
+#define FLUSH_NS 100000000LL
+
+#define NSEC_PER_SEC 1000000000LL
+
+struct capture_s {
+	int fd;
+	int policy;
+
+	// Only touched by the thread running the machine
+	uint64_t prev[DISPLAY_WORDS(HIRES)]; // Last frame queued
+	uint8_t prev_hires; // Its geometry
+	uint64_t frame; // Last frame seen
+	uint32_t since_key; // Records queued since the last key frame
+	uint8_t need_key;
+	uint8_t after_drop;
+	uint64_t dropped;
+
+	// The queue, a ring of records as they're written to the file. The
+	// machine's thread adds at tail, the writer takes from head, each only
+	// moving its own end. They're kept on their own cache lines so the two
+	// threads don't fight over them.
+	uint8_t *ring;
+	uint64_t head __attribute__((aligned(64)));
+	uint64_t tail __attribute__((aligned(64)));
+
+	// Used to sleep whichever side has nothing to do
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t work; // Signalled when frames are queued
+	pthread_cond_t room; // Signalled when frames are taken
+	int sleeping; // Set while the writer waits for work
+	int waiting; // Set while the machine's thread waits for room
+	int stopping;
+
+	// Only touched by the writer
+	uint8_t *buffer;
+	uint32_t used;
+	uint64_t offset; // Bytes handed to the file before the buffer
+	capture_key_t *keys;
+	uint32_t key_count;
+	uint32_t key_capacity;
+};
+
+/* Write the bytes to the file, dropping them if that fails */
+static void write_all(capture_t *cap, const void *data, uint32_t size)
+{
+	uint32_t done = 0;
+
+	while (done < size) {
+		ssize_t n = write(cap->fd, (const uint8_t *)data + done, size - done);
+
+		if (n <= 0) {
+			log_error("Couldn't write to the capture, dropping %u bytes.\n",
+					size - done);
+			break;
+		}
+
+		done += n;
+	}
+
+	cap->offset += size;
+}
+
+/* Write everything buffered to the file */
+static void flush(capture_t *cap)
+{
+	write_all(cap, cap->buffer, cap->used);
+	cap->used = 0;
+}
+
+/* Copy bytes into the ring at a position, wrapping around its end */
+static void ring_write(capture_t *cap, uint64_t at, const void *data, uint32_t size)
+{
+	uint32_t start = at % QUEUE_SIZE;
+	uint32_t first = size < QUEUE_SIZE - start ? size : QUEUE_SIZE - start;
+
+	memcpy(cap->ring + start, data, first);
+	memcpy(cap->ring, (const uint8_t *)data + first, size - first);
+}
+
+/* Copy bytes out of the ring at a position, wrapping around its end */
+static void ring_read(capture_t *cap, uint64_t at, void *data, uint32_t size)
+{
+	uint32_t start = at % QUEUE_SIZE;
+	uint32_t first = size < QUEUE_SIZE - start ? size : QUEUE_SIZE - start;
+
+	memcpy(data, cap->ring + start, first);
+	memcpy((uint8_t *)data + first, cap->ring, size - first);
+}
+
+/* Move the record at a position of the ring to the block, noting where key
+ * frames go. Returns its size */
+static uint32_t append(capture_t *cap, uint64_t at)
+{
+	capture_rec_t rec;
+
+	ring_read(cap, at, &rec, sizeof(rec));
+	uint32_t size = sizeof(rec) + rec.length;
+
+	if (cap->used + size > BLOCK_SIZE)
+		flush(cap);
+
+	if (rec.type == CAPTURE_KEY) {
+		if (cap->key_count == cap->key_capacity) {
+			cap->key_capacity = cap->key_capacity ? 2 * cap->key_capacity : 64;
+			cap->keys = realloc(cap->keys, cap->key_capacity * sizeof(capture_key_t));
+		}
+
+		cap->keys[cap->key_count].frame = rec.frame;
+		cap->keys[cap->key_count].offset = cap->offset + cap->used;
+		cap->key_count++;
+	}
+
+	ring_read(cap, at, cap->buffer + cap->used, size);
+	cap->used += size;
+	return size;
+}
+
+/* Bytes waiting for the writer */
+static uint64_t queued(capture_t *cap)
+{
+	return __atomic_load_n(&cap->tail, __ATOMIC_SEQ_CST) - cap->head;
+}
+
+/* Sleep until enough frames are queued or FLUSH_NS has passed, setting
+ * timed_out in the latter case. Returns 0 once the capture is closing and
+ * the queue is empty */
+static int wait_for_work(capture_t *cap, int *timed_out)
+{
+	struct timespec ts;
+	int status = 0, more;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	ts.tv_sec += (ts.tv_nsec + FLUSH_NS) / NSEC_PER_SEC;
+	ts.tv_nsec = (ts.tv_nsec + FLUSH_NS) % NSEC_PER_SEC;
+
+	pthread_mutex_lock(&cap->lock);
+
+	// Set before looking at the queue, so a frame queued after the look
+	// sees it and signals
+	__atomic_store_n(&cap->sleeping, 1, __ATOMIC_SEQ_CST);
+
+	while (queued(cap) < WAKE_AT && !cap->stopping && status != ETIMEDOUT)
+		status = pthread_cond_timedwait(&cap->work, &cap->lock, &ts);
+
+	__atomic_store_n(&cap->sleeping, 0, __ATOMIC_RELAXED);
+	more = queued(cap) || !cap->stopping;
+	pthread_mutex_unlock(&cap->lock);
+
+	*timed_out = status == ETIMEDOUT;
+	return more;
+}
+
+static void *writer_main(void *arg)
+{
+	capture_t *cap = arg;
+	int timed_out;
+
+	// Frames are taken in batches, when a batch is ready or FLUSH_NS has
+	// passed
+	while (wait_for_work(cap, &timed_out)) {
+		uint64_t head = cap->head;
+		uint64_t tail = __atomic_load_n(&cap->tail, __ATOMIC_ACQUIRE);
+
+		while (head != tail)
+			head += append(cap, head);
+
+		// The frames are copied, hand their room back
+		__atomic_store_n(&cap->head, head, __ATOMIC_SEQ_CST);
+
+		if (__atomic_load_n(&cap->waiting, __ATOMIC_SEQ_CST)) {
+			pthread_mutex_lock(&cap->lock);
+			pthread_cond_signal(&cap->room);
+			pthread_mutex_unlock(&cap->lock);
+		}
+
+		// Frames coming in slowly go to the file at least every FLUSH_NS
+		if (timed_out)
+			flush(cap);
+	}
+
+	flush(cap);
+	return NULL;
+}
+
+/* Start a capture in the given file with a CAPTURE_* policy, NULL if it
+ * couldn't be created */
+capture_t *capture_open(char *filename, int policy)
+{
+	pthread_condattr_t attr;
+	int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+	if (fd < 0) {
+		log_error("Couldn't create the capture '%s'.\n", filename);
+		return NULL;
+	}
+
+	capture_t *cap = aligned_alloc(_Alignof(capture_t), sizeof(capture_t));
+	memset(cap, 0, sizeof(capture_t));
+	cap->fd = fd;
+	cap->policy = policy;
+	cap->need_key = 1;
+	cap->ring = malloc(QUEUE_SIZE);
+	cap->buffer = malloc(BLOCK_SIZE);
+
+	capture_header_t header = { CAPTURE_MAGIC, CAPTURE_VERSION, 0 };
+	memcpy(cap->buffer, &header, sizeof(header));
+	cap->used = sizeof(header);
+
+	// The flush deadline is on the monotonic clock
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&cap->work, &attr);
+	pthread_condattr_destroy(&attr);
+	pthread_cond_init(&cap->room, NULL);
+	pthread_mutex_init(&cap->lock, NULL);
+
+	pthread_create(&cap->thread, NULL, writer_main, cap);
+	return cap;
+}
+
+/* Write out everything queued, add the index and close the file. Prints
+ * how many frames were dropped, if any */
+void capture_close(capture_t *cap)
+{
+	if (!cap)
+		return;
+
+	pthread_mutex_lock(&cap->lock);
+	cap->stopping = 1;
+	pthread_cond_signal(&cap->work);
+	pthread_mutex_unlock(&cap->lock);
+
+	pthread_join(cap->thread, NULL);
+
+	capture_footer_t footer = {
+		.offset = cap->offset,
+		.frames = cap->frame,
+		.count = cap->key_count,
+	};
+
+	memcpy(footer.magic, CAPTURE_INDEX_MAGIC, 4);
+	write_all(cap, cap->keys, cap->key_count * sizeof(capture_key_t));
+	write_all(cap, &footer, sizeof(footer));
+
+	if (cap->dropped)
+		log_warn("The capture dropped %llu frames.\n",
+				(unsigned long long)cap->dropped);
+
+	close(cap->fd);
+	pthread_cond_destroy(&cap->work);
+	pthread_cond_destroy(&cap->room);
+	pthread_mutex_destroy(&cap->lock);
+	free(cap->ring);
+	free(cap->buffer);
+	free(cap->keys);
+	free(cap);
+}
+
+/* Run length code the size bytes of a frame, see capture.h. Returns the
+ * length of the code */
+static uint16_t encode(const uint8_t *in, int size, uint8_t *out)
+{
+	int i = 0, used = 0;
+
+	while (i < size) {
+		int start = i;
+
+		if (in[i] == 0) {
+			// Deltas are mostly zeros, skip them a word at a time
+			while (i < size && i - start < 128) {
+				uint64_t word = 1;
+
+				if ((i & 7) == 0 && i - start <= 120)
+					memcpy(&word, &in[i], 8);
+
+				if (word == 0)
+					i += 8;
+				else if (in[i] == 0)
+					i++;
+				else
+					break;
+			}
+
+			out[used++] = i - start - 1;
+			continue;
+		}
+
+		// A lone zero costs less inside the literal than as a run
+		while (i < size && i - start < 128 && (in[i] || (i + 1 < size && in[i + 1])))
+			i++;
+
+		out[used++] = 0x80 | (i - start - 1);
+		memcpy(out + used, in + start, i - start);
+		used += i - start;
+	}
+
+	return used;
+}
+
+/* Bytes free in the queue */
+static uint32_t room(capture_t *cap)
+{
+	return QUEUE_SIZE - (cap->tail - __atomic_load_n(&cap->head, __ATOMIC_SEQ_CST));
+}
+
+/* Wait until the writer has made room for size bytes in the queue */
+static void wait_for_room(capture_t *cap, uint32_t size)
+{
+	pthread_mutex_lock(&cap->lock);
+	__atomic_store_n(&cap->waiting, 1, __ATOMIC_SEQ_CST);
+
+	while (room(cap) < size)
+		pthread_cond_wait(&cap->room, &cap->lock);
+
+	__atomic_store_n(&cap->waiting, 0, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&cap->lock);
+}
+
+/* Queue the display as the frame which just ended */
+void capture_frame(capture_t *cap, chip8_t *cpu)
+{
+	struct __attribute__((packed)) {
+		capture_rec_t rec;
+		uint8_t data[CAPTURE_MAX_DATA];
+	} record;
+	uint8_t bytes[CAPTURE_FRAME_BYTES(HIRES)];
+	const int hires = cpu->hires, words = DISPLAY_WORDS(hires);
+	uint32_t size;
+	int key, word;
+
+	cap->frame = cpu->frame;
+
+	// Most frames draw nothing, and aren't recorded. Only the words in
+	// use are looked at, a low resolution frame is a quarter of the
+	// display.
+	if (!cap->need_key && hires == cap->prev_hires
+			&& memcmp(cap->prev, cpu->display, words * sizeof(uint64_t)) == 0)
+		return;
+
+	key = cap->need_key || hires != cap->prev_hires
+			|| cap->since_key >= CAPTURE_KEY_INTERVAL;
+
+	// Words are stored leftmost pixels first
+	for (word = 0; word < words; word++) {
+		uint64_t bits = cpu->display[word] ^ (key ? 0 : cap->prev[word]);
+
+		bits = __builtin_bswap64(bits);
+		memcpy(&bytes[word * 8], &bits, 8);
+	}
+
+	record.rec.frame = cpu->frame;
+	record.rec.length = encode(bytes, CAPTURE_FRAME_BYTES(hires), record.data);
+	record.rec.type = key ? CAPTURE_KEY : CAPTURE_DELTA;
+	record.rec.flags = (cap->after_drop ? CAPTURE_AFTER_DROP : 0)
+			| (hires ? CAPTURE_HIRES : 0);
+	size = sizeof(record.rec) + record.rec.length;
+
+	if (room(cap) < size) {
+		if (cap->policy == CAPTURE_DROP) {
+			// The next frame can't be a delta of a frame which isn't there
+			cap->dropped++;
+			cap->need_key = 1;
+			cap->after_drop = 1;
+			return;
+		}
+
+		wait_for_room(cap, size);
+	}
+
+	ring_write(cap, cap->tail, &record, size);
+
+	memcpy(cap->prev, cpu->display, words * sizeof(uint64_t));
+	cap->prev_hires = hires;
+	cap->since_key = key ? 1 : cap->since_key + 1;
+	cap->need_key = 0;
+	cap->after_drop = 0;
+
+	__atomic_store_n(&cap->tail, cap->tail + size, __ATOMIC_SEQ_CST);
+
+	if (cap->tail - __atomic_load_n(&cap->head, __ATOMIC_RELAXED) >= WAKE_AT
+			&& __atomic_load_n(&cap->sleeping, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&cap->lock);
+		pthread_cond_signal(&cap->work);
+		pthread_mutex_unlock(&cap->lock);
+	}
+}
+
+/* XOR a coded frame of the given geometry into the rows, laid out like the
+ * display. They should be cleared first for a key frame, and hold the
+ * frame before it for a delta. Returns 0, -1 if the data is damaged */
+int capture_decode(const uint8_t *data, uint16_t length, int hires, uint64_t *rows)
+{
+	uint8_t bytes[CAPTURE_FRAME_BYTES(HIRES)];
+	int size = CAPTURE_FRAME_BYTES(hires), i = 0, used = 0, word;
+
+	while (i < length) {
+		int c = data[i++];
+		int n = (c & 0x7F) + 1;
+
+		if (used + n > size || (c >= 0x80 && i + n > length))
+			return -1;
+
+		if (c < 0x80) {
+			memset(&bytes[used], 0, n);
+		} else {
+			memcpy(&bytes[used], &data[i], n);
+			i += n;
+		}
+
+		used += n;
+	}
+
+	if (used != size)
+		return -1;
+
+	for (word = 0; word < size / 8; word++) {
+		uint64_t bits;
+
+		memcpy(&bits, &bytes[word * 8], 8);
+		rows[word] ^= __builtin_bswap64(bits);
+	}
+
+	return 0;
+}
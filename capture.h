@@ -0,0 +1,103 @@
+#ifndef CAPTURE_H_
+#define CAPTURE_H_
+
+#include "chip8.h"
+
+/*
+ * Recordings of the display, one record per emulated frame which changed
+ * it. A capture file is a header followed by records:
+ *
+ *   capture_rec_t  header
+ *   uint8_t        data[length]  the frame, run length coded
+ *
+ * Key frames are coded on their own, other frames as the XOR of the frame
+ * before them, which is mostly zeros. The bytes of a frame, 256 for 64x32
+ * and 1024 for 128x64 (CAPTURE_HIRES), row 0 first and each row's
+ * leftmost pixels in its first byte, are coded as runs: a byte c < 0x80
+ * stands for c + 1 zero bytes, any other byte is followed by (c & 0x7F) +
+ * 1 literal bytes. A frame of another geometry than the one before it is
+ * always a key frame.
+ *
+ * Frames missing from the file, because nothing was drawn or the machine
+ * skipped them waiting for a key, look the same as the one before.
+ * Closing the capture appends an index of the key frames and a footer, so
+ * any key frame can be found without reading what comes before it. Files
+ * cut short have no footer and are read from the start.
+ *
+ * Frames are coded on the thread running the machine and queued for a
+ * writer thread, which writes them out in large blocks. When the queue is
+ * full, CAPTURE_DROP drops the frame and the next one is a key frame,
+ * while CAPTURE_BLOCK waits for the writer to catch up.
+ */
+
+#define CAPTURE_MAGIC "C8CP"
+#define CAPTURE_INDEX_MAGIC "C8CI"
+#define CAPTURE_VERSION 2
+
+/* What to do with a frame when the writer is behind */
+#define CAPTURE_DROP 0 // Drop it, the machine never waits
+#define CAPTURE_BLOCK 1 // Wait for room, no frame is ever lost
+
+/* Record types */
+#define CAPTURE_KEY 0 // Coded on its own
+#define CAPTURE_DELTA 1 // Coded against the frame before
+
+/* Record flags */
+#define CAPTURE_AFTER_DROP 0x1 // Frames before this one were dropped
+#define CAPTURE_HIRES 0x2 // The frame is 128x64, not 64x32
+
+/* A key frame every this many records */
+#define CAPTURE_KEY_INTERVAL 600
+
+/* Bytes of a frame of the given geometry, LORES or HIRES */
+#define CAPTURE_FRAME_BYTES(hires) (DISPLAY_WORDS(hires) * 8)
+
+/* Longest coded frame, all literals */
+#define CAPTURE_MAX_DATA (CAPTURE_FRAME_BYTES(HIRES) + CAPTURE_FRAME_BYTES(HIRES) / 128)
+
+/* The file header */
+typedef struct __attribute__((packed)) {
+	char magic[4];
+	uint16_t version;
+	uint16_t reserved;
+} capture_header_t;
+
+/* The start of a record */
+typedef struct __attribute__((packed)) {
+	uint64_t frame; // Frame number of the machine
+	uint16_t length; // Bytes of data which follow
+	uint8_t type; // CAPTURE_KEY or CAPTURE_DELTA
+	uint8_t flags; // CAPTURE_*
+} capture_rec_t;
+
+/* One key frame in the index */
+typedef struct __attribute__((packed)) {
+	uint64_t frame;
+	uint64_t offset; // Of its record
+} capture_key_t;
+
+/* The end of a closed capture, after the index */
+typedef struct __attribute__((packed)) {
+	uint64_t offset; // Of the index
+	uint64_t frames; // Number of the last frame, recorded or not
+	uint32_t count; // Key frames in the index
+	char magic[4];
+} capture_footer_t;
+
+/* Start a capture in the given file with a CAPTURE_* policy, NULL if it
+ * couldn't be created */
+capture_t *capture_open(char *, int);
+
+/* Write out everything queued, add the index and close the file. Prints
+ * how many frames were dropped, if any */
+void capture_close(capture_t *);
+
+/* Queue the display as the frame which just ended */
+void capture_frame(capture_t *, chip8_t *);
+
+/* XOR a coded frame of the given geometry into the rows, laid out like the
+ * display. They should be cleared first for a key frame, and hold the
+ * frame before it for a delta. Returns 0, -1 if the data is damaged */
+int capture_decode(const uint8_t *, uint16_t, int, uint64_t *);
+
+#endif
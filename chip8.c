@@ -1,4 +1,14 @@
+#include <pthread.h>
+
+#include "capture.h"
 #include "chip8.h"
+#include "jit.h"
+#include "profile.h"
+#include "stream.h"
+#include "trace.h"
+
+/* Longest sequence of instructions fused into one handler */
+#define FUSE_MAX 4
 
 /* Define the fontset */
 uint8_t c8_fontset[0x80] =
@@ -21,573 +31,1658 @@ uint8_t c8_fontset[0x80] =
 		0xF0, 0x80, 0xF0, 0x80, 0x80  // F
 };
 
-void init_chip(chip8_t *cpu) 
+/* Where the large SUPER-CHIP digits go, after the fontset */
+#define BIG_FONT_START 0x80
+
+/* The large digits, 8x10 pixels each */
+uint8_t c8_big_fontset[100] =
+{
+		0x3C, 0x7E, 0xE7, 0xC3, 0xC3, 0xC3, 0xC3, 0xE7, 0x7E, 0x3C, // 0
+		0x18, 0x38, 0x58, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x3C, // 1
+		0x3E, 0x7F, 0xC3, 0x06, 0x0C, 0x18, 0x30, 0x60, 0xFF, 0xFF, // 2
+		0x3C, 0x7E, 0xC3, 0x03, 0x0E, 0x0E, 0x03, 0xC3, 0x7E, 0x3C, // 3
+		0x06, 0x0E, 0x1E, 0x36, 0x66, 0xC6, 0xFF, 0xFF, 0x06, 0x06, // 4
+		0xFF, 0xFF, 0xC0, 0xC0, 0xFC, 0xFE, 0x03, 0xC3, 0x7E, 0x3C, // 5
+		0x3E, 0x7C, 0xE0, 0xC0, 0xFC, 0xFE, 0xC3, 0xC3, 0x7E, 0x3C, // 6
+		0xFF, 0xFF, 0x03, 0x06, 0x0C, 0x18, 0x30, 0x60, 0x60, 0x60, // 7
+		0x3C, 0x7E, 0xC3, 0xC3, 0x7E, 0x7E, 0xC3, 0xC3, 0x7E, 0x3C, // 8
+		0x3C, 0x7E, 0xC3, 0xC3, 0x7F, 0x3F, 0x03, 0x03, 0x3E, 0x7C  // 9
+};
+
+/* The quirk profiles, indexed by QUIRKS_* */
+const quirks_t quirk_profiles[QUIRKS_COUNT] = {
+	// name       vf_reset  shift_vy  index       jump_vx  clip
+	{ "vip",      1,        1,        INDEX_X1,   0,       1 },
+	{ "chip48",   0,        0,        INDEX_X,    1,       1 },
+	{ "schip",    0,        0,        INDEX_KEEP, 1,       1 },
+	{ "xochip",   0,        1,        INDEX_X1,   0,       0 },
+};
+
+/* Power on state of every machine, built on first use */
+static chip8_t boot_image;
+static pthread_once_t boot_once = PTHREAD_ONCE_INIT;
+
+static void op_undecoded(chip8_t *, const instr_t *);
+
+/* Build the boot image: the fontsets in memory, the PC at the start of the
+ * program and nothing decoded */
+static void build_boot_image(void)
+{
+	chip8_t *boot = &boot_image;
+	int i;
+
+	memcpy(boot->memory, c8_fontset, sizeof(c8_fontset));
+	memcpy(&boot->memory[BIG_FONT_START], c8_big_fontset, sizeof(c8_big_fontset));
+	boot->pc = PROGRAM_START;
+	boot->ips = DEFAULT_IPS;
+	boot->random = DEFAULT_SEED;
+	boot->quirks = DEFAULT_QUIRKS;
+
+	for (i = 0; i < 2048; i++)
+		boot->decoded[i].handler = op_undecoded;
+}
+
+/* Allocate and initialize a machine, free it with free_chip() */
+chip8_t *chip8_new(void)
+{
+	chip8_t *cpu = aligned_alloc(_Alignof(chip8_t), sizeof(chip8_t));
+
+	init_chip(cpu);
+	return cpu;
+}
+
+/* A function which initializes all values for the cpu, without any
+ * attachments */
+void init_chip(chip8_t *cpu)
+{
+	cpu->jit = NULL;
+	cpu->frames = NULL;
+	cpu->stream = NULL;
+	cpu->trace = NULL;
+	cpu->capture = NULL;
+	reset_chip(cpu);
+}
+
+/* Put the cpu back in its power on state, keeping the attachments */
+void reset_chip(chip8_t *cpu)
+{
+	pthread_once(&boot_once, build_boot_image);
+	memcpy(cpu, &boot_image, CHIP8_STATE_SIZE);
+
+	// Whatever was translated belonged to the old program
+	jit_invalidate(cpu->jit, 0, 4096);
+}
+
+/* Seed the random number generator, a reset goes back to DEFAULT_SEED */
+void chip8_seed(chip8_t *cpu, uint64_t seed)
+{
+	cpu->random = seed;
+}
+
+/* Next number of the machine's random number generator (SplitMix64). Every
+ * state is valid, so any seed works */
+static inline uint64_t next_random(chip8_t *cpu)
+{
+	uint64_t z = (cpu->random += 0x9E3779B97F4A7C15ULL);
+
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	return z ^ (z >> 31);
+}
+
+/* Switch to a quirk profile, a reset goes back to DEFAULT_QUIRKS */
+void set_quirks(chip8_t *cpu, int profile)
 {
-	// Allocate 4kB of ram
-	cpu->memory = malloc(4096); // Allocate 4kB for the memory
-	memset(cpu->memory, 0x00, 4096);
+	if (profile < 0 || profile >= QUIRKS_COUNT || profile == cpu->quirks)
+		return;
+
+	// The handlers of the old profile are in the decoded instructions
+	cpu->quirks = profile;
+	invalidate_decoded(cpu, 0, 4096);
+}
+
+/* Parse the name of a quirk profile, -1 if it isn't one */
+int parse_quirks(const char *name)
+{
+	int profile;
+
+	for (profile = 0; profile < QUIRKS_COUNT; profile++)
+		if (strcmp(quirk_profiles[profile].name, name) == 0)
+			return profile;
+
+	return -1;
+}
 
-	// Set the fontset
-	uint8_t index = 0;
-	for (; index < 0x80; index++)
-		cpu->memory[index] = c8_fontset[index];
+/* Switch the display to LORES or HIRES, clearing it if that changes the
+ * geometry. A reset goes back to LORES */
+void set_resolution(chip8_t *cpu, int hires)
+{
+	if (hires == cpu->hires)
+		return;
 
-	// Allocate memory for the register. It has 16 8-bit data registers.
-	cpu->V = malloc(16);
+	cpu->hires = hires;
+	memset(cpu->display, 0, sizeof(cpu->display));
+	cpu->dirty = ~0ULL;
 
-	// Allocate the stack. It's 16 level deep
-	cpu->stack = malloc(16);
+	// The drawing handlers of the old geometry are in the decoded
+	// instructions
+	invalidate_decoded(cpu, 0, 4096);
+}
 
-	// Allocate space for the display matris.
-	// The screen is 64x32 pixels wide.
-	cpu->display = (uint8_t *)malloc(64 * 32);
-	memset(cpu->display, 0, 64*32);
+/* Timer ticks seen by the n-th instruction (counting from 1). The timers
+ * tick at the end of every 60 Hz frame of emulated time, so their values
+ * are worked out from the cycle counter whenever they're read */
+uint64_t timer_ticks(chip8_t *cpu, uint64_t n)
+{
+	// Frame f ends after instruction (f + 1) * ips / 60, see run_frame().
+	// Count the frames which ended before instruction n.
+	if (n == 0 || cpu->ips == 0)
+		return 0;
 
-	// Set default value for the timers
-	cpu->delayTimer = 0;
-	cpu->soundTimer = 0;
+	return (60 * n - 1) / cpu->ips;
+}
 
-	// Set default values for pointers
-	cpu->drawFlag = 0;
-	cpu->stackPointer = 0;
-	cpu->keys = 0x0;
-	cpu->pc = 0x200;
-	cpu->I = 0;
+/* Value of a timer set to value at tick set, at tick now */
+static uint8_t timer_value(uint16_t value, uint64_t set, uint64_t now)
+{
+	return now - set >= value ? 0 : value - (now - set);
 }
 
-/* Free all resources for the cpu */
+/* The delay and sound timers as the next instruction will see them */
+uint8_t delay_timer(chip8_t *cpu)
+{
+	return timer_value(cpu->delayTimer, cpu->delayTick,
+			timer_ticks(cpu, cpu->cycles + 1));
+}
+
+uint8_t sound_timer(chip8_t *cpu)
+{
+	return timer_value(cpu->soundTimer, cpu->soundTick,
+			timer_ticks(cpu, cpu->cycles + 1));
+}
+
+/* Set the timers as the next instruction will see them */
+void set_timers(chip8_t *cpu, uint8_t delay, uint8_t sound)
+{
+	uint64_t now = timer_ticks(cpu, cpu->cycles + 1);
+
+	cpu->delayTimer = delay;
+	cpu->delayTick = now;
+	cpu->soundTimer = sound;
+	cpu->soundTick = now;
+}
+
+/* Free the attachments and the cpu itself */
 void free_chip(chip8_t *cpu)
 {
-	// Free all allocated memory in the chip8_t struct
-	free(cpu->memory);
-	free(cpu->V);
-	free(cpu->stack);
-	free(cpu->display);
+	jit_free(cpu->jit);
+	trace_close(cpu->trace);
+	capture_close(cpu->capture);
 
 	// Free the struct
 	free(cpu);
 }
 
-void load_file(chip8_t *cpu, char *filename)
+/* Load the file into the cpus memory at PROGRAM_START. Returns 0 on
+ * success, files larger than PROGRAM_SIZE are rejected */
+int load_file(chip8_t *cpu, char *filename)
 {
 	/* Open the file */
 	FILE *pFile;
-	pFile = fopen(filename, "r");
+	pFile = fopen(filename, "rb");
 
 	if (!pFile) {
-		printf("Couldn't open the given file.\n");
-		return;
+		log_error("Couldn't open the given file.\n");
+		return -1;
 	}
 
-	/* Read instruction from the file and put in the memory
-	 * Instructions start at 0x200 */
-	int read_bytes = fread(&cpu->memory[cpu->pc], 1, 4096, pFile);
+	/* Read one byte more than fits, to tell a program which fills the
+	 * memory from one which is too large */
+	uint8_t program[PROGRAM_SIZE + 1];
+	int read_bytes = fread(program, 1, sizeof(program), pFile);
+	fclose(pFile);
+
+	if (read_bytes > PROGRAM_SIZE) {
+		log_error("'%s' doesn't fit in the %i bytes above 0x%X.\n", filename,
+				PROGRAM_SIZE, PROGRAM_START);
+		return -1;
+	}
 
 	/* Print out the starting byte */
-	printf("Read %i bytes from the file %s.\n", read_bytes, filename);
+	log_info("Read %i bytes from the file %s.\n", read_bytes, filename);
 
-	/* Close the file */
-	printf("Successfully loaded '%s' into the memory.\n", filename);
-	fclose(pFile);
+	/* Instructions start at 0x200 */
+	memcpy(&cpu->memory[PROGRAM_START], program, read_bytes);
+
+	/* Anything decoded before the load is stale now */
+	invalidate_decoded(cpu, 0, 4096);
+
+	log_info("Successfully loaded '%s' into the memory.\n", filename);
+	return 0;
 }
 
-/* Step and handle one instruction into the program */
-void step(chip8_t *cpu)
+/* Called after an instruction writes to memory */
+static void wrote_memory(chip8_t *cpu, uint16_t addr, uint16_t len)
 {
-	/* Get the next instruction 
-	 * Read the first 8 bits, shift them up and OR with the other 8 bits */
-	uint16_t opcode = (cpu->memory[cpu->pc] << 8) | cpu->memory[cpu->pc + 1];
+	invalidate_decoded(cpu, addr, len);
 
-	/* Mask out the OPCODE and handle the correct operation
-	 * Print out the instruction so we can follow it later */
-	printf("0x%X: ", opcode);
-	switch (opcode & 0xF000) 
-	{
-		case 0x0000: { // Multivalued instruction
-			printf("Entering multivalued instruction with 0xF0%X\n\t", (opcode & 0x00FF));
+	if (cpu->trace)
+		trace_memory(cpu->trace, cpu, addr, len);
+}
 
-			/* Need to switch on that new opcode */
-			switch (opcode & 0x00FF) 
-			{
+/* Halt instead of running past the end of the memory, the rest of the
+ * machine lies behind it. Returns 0 if len bytes from I are in memory */
+static int check_memory(chip8_t *cpu, const instr_t *in, uint16_t len)
+{
+	if (cpu->I + len <= 4096)
+		return 0;
 
-				case 0xE0: { // 00E0: Clears the screen.
-					printf("Clearing the screen.\n"); 
+	log_warn("0x%X reaches past the memory at I = 0x%X. Halting...\n",
+			in->opcode, cpu->I);
+	cpu->halted = 1;
+	return -1;
+}
 
-					/* Just set the whole video memory to 0s */
-					memset(cpu->display, 0, sizeof(*cpu->display));
+/*
+ * Instruction handlers. Each one executes a single decoded instruction and
+ * is responsible for moving the PC along.
+ */
 
-					// Move the PC to the next instruction
-					cpu->pc += 2;
-					break;
-				}
+/* 00E0: Clears the screen. */
+static void op_00e0(chip8_t *cpu, const instr_t *in)
+{
+	log_trace("Entering multivalued instruction with 0xF0%X\n\t", in->nn);
+	log_trace("Clearing the screen.\n"); 
 
-				case 0xEE: { // 00EE: Returns from a subroutine.
-					printf("Returning from a subroutine.\n");
+	/* Just set the video memory in use to 0s, the rest always is */
+	memset(cpu->display, 0, DISPLAY_WORDS(cpu->hires) * sizeof(uint64_t));
+	cpu->dirty = ~0ULL;
 
-					/* Pop the adr off the stack and put as the new PC */
-					cpu->stackPointer--;
-					cpu->pc = cpu->stack[cpu->stackPointer];
-					break;
-				}
+	// Move the PC to the next instruction
+	cpu->pc += 2;
+}
 
-				default: {
-					printf("Unimplemented 0x00%x. Exiting...\n", (opcode & 0x00FF));
-					exit(1);
-				}
-			}
+/* 00EE: Returns from a subroutine. */
+static void op_00ee(chip8_t *cpu, const instr_t *in)
+{
+	log_trace("Entering multivalued instruction with 0xF0%X\n\t", in->nn);
+	log_trace("Returning from a subroutine.\n");
 
-			break;
-		}
+	if (cpu->stackPointer == 0) {
+		log_warn("Stack underflow at 0x%X. Halting...\n", cpu->pc);
+		cpu->halted = 1;
+		return;
+	}
 
-		case 0x1000: { // 1NNN: Jumps to address NNN.
-			printf("Jumping to 0x0%x.\n", (opcode & 0x0FFF));
-			
-			/* Set the PC to the new value */
-			cpu->pc = (opcode & 0x0FFF);
-			break;
-		}
+	/* Pop the adr off the stack and put as the new PC */
+	cpu->stackPointer--;
+	cpu->pc = cpu->stack[cpu->stackPointer];
+}
+
+/* 00CN: Scrolls the display down N rows. Rows are moved a word at a time
+ * and only the ones which change are redrawn */
+static inline void resolution_00cn(chip8_t *cpu, const instr_t *in, const int hires)
+{
+	const int words = ROW_WORDS(hires);
+	uint64_t dirty = 0;
+	int row, word;
 
-		case 0x2000: { // 2NNN: Calls subroutine at NNN.
-			printf("Calling subroutine at 0x%x.\n", (opcode & 0x0FFF));
+	log_trace("Scrolling the screen down %i rows.\n", in->n);
 
-			/* Save the next instruction on the stack and increase the sp */
-			cpu->stack[cpu->stackPointer++] = cpu->pc + 2;
+	for (row = DISPLAY_HEIGHT(hires) - 1; row >= 0; row--) {
+		uint64_t *line = &cpu->display[row * words];
 
-			/* Set the PC to the new adr */
-			cpu->pc = (opcode & 0x0FFF);
-			break;
+		for (word = 0; word < words; word++) {
+			uint64_t bits = row >= in->n ? line[word - in->n * words] : 0;
+
+			if (line[word] != bits) {
+				line[word] = bits;
+				dirty |= 1ULL << row;
+			}
 		}
+	}
 
-		case 0x3000: { // 3XNN: Skips the next instruction if VX equals NN.
-			printf("Skip if VX equals NN ");
+	cpu->dirty |= dirty;
+	cpu->pc += 2;
+}
 
-			/* Print out the values */
-			printf("(V[0x%X] = 0x%X and NN = 0x%X). ", (opcode & 0x0F00) >> 8,
-												cpu->V[(opcode & 0x0F00) >> 8],
-												opcode & 0x00FF);
+/* 00FB: Scrolls the display right 4 pixels. */
+static inline void resolution_00fb(chip8_t *cpu, const instr_t *in, const int hires)
+{
+	const int words = ROW_WORDS(hires);
+	uint64_t dirty = 0;
+	int row, word;
 
-			if (cpu->V[(opcode & 0x0F00) >> 8] == (opcode & 0x00FF)) {
-				printf("Skipping.\n");
-				cpu->pc += 2;
-			} else {
-				printf("Not skipping.\n");
-			}
+	(void)in;
+	log_trace("Scrolling the screen right.\n");
 
-			// Move to the next instruction
-			cpu->pc += 2;
-			break;
+	// Pixels shifted out of a word go into the top of the next one
+	for (row = 0; row < DISPLAY_HEIGHT(hires); row++) {
+		uint64_t *line = &cpu->display[row * words];
+
+		for (word = words - 1; word >= 0; word--) {
+			uint64_t bits = (line[word] >> 4) | (word > 0 ? line[word - 1] << 60 : 0);
+
+			if (line[word] != bits) {
+				line[word] = bits;
+				dirty |= 1ULL << row;
+			}
 		}
+	}
 
-		case 0x4000: { // 4XNN:: Skips the next instruction if VX doesn't equal NN
-			printf("Skip if VX doesn't equals NN");
+	cpu->dirty |= dirty;
+	cpu->pc += 2;
+}
 
-			/* Print out the values */
-			printf("(V[0x%X] = 0x%X and NN = 0x%X). ", (opcode & 0x0F00) >> 8,
-												cpu->V[(opcode & 0x0F00) >> 8],
-												opcode & 0x00FF);
+/* 00FC: Scrolls the display left 4 pixels. */
+static inline void resolution_00fc(chip8_t *cpu, const instr_t *in, const int hires)
+{
+	const int words = ROW_WORDS(hires);
+	uint64_t dirty = 0;
+	int row, word;
 
-			if (cpu->V[(opcode & 0x0F00) >> 8] != (opcode & 0x00FF)) {
-				printf("Skipping.\n");
-				cpu->pc += 2;
-			} else {
-				printf("Not skipping.\n");
-			}
+	(void)in;
+	log_trace("Scrolling the screen left.\n");
 
-			// Move to the next instruction
-			cpu->pc += 2;
-			break;
-		}
+	// Pixels shifted out of a word go into the bottom of the one before
+	for (row = 0; row < DISPLAY_HEIGHT(hires); row++) {
+		uint64_t *line = &cpu->display[row * words];
 
-		case 0x5000: { // 5XY0: Skips the next instruction if VX equals VY.
-			printf("Skipping the next instruction if VX == VY.\n");
-			uint8_t _x = (opcode & 0x0F00) >> 8;
-			uint8_t _y = (opcode & 0x0F00) >> 4;
+		for (word = 0; word < words; word++) {
+			uint64_t bits = (line[word] << 4)
+					| (word + 1 < words ? line[word + 1] >> 60 : 0);
 
-			if (cpu->V[_x] == cpu->V[_y]) {
-				printf("\tSkipping...\n");
-				cpu->pc += 2;
+			if (line[word] != bits) {
+				line[word] = bits;
+				dirty |= 1ULL << row;
 			}
-	
-			cpu->pc += 2;
-			break;
 		}
+	}
 
-		case 0x6000: { // 6XNN: Sets VX to NN.
-			printf("Setting VX to 0x%x.\n", (opcode & 0x00FF));
-			cpu->V[(opcode & 0x0F00) >> 8] = (opcode & 0x00FF);
+	cpu->dirty |= dirty;
+	cpu->pc += 2;
+}
 
-			// Move to the next instruction
-			cpu->pc += 2;
-			break;
-		}
+/* Make the handlers of an instruction for both geometries, decode() picks
+ * the ones of the machine's geometry. See QUIRK_HANDLER */
+#define RESOLUTION_HANDLERS(op) \
+	static void op_##op##_lores(chip8_t *cpu, const instr_t *in) \
+	{ \
+		resolution_##op(cpu, in, LORES); \
+	} \
+	static void op_##op##_hires(chip8_t *cpu, const instr_t *in) \
+	{ \
+		resolution_##op(cpu, in, HIRES); \
+	}
 
-		case 0x7000: { // 7XNN: Adds NN to VX.
-			printf("Adds NN to VX.\n");
+RESOLUTION_HANDLERS(00cn)
+RESOLUTION_HANDLERS(00fb)
+RESOLUTION_HANDLERS(00fc)
 
-			/* Do the addition */
-			uint8_t _x = (opcode & 0x0F00) >> 8;
-			uint8_t _nn = (opcode & 0x00FF);
-			cpu->V[_x] += _nn;
+/* 00FD: Exits the interpreter, which halts the machine. */
+static void op_00fd(chip8_t *cpu, const instr_t *in)
+{
+	(void)in;
+	log_info("The program exited at 0x%X.\n", cpu->pc);
+	cpu->halted = 1;
+}
 
-			// Move to the next instruction
-			cpu->pc += 2;
-			break;
-		}			 
-
-		case 0x8000: { // Multivalued instruction, 8XYN
-			uint16_t _x = (opcode & 0x0F00) >> 8;
-			uint16_t _y = (opcode & 0x00F0) >> 4;
-			uint16_t _n = (opcode & 0x000F);
-			
-			switch (_n)
-			{
-				case 0x0: { // 8XY0 Sets VX to the value of VY.
-					printf("\tSetting VX to the value of VY.\n");
-					cpu->V[_x] = cpu->V[_y];
-
-					break;
-				}
-
-				case 0x1: { // 8XY1: Sets VX to VX or VY.
-					printf("\tSetting VX to VX or VY.\n");
-					cpu->V[_x] |= cpu->V[_y];
-
-					break;
-				}
-
-				case 0x2: { // 8XY2: Sets VX to VX and VY.
-					printf("\tSetting VX to VX and VY.\n");
-					cpu->V[_x] &= cpu->V[_y];
-
-					break;
-				}
-
-				case 0x3: { // 8XY3: Sets VX to VX xor VY.
-					printf("\tSetting VX to VX xor VY.\n");
-					cpu->V[_x] ^= cpu->V[_y];
-
-					break;
-				}
-
-				// 8XY4: Adds VY to VX. VF is set to 1 when there's a carry, 
-				// and to 0 when there isn't.
-				case 0x4: { 
-					printf("\tAdds VY to VX.\n");
-					uint16_t result = cpu->V[_x] += cpu->V[_y];
-
-					if (result > 0x00FF)
-						cpu->V[0xF] = 1;
-
-					cpu->V[_x] = result;
-
-					break;
-				}
-				
-				// 8XY5: VY is subtracted from VX. VF is set to 0 when there's 
-				// a borrow, and 1 when there isn't.
-				/*case 0x5: {
-					printf("\tVY is subtracted from VX. (skipped)\n");
-					break;
-				}*/
-
-				// 8XY6: Shifts VX right by one. VF is set to the value of 
-				// the least significant bit of VX before the shift.
-				case 0x6: {
-					printf("\tShifted VX right by one bit.\n");
-					cpu->V[0xF] = (opcode & 0x1);
-					cpu->V[_x] >>= 0x1;
-
-					break;
-				}
-
-				default: {
-					printf("\tUnimplemented instruction.\n");
-					exit(1);
-				}
-			}
+/* 00FE: Switches to the 64x32 display. */
+static void op_00fe(chip8_t *cpu, const instr_t *in)
+{
+	(void)in;
+	log_trace("Switching to low resolution.\n");
 
-			// Every instruction in this will not modify the pc in any way
-			cpu->pc += 2;
-			break;
-		}
+	cpu->pc += 2;
+	set_resolution(cpu, LORES);
+}
 
-		case 0x9000: { // 9XY0: Skips the next instruction if VX doesn't equal VY.
-			printf("Skips the next instruction if VX != VY.\n");
-			uint16_t _x = (opcode & 0x0F00) >> 8;
-			uint16_t _y = (opcode & 0x00F0) >> 4;
+/* 00FF: Switches to the 128x64 display. */
+static void op_00ff(chip8_t *cpu, const instr_t *in)
+{
+	(void)in;
+	log_trace("Switching to high resolution.\n");
 
-			if (cpu->V[_x] != cpu->V[_y]) {
-				printf("\tSkipping.\n");
-				cpu->pc += 2;
-			}
+	cpu->pc += 2;
+	set_resolution(cpu, HIRES);
+}
 
-			// Move to the next instruction
-			cpu->pc += 2;
-			break;
-		}
+/* 0NNN: Calls a machine code routine, which we can't do. */
+static void op_0nnn(chip8_t *cpu, const instr_t *in)
+{
+	log_trace("Entering multivalued instruction with 0xF0%X\n\t", in->nn);
+	log_warn("Unimplemented 0x%X. Halting...\n", in->opcode);
+	cpu->halted = 1;
+}
 
-		case 0xA000: { // ANNN: Sets I to the address NNN.
-			printf("Setting I to 0x%x.\n", (opcode & 0x0FFF));
+/* 1NNN: Jumps to address NNN. */
+static void op_1nnn(chip8_t *cpu, const instr_t *in)
+{
+	log_trace("Jumping to 0x0%x.\n", in->nnn);
 
-			/* Set I to NNN */
-			cpu->I = (opcode & 0x0FFF);
+	// Nothing ever changes in a jump to itself, so the rest of the
+	// budget would be spent right here
+	if (in->nnn == cpu->pc && cpu->budget_end > cpu->cycles && !cpu->trace)
+		cpu->cycles = cpu->budget_end;
 
-			// Move to the next instruction
-			cpu->pc += 2;
-			break;
-		}
+	/* Set the PC to the new value */
+	cpu->pc = in->nnn;
+}
 
-		case 0xB000: { // BNNN: Jumps to the address NNN plus V0.
-			printf("Jumping to 0x%x + V[0].\n", (opcode & 0x0FFF));
-			printf("\tV[0] = %i.\n", cpu->V[0]);
+/* 2NNN: Calls subroutine at NNN. */
+static void op_2nnn(chip8_t *cpu, const instr_t *in)
+{
+	log_trace("Calling subroutine at 0x%x.\n", in->nnn);
 
-			cpu->pc = (opcode & 0x0FFF) + cpu->V[0];
-			break;
-		}
+	if (cpu->stackPointer == 16) {
+		log_warn("Stack overflow at 0x%X. Halting...\n", cpu->pc);
+		cpu->halted = 1;
+		return;
+	}
+
+	/* Save the next instruction on the stack and increase the sp */
+	cpu->stack[cpu->stackPointer++] = cpu->pc + 2;
+
+	/* Set the PC to the new adr */
+	cpu->pc = in->nnn;
+}
+
+/* 3XNN: Skips the next instruction if VX equals NN. */
+static void op_3xnn(chip8_t *cpu, const instr_t *in)
+{
+	log_trace("Skip if VX equals NN ");
+
+	/* Print out the values */
+	log_trace("(V[0x%X] = 0x%X and NN = 0x%X). ", in->x, cpu->V[in->x], in->nn);
+
+	if (cpu->V[in->x] == in->nn) {
+		log_trace("Skipping.\n");
+		cpu->pc += 2;
+	} else {
+		log_trace("Not skipping.\n");
+	}
+
+	// Move to the next instruction
+	cpu->pc += 2;
+}
+
+/* 4XNN: Skips the next instruction if VX doesn't equal NN. */
+static void op_4xnn(chip8_t *cpu, const instr_t *in)
+{
+	log_trace("Skip if VX doesn't equals NN");
+
+	/* Print out the values */
+	log_trace("(V[0x%X] = 0x%X and NN = 0x%X). ", in->x, cpu->V[in->x], in->nn);
+
+	if (cpu->V[in->x] != in->nn) {
+		log_trace("Skipping.\n");
+		cpu->pc += 2;
+	} else {
+		log_trace("Not skipping.\n");
+	}
+
+	// Move to the next instruction
+	cpu->pc += 2;
+}
+
+/* 5XY0: Skips the next instruction if VX equals VY. */
+static void op_5xy0(chip8_t *cpu, const instr_t *in)
+{
+	log_trace("Skipping the next instruction if VX == VY.\n");
+
+	if (cpu->V[in->x] == cpu->V[in->y]) {
+		log_trace("\tSkipping...\n");
+		cpu->pc += 2;
+	}
+
+	cpu->pc += 2;
+}
+
+/* 6XNN: Sets VX to NN. */
+static void op_6xnn(chip8_t *cpu, const instr_t *in)
+{
+	log_trace("Setting VX to 0x%x.\n", in->nn);
+	cpu->V[in->x] = in->nn;
+
+	// Move to the next instruction
+	cpu->pc += 2;
+}
+
+/* 7XNN: Adds NN to VX. */
+static void op_7xnn(chip8_t *cpu, const instr_t *in)
+{
+	log_trace("Adds NN to VX.\n");
+
+	/* Do the addition */
+	cpu->V[in->x] += in->nn;
 
-		case 0xC000: { // CXNN: Sets VX to a random number and NN.
-			printf("Setting VX to a random number and NN.\n");
-			uint8_t _x = (opcode & 0x0F00) >> 8;
-			uint8_t _nn = opcode & 0x00FF;
+	// Move to the next instruction
+	cpu->pc += 2;
+}
+
+/* 8XY0: Sets VX to the value of VY. */
+static void op_8xy0(chip8_t *cpu, const instr_t *in)
+{
+	log_trace("\tSetting VX to the value of VY.\n");
+	cpu->V[in->x] = cpu->V[in->y];
+	cpu->pc += 2;
+}
 
-			uint16_t rand_number = rand();
-			rand_number &= _nn;
+/* 8XY1: Sets VX to VX or VY. VF is cleared on the VIP. */
+static inline void quirk_8xy1(chip8_t *cpu, const instr_t *in, const int profile)
+{
+	log_trace("\tSetting VX to VX or VY.\n");
+	cpu->V[in->x] |= cpu->V[in->y];
+
+	if (quirk_profiles[profile].vf_reset)
+		cpu->V[0xF] = 0;
+
+	cpu->pc += 2;
+}
 
-			cpu->V[_x] = rand_number;
-			printf("RANDOM NUMBER: %x\n", rand_number);
+/* 8XY2: Sets VX to VX and VY. VF is cleared on the VIP. */
+static inline void quirk_8xy2(chip8_t *cpu, const instr_t *in, const int profile)
+{
+	log_trace("\tSetting VX to VX and VY.\n");
+	cpu->V[in->x] &= cpu->V[in->y];
+
+	if (quirk_profiles[profile].vf_reset)
+		cpu->V[0xF] = 0;
+
+	cpu->pc += 2;
+}
+
+/* 8XY3: Sets VX to VX xor VY. VF is cleared on the VIP. */
+static inline void quirk_8xy3(chip8_t *cpu, const instr_t *in, const int profile)
+{
+	log_trace("\tSetting VX to VX xor VY.\n");
+	cpu->V[in->x] ^= cpu->V[in->y];
+
+	if (quirk_profiles[profile].vf_reset)
+		cpu->V[0xF] = 0;
+
+	cpu->pc += 2;
+}
+
+/* 8XY4: Adds VY to VX. VF is set to 1 when there's a carry, and to 0 when
+ * there isn't. */
+static void op_8xy4(chip8_t *cpu, const instr_t *in)
+{
+	log_trace("\tAdds VY to VX.\n");
+	uint16_t result = cpu->V[in->x] + cpu->V[in->y];
+
+	// VF is set last, so it holds the carry even when it's VX
+	cpu->V[in->x] = result;
+	cpu->V[0xF] = result > 0x00FF;
+	cpu->pc += 2;
+}
+
+/* 8XY5: VY is subtracted from VX. VF is set to 0 when there's a borrow,
+ * and 1 when there isn't. */
+static void op_8xy5(chip8_t *cpu, const instr_t *in)
+{
+	log_trace("\tSubtracts VY from VX.\n");
+	uint8_t no_borrow = cpu->V[in->x] >= cpu->V[in->y];
 
-			// Move to the next instruction
-			cpu->pc += 2;
+	cpu->V[in->x] -= cpu->V[in->y];
+	cpu->V[0xF] = no_borrow;
+	cpu->pc += 2;
+}
+
+/* 8XY6: Shifts VX (VY on the VIP) right by one into VX. VF is set to the
+ * bit shifted out. */
+static inline void quirk_8xy6(chip8_t *cpu, const instr_t *in, const int profile)
+{
+	log_trace("\tShifted VX right by one bit.\n");
+	uint8_t value = cpu->V[quirk_profiles[profile].shift_vy ? in->y : in->x];
+
+	cpu->V[in->x] = value >> 1;
+	cpu->V[0xF] = value & 0x1;
+	cpu->pc += 2;
+}
+
+/* 8XY7: Sets VX to VY minus VX. VF is set to 0 when there's a borrow, and
+ * 1 when there isn't. */
+static void op_8xy7(chip8_t *cpu, const instr_t *in)
+{
+	log_trace("\tSetting VX to VY - VX.\n");
+	uint8_t no_borrow = cpu->V[in->y] >= cpu->V[in->x];
+
+	cpu->V[in->x] = cpu->V[in->y] - cpu->V[in->x];
+	cpu->V[0xF] = no_borrow;
+	cpu->pc += 2;
+}
+
+/* 8XYE: Shifts VX (VY on the VIP) left by one into VX. VF is set to the
+ * bit shifted out. */
+static inline void quirk_8xye(chip8_t *cpu, const instr_t *in, const int profile)
+{
+	log_trace("\tShifted VX left by one bit.\n");
+	uint8_t value = cpu->V[quirk_profiles[profile].shift_vy ? in->y : in->x];
+
+	cpu->V[in->x] = value << 1;
+	cpu->V[0xF] = value >> 7;
+	cpu->pc += 2;
+}
+
+/* 8XYN: Everything else in the 8-family doesn't exist. */
+static void op_8xyn(chip8_t *cpu, const instr_t *in)
+{
+	log_warn("Unimplemented instruction 0x%X. Halting...\n", in->opcode);
+	cpu->halted = 1;
+}
+
+/* 9XY0: Skips the next instruction if VX doesn't equal VY. */
+static void op_9xy0(chip8_t *cpu, const instr_t *in)
+{
+	log_trace("Skips the next instruction if VX != VY.\n");
+
+	if (cpu->V[in->x] != cpu->V[in->y]) {
+		log_trace("\tSkipping.\n");
+		cpu->pc += 2;
+	}
+
+	// Move to the next instruction
+	cpu->pc += 2;
+}
+
+/* ANNN: Sets I to the address NNN. */
+static void op_annn(chip8_t *cpu, const instr_t *in)
+{
+	log_trace("Setting I to 0x%x.\n", in->nnn);
+
+	/* Set I to NNN */
+	cpu->I = in->nnn;
+
+	// Move to the next instruction
+	cpu->pc += 2;
+}
+
+/* BNNN: Jumps to the address NNN plus V0. Read as BXNN, jumping to XNN
+ * plus VX, after the VIP. */
+static inline void quirk_bnnn(chip8_t *cpu, const instr_t *in, const int profile)
+{
+	uint8_t reg = quirk_profiles[profile].jump_vx ? in->x : 0;
+
+	log_trace("Jumping to 0x%x + V[%X].\n", in->nnn, reg);
+	log_trace("\tV[%X] = %i.\n", reg, cpu->V[reg]);
+
+	cpu->pc = in->nnn + cpu->V[reg];
+}
+
+/* CXNN: Sets VX to a random number and NN. */
+static void op_cxnn(chip8_t *cpu, const instr_t *in)
+{
+	log_trace("Setting VX to a random number and NN.\n");
+
+	uint8_t rand_number = next_random(cpu) & in->nn;
+
+	cpu->V[in->x] = rand_number;
+	log_trace("RANDOM NUMBER: %x\n", rand_number);
+
+	// Move to the next instruction
+	cpu->pc += 2;
+}
+
+/* DXYN: Draw a sprite from I to position X, Y. DXY0 draws a 16x16 sprite
+ * of two bytes per row. Sprites going over the edges are clipped, or wrap
+ * around with some quirks. The geometry is fixed by the caller, so every
+ * profile gets a copy for each */
+static inline void draw_sprite(chip8_t *cpu, const instr_t *in, const int profile,
+		const int hires)
+{
+	const int width = DISPLAY_WIDTH(hires), height = DISPLAY_HEIGHT(hires);
+	const int clip = quirk_profiles[profile].clip;
+
+	/* Parse out the values that's going to be needed. The position wraps
+	 * around the screen */
+	uint8_t x = cpu->V[in->x] & (width - 1);
+	uint8_t y = cpu->V[in->y] & (height - 1);
+	int rows = in->n ? in->n : 16;
+	uint64_t collision = 0, dirty = 0;
+	int row;
+
+	PROFILE_BEGIN(start);
+
+	log_trace("Draw a sprite from I with height %i to x,y (%x,%x).\n", 
+			rows, x, y);
+
+	// Every sprite row is a byte, or two for DXY0, put it in the top of
+	// a word and shift it into place. Pixels past the right edge fall
+	// off, or are rotated around to the left.
+	for (row = 0; row < rows; row++) {
+		if (clip && y + row >= height)
 			break;
+
+		uint64_t sprite;
+		uint64_t *line = &cpu->display[((y + row) & (height - 1)) * ROW_WORDS(hires)];
+
+		if (in->n) {
+			sprite = (uint64_t)cpu->memory[(cpu->I + row) & 0xFFF] << 56;
+		} else {
+			sprite = (uint64_t)cpu->memory[(cpu->I + 2 * row) & 0xFFF] << 56
+					| (uint64_t)cpu->memory[(cpu->I + 2 * row + 1) & 0xFFF] << 48;
 		}
 
-		case 0xD000: { // DXYN: Draw a sprite from I to position X, Y
-			/* Parse out the values that's going to be needed */
-			uint16_t x = cpu->V[(opcode & 0x0F00) >> 8];
-			uint16_t y = cpu->V[(opcode & 0x00F0) >> 4];
-			uint16_t height = (opcode & 0x000F);
+		if (!hires) {
+			// A row is one word
+			if (clip)
+				sprite >>= x;
+			else
+				sprite = (sprite >> x) | (sprite << (-x & 63));
+
+			collision |= *line & sprite;
+			*line ^= sprite;
+		} else {
+			// A row is two words, the sprite goes into the one x is in
+			// and spills over into the other one
+			int word = x >> 6, shift = x & 63;
+			uint64_t spill = shift ? sprite << (64 - shift) : 0;
+
+			sprite >>= shift;
+			collision |= line[word] & sprite;
+			line[word] ^= sprite;
+
+			if (word == 0 || !clip) {
+				collision |= line[word ^ 1] & spill;
+				line[word ^ 1] ^= spill;
+			}
+		}
+
+		dirty |= 1ULL << ((y + row) & (height - 1));
+	}
+
+	// V[0xF] is set if any pixel was turned off
+	cpu->V[0xF] = collision != 0;
+	cpu->dirty |= dirty;
 
-			printf("Draw a sprite from I with height %i to x,y (%x,%x).\n", 
-					height, x, y);
+	PROFILE_END(PROFILE_DXYN, start);
 
-			// Reset the V[0xF] bit
-			cpu->V[0xF] = 0x0;
+	// Move to the next instruction
+	cpu->pc += 2;
+}
 
-			int _y, _x;
+static inline void quirk_dxyn(chip8_t *cpu, const instr_t *in, const int profile)
+{
+	draw_sprite(cpu, in, profile, LORES);
+}
 
-			// For each row in the sprite
-			for (_y = 0; _y < height; _y++) {
-				uint8_t line = cpu->memory[cpu->I + _y];
-				
-				// For each pixel
-				for (_x = 0; _x < 8; _x++) {
-					uint8_t pixel = line & (0x80 >> _x);
-					uint32_t display_index = (64 * (_y + y)) + (x + _x);
+static inline void quirk_dxyn_hires(chip8_t *cpu, const instr_t *in, const int profile)
+{
+	draw_sprite(cpu, in, profile, HIRES);
+}
 
-					printf("%c", pixel ? 'x' : ' ');
+/* The keys as the cpu sees them right now, set_key() changes them from
+ * other threads */
+static inline uint16_t read_keys(chip8_t *cpu)
+{
+	return __atomic_load_n(&cpu->keys, __ATOMIC_ACQUIRE);
+}
 
-					if (pixel != 0) {
-						if (cpu->display[display_index] == 1) {
-							cpu->V[0xF] = 1;
-						}
+/* EX9E: Skips the next instruction if the key in VX is pressed. */
+static void op_ex9e(chip8_t *cpu, const instr_t *in)
+{
+	log_trace("Skips the next instruction if the key in VX is pressed.\n");
 
-						cpu->display[display_index] ^= 1;
-					}
-				}
+	if (read_keys(cpu) & (1 << (cpu->V[in->x] & 0xF))) {
+		log_trace("\tSkipping.\n");
+		cpu->pc += 2;
+	}
 
-				printf("\n");
-			}
+	// Move to the next instruction
+	cpu->pc += 2;
+}
 
-			// 1xxxxxxx = 0x80
-			// x1xxxxxx = 0x40
-			// xx1xxxxx = 0x20
-			// xxx1xxxx = 0x10
+/* EXA1: Skips the next instruction if the key in VX isn't pressed. */
+static void op_exa1(chip8_t *cpu, const instr_t *in)
+{
+	log_trace("Skips the next instruction if the key in VX isn't pressed.\n");
 
-			cpu->drawFlag = 1;
+	if (!(read_keys(cpu) & (1 << (cpu->V[in->x] & 0xF)))) {
+		log_trace("\tSkipping.\n");
+		cpu->pc += 2;
+	}
 
-			// Move to the next instruction
-			cpu->pc += 2;
+	// Move to the next instruction
+	cpu->pc += 2;
+}
+
+/* EXNN: Everything else in the E-family doesn't exist. */
+static void op_exnn(chip8_t *cpu, const instr_t *in)
+{
+	log_trace("Entering multivalued instruction with 0x%x\n\t", in->opcode);
+	log_warn("Unimplemented instruction 0x%X. Halting...\n", in->opcode);
+	cpu->halted = 1;
+}
+
+/* Called after the FX07 of a poll of the delay timer:
+ *
+ *   loop: FX07        loop: FX07
+ *         3XNN              4XNN
+ *         1NNN loop         1NNN loop
+ *
+ * The timer only changes at known cycles, so work out when the poll will
+ * see the value it waits for and skip straight to the FX07 which does, or
+ * to the end of the budget if that comes first. Registers and PC end up
+ * as if every instruction in between had run */
+static void skip_idle(chip8_t *cpu, const instr_t *in)
+{
+	uint16_t loop = cpu->pc - 2;
+
+	if (cpu->budget_end <= cpu->cycles || cpu->trace
+			|| (loop & 1) || loop > 0xFFA)
+		return;
+
+	const instr_t *skip = in + 1, *jump = in + 2;
+
+	// The decoded entries are only right for instructions at even
+	// addresses, and in is the one at the loop. Their handlers may be
+	// fused ones, so go by the opcodes.
+	if (in != &cpu->decoded[loop >> 1]
+			|| skip->handler == op_undecoded || jump->handler == op_undecoded
+			|| skip->x != in->x || (jump->opcode & 0xF000) != 0x1000
+			|| jump->nnn != loop)
+		return;
+
+	uint8_t seen = cpu->V[in->x];
+	uint64_t now = timer_ticks(cpu, cpu->cycles);
+	uint64_t end = cpu->budget_end, ends = 0;
+
+	// The first tick at which the poll ends, 0 if it never does
+	if ((skip->opcode & 0xF000) == 0x3000 && seen != skip->nn) {
+		if (skip->nn < seen)
+			ends = now + (seen - skip->nn);
+	} else if ((skip->opcode & 0xF000) == 0x4000 && seen == skip->nn) {
+		if (seen > 0)
+			ends = now + 1;
+	} else {
+		return;
+	}
+
+	// Stop right before the first FX07 which sees that tick. FX07 runs
+	// as every third instruction from this one.
+	if (ends) {
+		uint64_t first = ends * cpu->ips / 60 + 1;
+		uint64_t fx07 = cpu->cycles + 3 * ((first - cpu->cycles + 2) / 3);
+
+		if (fx07 - 1 < end)
+			end = fx07 - 1;
+	}
+
+	if (end <= cpu->cycles)
+		return;
+
+	// The PC is at the skip, one instruction into the loop
+	uint64_t skipped = end - cpu->cycles;
+	uint64_t last = cpu->cycles + 3 * (skipped / 3);
+
+	cpu->V[in->x] = timer_value(cpu->delayTimer, cpu->delayTick,
+			timer_ticks(cpu, last));
+	cpu->pc = loop + 2 * ((1 + skipped) % 3);
+	cpu->cycles = end;
+}
+
+/* FX07: Sets VX to the value of the delay timer. */
+static void op_fx07(chip8_t *cpu, const instr_t *in)
+{
+	log_trace("Entering multivalued instruction with 0xF%X\n\t", in->nnn);
+	log_trace("Setting VX to the value of the delay timer.\n");
+	cpu->V[in->x] = timer_value(cpu->delayTimer, cpu->delayTick,
+			timer_ticks(cpu, cpu->cycles));
+	cpu->pc += 2;
+
+	skip_idle(cpu, in);
+}
+
+/* FX0A: Waits for a key to be pressed and released, like the VIP, and
+ * stores it in VX. */
+static void op_fx0a(chip8_t *cpu, const instr_t *in)
+{
+	log_trace("Entering multivalued instruction with 0xF%X\n\t", in->nnn);
+	log_trace("Waiting for a key.\n");
+
+	uint16_t keys = read_keys(cpu);
+	uint16_t released = cpu->key_wait & ~keys;
+
+	if (released) {
+		// The lowest key if several went up at once
+		cpu->V[in->x] = __builtin_ctz(released);
+		cpu->key_wait = 0;
+		cpu->pc += 2;
+		return;
+	}
+
+	cpu->key_wait |= keys;
+
+	// Nothing changes until a key does, so like a jump to itself the rest
+	// of the budget would be spent right here. The scheduler parks the
+	// thread until a key comes, see waiting_for_key().
+	if (cpu->budget_end > cpu->cycles && !cpu->trace)
+		cpu->cycles = cpu->budget_end;
+}
+
+/* FX15: Sets the delay timer to VX. */
+static void op_fx15(chip8_t *cpu, const instr_t *in)
+{
+	log_trace("Entering multivalued instruction with 0xF%X\n\t", in->nnn);
+	log_trace("Setting delay timer to VX.\n");
+	cpu->delayTimer = cpu->V[in->x];
+	cpu->delayTick = timer_ticks(cpu, cpu->cycles);
+	cpu->pc += 2;
+}
+
+/* FX18: Sets the sound timer to VX. */
+static void op_fx18(chip8_t *cpu, const instr_t *in)
+{
+	log_trace("Entering multivalued instruction with 0xF%X\n\t", in->nnn);
+	log_trace("Setting sound timer to VX.\n");
+	cpu->soundTimer = cpu->V[in->x];
+	cpu->soundTick = timer_ticks(cpu, cpu->cycles);
+	cpu->pc += 2;
+}
+
+/* FX1E: Adds VX to I. (If overflow, set VF) */
+static void op_fx1e(chip8_t *cpu, const instr_t *in)
+{
+	log_trace("Entering multivalued instruction with 0xF%X\n\t", in->nnn);
+	log_trace("Adding VX to I.\n");
+
+	/* If it overflows we need to set the carry flag */
+	/* NOTE: Kinda cool that the compiler complained when tried
+	 * using a uint8_t since that always will be false */
+	uint16_t _i = cpu->I + cpu->V[in->x];
+	if (_i > 0xFFF) {
+		log_trace("Overflow: Setting carry flag\n\t");
+		cpu->V[0xF] = 1;
+	}
+
+	/* Do the addition */
+	cpu->I = _i;
+	cpu->pc += 2;
+}
+
+/* FX29: Sets I to the location of the sprite for the character in VX.
+ * Characters 0-F (in hexadecimal) are represented by a 4x5 font. */
+static void op_fx29(chip8_t *cpu, const instr_t *in)
+{
+	log_trace("Entering multivalued instruction with 0xF%X\n\t", in->nnn);
+	log_trace("Setting I to the location of char %x.\n", in->x);
+
+	// One character takes up 5 bytes
+	cpu->I = (cpu->V[in->x] * 5);
+	cpu->pc += 2;
+}
+
+/* FX30: Sets I to the location of the large sprite for the digit in VX.
+ * Digits 0-9 are represented by an 8x10 font. */
+static void op_fx30(chip8_t *cpu, const instr_t *in)
+{
+	log_trace("Setting I to the location of large digit %x.\n", cpu->V[in->x]);
+
+	// One digit takes up 10 bytes
+	cpu->I = BIG_FONT_START + (cpu->V[in->x] & 0xF) * 10;
+	cpu->pc += 2;
+}
+
+/* FX33: Store a binary coded representation of VX with the three most
+ * significant digits at I. Meaning that the number 156 would be placed as
+ * I[0] = 1, I[1] = 5, I[2] = 6 */
+static void op_fx33(chip8_t *cpu, const instr_t *in)
+{
+	log_trace("Entering multivalued instruction with 0xF%X\n\t", in->nnn);
+	log_trace("Storing a binary-coded representation of VX at I. (skipped)\n"); 
+	log_trace("\tVX = %i\n", cpu->V[in->x]);
+	uint8_t hundreds, tens, ones;
+	hundreds = tens = ones = 0;
+
+	// Calculate the new value
+	hundreds = cpu->V[in->x] / 100;
+	tens = (cpu->V[in->x] / 10) - (hundreds * 10);
+	ones = cpu->V[in->x] % 10;
+	
+	log_trace("Hundreds: %i\n", hundreds);
+	log_trace("Tens: %i\n", tens);
+	log_trace("Ones: %i\n", ones);
+
+	if (check_memory(cpu, in, 3) != 0)
+		return;
+
+	// Set them at I
+	cpu->memory[cpu->I] = hundreds;
+	cpu->memory[cpu->I + 1] = tens;
+	cpu->memory[cpu->I + 2] = ones;
+	wrote_memory(cpu, cpu->I, 3);
+
+	cpu->pc += 2;
+}
+
+/* Move I past registers stored or loaded by FX55 or FX65, as far as the
+ * profile does */
+static inline void step_index(chip8_t *cpu, const instr_t *in, const int profile)
+{
+	if (quirk_profiles[profile].index == INDEX_X1)
+		cpu->I += in->x + 1;
+	else if (quirk_profiles[profile].index == INDEX_X)
+		cpu->I += in->x;
+}
+
+/* FX55: Stores V0 to VX in memory starting at address I. */
+static inline void quirk_fx55(chip8_t *cpu, const instr_t *in, const int profile)
+{
+	log_trace("Entering multivalued instruction with 0xF%X\n\t", in->nnn);
+	log_trace("Stores V0...VX in memory at I.\n");
+
+	if (check_memory(cpu, in, in->x + 1) != 0)
+		return;
+
+	memcpy(&cpu->memory[cpu->I], cpu->V, in->x + 1);
+	wrote_memory(cpu, cpu->I, in->x + 1);
+	step_index(cpu, in, profile);
+
+	cpu->pc += 2;
+}
+
+/* FX65: Fills V0 to VX with values from memory starting at address I. */
+static inline void quirk_fx65(chip8_t *cpu, const instr_t *in, const int profile)
+{
+	log_trace("Entering multivalued instruction with 0xF%X\n\t", in->nnn);
+	log_trace("Stores values from I in V0...VX.\n");
+
+	if (check_memory(cpu, in, in->x + 1) != 0)
+		return;
+
+	memcpy(cpu->V, &cpu->memory[cpu->I], in->x + 1);
+	step_index(cpu, in, profile);
+
+	cpu->pc += 2;
+}
+
+/* FX75: Stores V0 to VX in the user flags. */
+static void op_fx75(chip8_t *cpu, const instr_t *in)
+{
+	log_trace("Storing V0...VX in the user flags.\n");
+
+	memcpy(cpu->flags, cpu->V, in->x + 1);
+	cpu->pc += 2;
+}
+
+/* FX85: Fills V0 to VX with the user flags. */
+static void op_fx85(chip8_t *cpu, const instr_t *in)
+{
+	log_trace("Filling V0...VX from the user flags.\n");
+
+	memcpy(cpu->V, cpu->flags, in->x + 1);
+	cpu->pc += 2;
+}
+
+/* FXNN: Everything else in the F-family. */
+static void op_fxnn(chip8_t *cpu, const instr_t *in)
+{
+	log_trace("Entering multivalued instruction with 0xF%X\n\t", in->nnn);
+	log_warn("Unimplemented instruction 0x%X. Halting...\n", in->opcode);
+	cpu->halted = 1;
+}
+
+/* The handlers which differ between quirk profiles */
+typedef struct {
+	handler_t op_8xy1, op_8xy2, op_8xy3, op_8xy6, op_8xye;
+	handler_t op_bnnn, op_dxyn, op_dxyn_hires, op_fx55, op_fx65;
+} quirk_handlers_t;
+
+/* Make the handlers of a profile. Every one is a copy of the generic
+ * handler with the profile's quirks fixed, so they cost nothing at run
+ * time, and decode() picks the copies of the machine's profile */
+#define QUIRK_HANDLER(op, name, profile) \
+	static void op_##op##_##name(chip8_t *cpu, const instr_t *in) \
+	{ \
+		quirk_##op(cpu, in, profile); \
+	}
+
+#define QUIRK_HANDLERS(name, profile) \
+	QUIRK_HANDLER(8xy1, name, profile) \
+	QUIRK_HANDLER(8xy2, name, profile) \
+	QUIRK_HANDLER(8xy3, name, profile) \
+	QUIRK_HANDLER(8xy6, name, profile) \
+	QUIRK_HANDLER(8xye, name, profile) \
+	QUIRK_HANDLER(bnnn, name, profile) \
+	QUIRK_HANDLER(dxyn, name, profile) \
+	QUIRK_HANDLER(dxyn_hires, name, profile) \
+	QUIRK_HANDLER(fx55, name, profile) \
+	QUIRK_HANDLER(fx65, name, profile) \
+	static const quirk_handlers_t name##_handlers = { \
+		op_8xy1_##name, op_8xy2_##name, op_8xy3_##name, \
+		op_8xy6_##name, op_8xye_##name, op_bnnn_##name, \
+		op_dxyn_##name, op_dxyn_hires_##name, op_fx55_##name, op_fx65_##name \
+	};
+
+QUIRK_HANDLERS(vip, QUIRKS_VIP)
+QUIRK_HANDLERS(chip48, QUIRKS_CHIP48)
+QUIRK_HANDLERS(schip, QUIRKS_SCHIP)
+QUIRK_HANDLERS(xochip, QUIRKS_XOCHIP)
+
+static const quirk_handlers_t *quirk_handlers[QUIRKS_COUNT] = {
+	&vip_handlers, &chip48_handlers, &schip_handlers, &xochip_handlers
+};
+
+/* Pick the handler for the opcode and extract the operands. Quirks and
+ * the display geometry are settled here, by picking the handlers of the
+ * profile and geometry */
+static void decode(uint16_t opcode, int profile, int hires, instr_t *in)
+{
+	const quirk_handlers_t *quirks = quirk_handlers[profile];
+
+	in->opcode = opcode;
+	in->nnn = opcode & 0x0FFF;
+	in->x = (opcode & 0x0F00) >> 8;
+	in->y = (opcode & 0x00F0) >> 4;
+	in->n = opcode & 0x000F;
+	in->nn = opcode & 0x00FF;
+
+	switch (opcode & 0xF000) 
+	{
+		case 0x0000: {
+			if (opcode == 0x00E0)
+				in->handler = op_00e0;
+			else if (opcode == 0x00EE)
+				in->handler = op_00ee;
+			else if ((opcode & 0xFFF0) == 0x00C0)
+				in->handler = hires ? op_00cn_hires : op_00cn_lores;
+			else if (opcode == 0x00FB)
+				in->handler = hires ? op_00fb_hires : op_00fb_lores;
+			else if (opcode == 0x00FC)
+				in->handler = hires ? op_00fc_hires : op_00fc_lores;
+			else if (opcode == 0x00FD)
+				in->handler = op_00fd;
+			else if (opcode == 0x00FE)
+				in->handler = op_00fe;
+			else if (opcode == 0x00FF)
+				in->handler = op_00ff;
+			else
+				in->handler = op_0nnn;
 			break;
 		}
 
-		case 0xE000: { // Multivalued instruction
-			printf("Entering multivalued instruction with 0x%x\n\t", opcode);
-			uint16_t _x = (opcode & 0x0F00) >> 8;
-
-			switch (opcode & 0x00FF) {
-
-				// EX9E: Skips the next instruction if the key stored in VX is pressed.
-				/*case 0x9E: {
-					printf("Skipping next instruction if key is pressed (skipping).\n");
-					break;
-				}
-				
-				// EXA1: Skips the next instruction if the key stored in VX isn't pressed.
-				case 0xA1: { 
-					printf("Skipping next instruction if key isn't pressed. (skipping)\n");
-					break;
-				}*/
-
-				default: {
-					printf("Unimplemented instruction 0x00%X. \
-							Exiting...\n", (opcode & 0x00FF));
-					exit(1);
-				}
-			}
+		case 0x1000: in->handler = op_1nnn; break;
+		case 0x2000: in->handler = op_2nnn; break;
+		case 0x3000: in->handler = op_3xnn; break;
+		case 0x4000: in->handler = op_4xnn; break;
+		case 0x5000: in->handler = op_5xy0; break;
+		case 0x6000: in->handler = op_6xnn; break;
+		case 0x7000: in->handler = op_7xnn; break;
 
-			// Every instruction in this will not modify the pc in any way
-			cpu->pc += 2;
+		case 0x8000: {
+			switch (in->n)
+			{
+				case 0x0: in->handler = op_8xy0; break;
+				case 0x1: in->handler = quirks->op_8xy1; break;
+				case 0x2: in->handler = quirks->op_8xy2; break;
+				case 0x3: in->handler = quirks->op_8xy3; break;
+				case 0x4: in->handler = op_8xy4; break;
+				case 0x5: in->handler = op_8xy5; break;
+				case 0x6: in->handler = quirks->op_8xy6; break;
+				case 0x7: in->handler = op_8xy7; break;
+				case 0xE: in->handler = quirks->op_8xye; break;
+				default: in->handler = op_8xyn; break;
+			}
 			break;
 		}
-		
-		case 0xF000: { // Multivalued instruction
-			printf("Entering multivalued instruction with 0xF%X\n\t", (opcode & 0x0FFF));
-			uint16_t _x = (opcode & 0x0F00) >> 8;
 
-			switch (opcode & 0x00FF) 
+		case 0x9000: in->handler = op_9xy0; break;
+		case 0xA000: in->handler = op_annn; break;
+		case 0xB000: in->handler = quirks->op_bnnn; break;
+		case 0xC000: in->handler = op_cxnn; break;
+		case 0xD000:
+			in->handler = hires ? quirks->op_dxyn_hires : quirks->op_dxyn;
+			break;
+
+		case 0xE000: {
+			switch (in->nn)
 			{
-				// FX07: Sets VX to the value of the delay timer.
-				case 0x07: {
-					printf("Setting VX to the value of the delay timer.\n");
-					cpu->V[_x] = cpu->delayTimer;
-					break;
-				}
-
-				case 0x15: { // FX15: Sets the delay timer to VX.
-					printf("Setting delay timer to VX.\n");
-					cpu->delayTimer = cpu->V[_x];
-					break;
-				}
-
-				case 0x18: { // FX18: Sets the sound timer to VX.
-					printf("Setting sound timer to VX.\n");
-					cpu->soundTimer = cpu->V[_x];
-					break;
-				}
-
-				case 0x1E: { // FX1E Adds VX to I. (If overflow, set VF)
-					printf("Adding VX to I.\n");
-
-					/* If it overflows we need to set the carry flag */
-					/* NOTE: Kinda cool that the compiler complained when tried
-					 * using a uint8_t since that always will be false */
-					uint16_t _i = cpu->I + cpu->V[_x];
-					if (_i > 0xFFF) {
-						printf("Overflow: Setting carry flag\n\t");
-						cpu->V[0xF] = 1;
-					}
-
-					/* Do the addition */
-					cpu->I += _i;
-					break;
-				}
-
-				// FX29: Sets I to the location of the sprite for the character in VX. 
-				// Characters 0-F (in hexadecimal) are represented by a 4x5 font.
-				case 0x29: {
-					printf("Setting I to the location of char %x.\n", _x);
-
-					// One character takes up 5 bytes
-					cpu->I = (cpu->V[_x] * 5);
-					break;
-				}
-
-				// FX33: Store a binary coded representation of VX with the three most 
-				// significant digits at I. Meaning that the number 156 would be placed as
-				// I[0] = 1, I[1] = 5, I[2] = 6
-				case 0x33: {
-					printf("Storing a binary-coded representation of VX at I. (skipped)\n"); 
-					printf("\tVX = %i\n", cpu->V[_x]);
-					uint8_t hundreds, tens, ones;
-					hundreds = tens = ones = 0;
-
-					// Calculate the new value
-					hundreds = cpu->V[_x] / 100;
-					tens = (cpu->V[_x] / 10) - (hundreds * 10);
-					ones = cpu->V[_x] % 10;
-					
-					printf("Hundreds: %i\n", hundreds);
-					printf("Tens: %i\n", tens);
-					printf("Ones: %i\n", ones);
-
-					// Set them at I
-					cpu->memory[cpu->I] = hundreds;
-					cpu->memory[cpu->I + 1] = tens;
-					cpu->memory[cpu->I + 2] = ones;
-					break;
-				}
-
-				// FX55: Stores V0 to VX in memory starting at address I.
-				case 0x55: {
-					printf("Stores V0...VX in memory at I.\n");
-
-					uint16_t _x = (opcode & 0x0F00) >> 8;
-					memcpy(&cpu->memory[cpu->I], cpu->V, _x);
-					break;
-				}
-				
-				// FX65: Fills V0 to VX with values from memory starting at address I.
-				case 0x65: {
-					printf("Stores values from I in V0...VX.\n");
-
-					uint16_t _x = (opcode & 0x0F00) >> 8;
-					memcpy(cpu->V, &cpu->memory[cpu->I], _x);
-					break;
-				}
-
-				default: {
-					printf("Unimplemented instruction 0x00%x. \
-							Exiting...\n", (opcode & 0x00FF));
-					exit(1);
-				}
+				case 0x9E: in->handler = op_ex9e; break;
+				case 0xA1: in->handler = op_exa1; break;
+				default: in->handler = op_exnn; break;
 			}
-			
-			// Every instruction in this will not modify the pc in any way
-			cpu->pc += 2;
 			break;
 		}
 
-		default: {
-			printf("Unimplemented instruction: 0x%X. Exiting...\n", opcode);
-			exit(1);
+		case 0xF000: {
+			switch (in->nn)
+			{
+				case 0x07: in->handler = op_fx07; break;
+				case 0x0A: in->handler = op_fx0a; break;
+				case 0x15: in->handler = op_fx15; break;
+				case 0x18: in->handler = op_fx18; break;
+				case 0x1E: in->handler = op_fx1e; break;
+				case 0x29: in->handler = op_fx29; break;
+				case 0x30: in->handler = op_fx30; break;
+				case 0x33: in->handler = op_fx33; break;
+				case 0x55: in->handler = quirks->op_fx55; break;
+				case 0x65: in->handler = quirks->op_fx65; break;
+				case 0x75: in->handler = op_fx75; break;
+				case 0x85: in->handler = op_fx85; break;
+				default: in->handler = op_fxnn; break;
+			}
 			break;
 		}
 	}
 }
 
-/* Tick the timers on the cpu */
-void tick(chip8_t *cpu)
+/* Fetch the opcode at addr. Reads wrap around at the end of the memory. */
+static uint16_t fetch(chip8_t *cpu, uint16_t addr)
+{
+	/* Read the first 8 bits, shift them up and OR with the other 8 bits */
+	return (cpu->memory[addr & 0xFFF] << 8) | cpu->memory[(addr + 1) & 0xFFF];
+}
+
+// Profiles count every instruction in step(), so nothing is fused
+#ifndef CHIP8_PROFILE
+
+/* The DXYN handler of the machine's profile and geometry */
+static inline handler_t dxyn_handler(chip8_t *cpu)
 {
-	// Count down the timers
-	if (cpu->soundTimer > 0)
-		cpu->soundTimer -= 1;
+	const quirk_handlers_t *quirks = quirk_handlers[cpu->quirks];
 
-	if (cpu->soundTimer > 0)
-		cpu->delayTimer -= 1;
+	return cpu->hires ? quirks->op_dxyn_hires : quirks->op_dxyn;
 }
 
-void unset_drawFlag(chip8_t *cpu)
+/* Go on to instruction i of the fused sequence at pc if run_cycles()
+ * would have run it next, counting it like step() does. Returns 0 if the
+ * sequence ends here. */
+static inline int fused_next(chip8_t *cpu, uint16_t pc, const instr_t *in, int i)
 {
-	cpu->drawFlag = 0;
+	// Outside of run_cycles() budget_end is 0, so step() runs one
+	// instruction at a time there
+	if (cpu->pc != (uint16_t)(pc + 2 * i) || cpu->cycles >= cpu->budget_end
+			|| cpu->halted || cpu->trace)
+		return 0;
+
+	cpu->cycles++;
+	log_trace("0x%X: ", in[i].opcode);
+	return 1;
 }
 
-/* Return the display matrix */
-uint8_t *get_display(chip8_t *cpu)
+/* 6XNN 6XNN ANNN DXYN: Sets up the position and address of a sprite and
+ * draws it. */
+static void op_6xnn_6xnn_annn_dxyn(chip8_t *cpu, const instr_t *in)
 {
-	return cpu->display;
+	uint16_t pc = cpu->pc;
+
+	op_6xnn(cpu, in);
+	if (!fused_next(cpu, pc, in, 1))
+		return;
+
+	op_6xnn(cpu, in + 1);
+	if (!fused_next(cpu, pc, in, 2))
+		return;
+
+	op_annn(cpu, in + 2);
+	if (!fused_next(cpu, pc, in, 3))
+		return;
+
+	dxyn_handler(cpu)(cpu, in + 3);
 }
 
-/* Return and reset the drawFlag */
-uint8_t get_drawFlag(chip8_t *cpu)
+/* 7XNN 3XNN 1NNN: A counted loop. */
+static void op_7xnn_3xnn_1nnn(chip8_t *cpu, const instr_t *in)
 {
-	return cpu->drawFlag;
+	uint16_t pc = cpu->pc;
+
+	op_7xnn(cpu, in);
+	if (!fused_next(cpu, pc, in, 1))
+		return;
+
+	op_3xnn(cpu, in + 1);
+	if (!fused_next(cpu, pc, in, 2))
+		return;
+
+	op_1nnn(cpu, in + 2);
 }
 
-/* Function which steps through the program */
-void run_chip(chip8_t *cpu)
+/* 7XNN 4XNN 1NNN: A counted loop. */
+static void op_7xnn_4xnn_1nnn(chip8_t *cpu, const instr_t *in)
 {
-	for (;;) {
-		//usleep(160 * 1000);
+	uint16_t pc = cpu->pc;
+
+	op_7xnn(cpu, in);
+	if (!fused_next(cpu, pc, in, 1))
+		return;
+
+	op_4xnn(cpu, in + 1);
+	if (!fused_next(cpu, pc, in, 2))
+		return;
+
+	op_1nnn(cpu, in + 2);
+}
+
+/* FX07 3XNN 1NNN: Waits for the delay timer. FX07 may skip most of the
+ * wait, see skip_idle(), which ends the sequence. */
+static void op_fx07_3xnn_1nnn(chip8_t *cpu, const instr_t *in)
+{
+	uint16_t pc = cpu->pc;
+
+	op_fx07(cpu, in);
+	if (!fused_next(cpu, pc, in, 1))
+		return;
+
+	op_3xnn(cpu, in + 1);
+	if (!fused_next(cpu, pc, in, 2))
+		return;
+
+	op_1nnn(cpu, in + 2);
+}
+
+/* 6XNN 6XNN: Sets two registers. */
+static void op_6xnn_6xnn(chip8_t *cpu, const instr_t *in)
+{
+	uint16_t pc = cpu->pc;
+
+	op_6xnn(cpu, in);
+	if (!fused_next(cpu, pc, in, 1))
+		return;
+
+	op_6xnn(cpu, in + 1);
+}
+
+/* 3XNN 1NNN: Jumps unless VX equals NN. */
+static void op_3xnn_1nnn(chip8_t *cpu, const instr_t *in)
+{
+	uint16_t pc = cpu->pc;
+
+	op_3xnn(cpu, in);
+	if (!fused_next(cpu, pc, in, 1))
+		return;
+
+	op_1nnn(cpu, in + 1);
+}
+
+/* 4XNN 1NNN: Jumps if VX equals NN. */
+static void op_4xnn_1nnn(chip8_t *cpu, const instr_t *in)
+{
+	uint16_t pc = cpu->pc;
+
+	op_4xnn(cpu, in);
+	if (!fused_next(cpu, pc, in, 1))
+		return;
+
+	op_1nnn(cpu, in + 1);
+}
+
+/* ANNN DXYN: Draws the sprite at NNN. */
+static void op_annn_dxyn(chip8_t *cpu, const instr_t *in)
+{
+	uint16_t pc = cpu->pc;
+
+	op_annn(cpu, in);
+	if (!fused_next(cpu, pc, in, 1))
+		return;
+
+	dxyn_handler(cpu)(cpu, in + 1);
+}
+
+/* A sequence run by one fused handler. Instruction i matches when
+ * (opcode & mask[i]) == match[i]. None of them write to memory, so a
+ * sequence can't change its own code. */
+typedef struct {
+	handler_t handler;
+	int length;
+	uint16_t mask[FUSE_MAX];
+	uint16_t match[FUSE_MAX];
+} fusion_t;
+
+/* The fused sequences, the longest first. They're the hottest ones in the
+ * sequence report of the profiler (make PROFILE=1) over the programs */
+static const fusion_t fusions[] = {
+	{ op_6xnn_6xnn_annn_dxyn, 4,
+		{ 0xF000, 0xF000, 0xF000, 0xF000 }, { 0x6000, 0x6000, 0xA000, 0xD000 } },
+	{ op_7xnn_3xnn_1nnn, 3,
+		{ 0xF000, 0xF000, 0xF000 }, { 0x7000, 0x3000, 0x1000 } },
+	{ op_7xnn_4xnn_1nnn, 3,
+		{ 0xF000, 0xF000, 0xF000 }, { 0x7000, 0x4000, 0x1000 } },
+	{ op_fx07_3xnn_1nnn, 3,
+		{ 0xF0FF, 0xF000, 0xF000 }, { 0xF007, 0x3000, 0x1000 } },
+	{ op_6xnn_6xnn, 2, { 0xF000, 0xF000 }, { 0x6000, 0x6000 } },
+	{ op_3xnn_1nnn, 2, { 0xF000, 0xF000 }, { 0x3000, 0x1000 } },
+	{ op_4xnn_1nnn, 2, { 0xF000, 0xF000 }, { 0x4000, 0x1000 } },
+	{ op_annn_dxyn, 2, { 0xF000, 0xF000 }, { 0xA000, 0xD000 } },
+	{ NULL }
+};
+
+/* Fuse the decoded instruction at the PC with the ones after it if they
+ * make one of the fused sequences. Every instruction of the sequence keeps
+ * its own entry, so jumps into the middle of it run the rest one by one,
+ * and the entries after the first hold the operands. */
+static void fuse(chip8_t *cpu, instr_t *entry)
+{
+	uint16_t pc = cpu->pc & 0xFFF;
+	uint16_t opcodes[FUSE_MAX];
+	const fusion_t *f;
+	int count, i;
+
+	// Sequences never wrap around the end of the memory
+	for (count = 0; count < FUSE_MAX && pc + 2 * count < 0xFFF; count++)
+		opcodes[count] = fetch(cpu, pc + 2 * count);
+
+	for (f = fusions; f->handler; f++) {
+		if (f->length > count)
+			continue;
+
+		for (i = 0; i < f->length; i++)
+			if ((opcodes[i] & f->mask[i]) != f->match[i])
+				break;
+
+		if (i < f->length)
+			continue;
+
+		for (i = 1; i < f->length; i++)
+			if (entry[i].handler == op_undecoded)
+				decode(opcodes[i], cpu->quirks, cpu->hires, &entry[i]);
+
+		entry->handler = f->handler;
+		return;
+	}
+}
+
+#endif
+
+/* Placeholder handler for entries which haven't been decoded yet. Decodes
+ * the instruction at the PC into the cache, fusing it with the ones after
+ * it where it can, and runs it. */
+static void op_undecoded(chip8_t *cpu, const instr_t *in)
+{
+	instr_t *entry = &cpu->decoded[(cpu->pc & 0xFFF) >> 1];
+
+	decode(fetch(cpu, cpu->pc), cpu->quirks, cpu->hires, entry);
+
+#ifndef CHIP8_PROFILE
+	fuse(cpu, entry);
+#endif
+
+	log_trace("0x%X: ", entry->opcode);
+	entry->handler(cpu, entry);
+}
+
+/* Drop the decoded instructions covering len bytes from addr */
+void invalidate_decoded(chip8_t *cpu, uint16_t addr, uint16_t len)
+{
+	if (len == 0)
+		return;
+
+	// Fused sequences are decoded at their first instruction, so the
+	// entries which may start one running into addr go as well
+	uint16_t reach = 2 * (FUSE_MAX - 1);
+	uint16_t first = ((addr - reach) & 0xFFF) >> 1;
+	uint16_t last = ((addr + len - 1) & 0xFFF) >> 1;
+
+	if (len > 4096 - reach) {
+		first = 0;
+		last = 0x7FF;
+	}
+
+	for (;; first = (first + 1) & 0x7FF) {
+		cpu->decoded[first].handler = op_undecoded;
+
+		if (first == last)
+			break;
+	}
+
+	// Translated code has to go as well
+	jit_invalidate(cpu->jit, addr, len);
+}
+
+/* Step and handle one instruction into the program */
+void step(chip8_t *cpu)
+{
+	const instr_t *in;
+	instr_t uncached;
+
+	if (cpu->trace)
+		trace_before(cpu->trace, cpu);
+
+	cpu->cycles++;
+	PROFILE_STEP(cpu->pc, fetch(cpu, cpu->pc));
+
+	/* Instructions at odd addresses aren't cached, so decode those on
+	 * the fly */
+	if (cpu->pc & 1) {
+		decode(fetch(cpu, cpu->pc), cpu->quirks, cpu->hires, &uncached);
+		in = &uncached;
+	} else {
+		in = &cpu->decoded[(cpu->pc & 0xFFF) >> 1];
+	}
+
+	/* Run the decoded instruction. The opcode is printed here so the
+	 * trace looks the same as before, undecoded entries print their own */
+	if (in->handler != op_undecoded)
+		log_trace("0x%X: ", in->opcode);
+
+	in->handler(cpu, in);
+
+	if (cpu->trace)
+		trace_after(cpu->trace, cpu);
+}
+
+/* Publish the display to the frame buffer and stream if it changed since
+ * the last published frame */
+void publish_frame(chip8_t *cpu)
+{
+	if ((!cpu->frames && !cpu->stream) || !cpu->dirty)
+		return;
+
+	// Only the words in use, a low resolution frame is a quarter of the
+	// display
+	if (cpu->frames) {
+		frame_t *frame = frame_back(cpu->frames);
+		memcpy(frame->rows, cpu->display, DISPLAY_WORDS(cpu->hires) * sizeof(uint64_t));
+		frame->hires = cpu->hires;
+		frame_publish(cpu->frames);
+	}
+
+	if (cpu->stream)
+		stream_publish(cpu->stream, cpu->display, cpu->hires);
+
+	cpu->dirty = 0;
+}
+
+/* Run up to n instructions, stopping early if the cpu halts. Returns the
+ * number of instructions run */
+uint64_t run_cycles(chip8_t *cpu, uint64_t n)
+{
+	uint64_t start = cpu->cycles;
+	uint64_t end = start + n;
+
+	// Lets busy waits skip to the end, see skip_idle()
+	cpu->budget_end = end;
+
+	while (cpu->cycles < end && !cpu->halted) {
+		// Prefer translated code, and interpret whatever isn't. Traces
+		// and profiles need every instruction to go through step().
+#ifndef CHIP8_PROFILE
+		if (cpu->jit && !cpu->trace && jit_run(cpu, end - cpu->cycles))
+			continue;
+#endif
+
 		step(cpu);
 	}
+
+	cpu->budget_end = 0;
+	return cpu->cycles - start;
+}
+
+/* Run the instructions of one 60 Hz frame, then tick the timers, capture
+ * and publish the display */
+void run_frame(chip8_t *cpu)
+{
+	// Frames end on whole instructions, spreading any remainder of
+	// ips / 60 evenly over the frames
+	uint64_t end = (cpu->frame + 1) * cpu->ips / 60;
+
+	if (end > cpu->cycles)
+		run_cycles(cpu, end - cpu->cycles);
+
+	if (cpu->halted)
+		return;
+
+	cpu->frame++;
+
+	if (cpu->capture)
+		capture_frame(cpu->capture, cpu);
+
+	publish_frame(cpu);
+}
+
+/* Press (down set) or release one of the keys 0x0-0xF. Safe to call from
+ * any thread while the cpu runs */
+void set_key(chip8_t *cpu, int key, int down)
+{
+	uint16_t bit = 1 << (key & 0xF);
+
+	if (down)
+		__atomic_fetch_or(&cpu->keys, bit, __ATOMIC_RELEASE);
+	else
+		__atomic_fetch_and(&cpu->keys, ~bit, __ATOMIC_RELEASE);
+}
+
+/* True if the cpu is stuck at an FX0A until a key is pressed or released */
+int waiting_for_key(chip8_t *cpu)
+{
+	uint16_t keys = read_keys(cpu);
+
+	// A key seen down which went up since ends the wait at once
+	return !cpu->halted && (fetch(cpu, cpu->pc) & 0xF0FF) == 0xF00A
+			&& !(cpu->key_wait & ~keys);
+}
+
+/* Let n frames pass on a cpu which waited for a key through them, the same
+ * as running them */
+void wait_frames(chip8_t *cpu, uint64_t n)
+{
+	// FX0A would have run over and over, only noting the keys held. The
+	// key which ended the wait may be up already, the frames passed all
+	// the same.
+	cpu->key_wait |= read_keys(cpu);
+	cpu->frame += n;
+	cpu->cycles = cpu->frame * cpu->ips / 60;
+}
+
+/* Hash the display, used to compare the output of two runs */
+uint64_t display_hash(chip8_t *cpu)
+{
+	// 64-bit FNV-1a, over the words in use so a low resolution display
+	// hashes the same as it always has
+	uint64_t hash = 0xCBF29CE484222325ULL;
+	int i;
+
+	for (i = 0; i < DISPLAY_WORDS(cpu->hires) * 8; i++) {
+		hash ^= (cpu->display[i / 8] >> (56 - 8 * (i % 8))) & 0xFF;
+		hash *= 0x100000001B3ULL;
+	}
+
+	return hash;
+}
+
+/* Function which steps through the program as fast as possible */
+void run_chip(chip8_t *cpu)
+{
+	while (!cpu->halted)
+		run_frame(cpu);
 }
@@ -7,6 +7,16 @@
 #include <unistd.h>
 
 #include <string.h>
+#include <stddef.h>
+
+#include "frame.h"
+#include "logger.h"
+
+/* Traces, save files, captures, ROM packs and the display stream are
+ * written straight from the structs and integers in memory, with no byte
+ * swapping. Their formats are all little endian, so the host has to be */
+_Static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__,
+		"the file and stream formats need a little endian host");
 
 /* Fontset in bytes */
 /*{ 
@@ -35,53 +45,218 @@
  * 1010 1100
  */
 
-/* Define a struct that contains the emulator variables */
+/* Instructions run per second unless configured otherwise */
+#define DEFAULT_IPS 600
+
+/* Where programs are loaded, and the most they can take up */
+#define PROGRAM_START 0x200
+#define PROGRAM_SIZE (4096 - PROGRAM_START)
+
+/* Display geometries. The display is kept as words of 64 pixels, the
+ * leftmost pixel in the most significant bit, a row after the other */
+#define LORES 0 // 64x32, CHIP-8
+#define HIRES 1 // 128x64, the SUPER-CHIP high resolution mode
+#define DISPLAY_WIDTH(hires) (64 << (hires))
+#define DISPLAY_HEIGHT(hires) (32 << (hires))
+#define ROW_WORDS(hires) (1 << (hires))
+#define DISPLAY_WORDS(hires) (32 << 2 * (hires))
+
+/* Seed of the random number generator unless configured otherwise */
+#define DEFAULT_SEED 0
+
+/* Quirk profiles, the behaviours of the CHIP-8 variants where they
+ * disagree. Pick one with set_quirks() */
+#define QUIRKS_VIP 0 // The original COSMAC VIP interpreter
+#define QUIRKS_CHIP48 1 // CHIP-48 on the HP-48
+#define QUIRKS_SCHIP 2 // SUPER-CHIP 1.1
+#define QUIRKS_XOCHIP 3 // The quirks of XO-CHIP, not its extra instructions
+#define QUIRKS_COUNT 4
+
+/* Quirk profile unless configured otherwise */
+#define DEFAULT_QUIRKS QUIRKS_VIP
+
+/* How FX55 and FX65 leave I */
+#define INDEX_KEEP 0 // Unchanged
+#define INDEX_X 1 // Moved forward by X
+#define INDEX_X1 2 // Moved forward by X + 1, past the last register
+
+/* What a quirk profile does */
 typedef struct {
-	uint8_t *memory; // RAM for the machine
-	uint8_t *V; // Data registers
-	uint16_t I; // Points to a specific point in the memory
+	const char *name;
+	uint8_t vf_reset; // 8XY1, 8XY2 and 8XY3 clear VF
+	uint8_t shift_vy; // 8XY6 and 8XYE shift VY into VX, not VX itself
+	uint8_t index; // INDEX_*
+	uint8_t jump_vx; // BXNN jumps to XNN + VX, not to NNN + V0
+	uint8_t clip; // Sprites are clipped at the edges, not wrapped
+} quirks_t;
+
+/* The profiles, indexed by QUIRKS_* */
+extern const quirks_t quirk_profiles[QUIRKS_COUNT];
 
-	uint16_t *stack; // The stack (16 levels deep)
+/* Forward declare the machine so decoded instructions can refer to it */
+typedef struct chip8_s chip8_t;
+typedef struct instr_s instr_t;
+typedef struct jit_s jit_t;
+typedef struct trace_s trace_t;
+typedef struct capture_s capture_t;
+typedef struct stream_s stream_t;
 
-	// The screen matris
-	uint8_t *display; // The screen matris
+/* A function which executes one decoded instruction */
+typedef void (*handler_t)(chip8_t *, const instr_t *);
 
-	// The keys 0x0-0xF
+/* An instruction decoded once, with the operands already masked out */
+struct instr_s {
+	handler_t handler; // The function which executes the instruction
+	uint16_t opcode; // The raw opcode
+	uint16_t nnn; // Lowest 12 bits
+	uint8_t x; // Lower 4 bits of the high byte
+	uint8_t y; // Upper 4 bits of the low byte
+	uint8_t n; // Lowest 4 bits
+	uint8_t nn; // Lowest 8 bits
+};
+
+/* Define a struct that contains the emulator variables. Everything lives
+ * inline in one cache line aligned block, so a machine is a single
+ * allocation and a reset is a single copy of the boot image */
+struct chip8_s {
+	// Registers first, they're touched by every instruction
+	uint8_t V[16]; // Data registers
+	uint16_t I; // Points to a specific point in the memory
+	uint16_t pc; // The PC
+	uint8_t stackPointer; // The stack pointer
+	uint8_t halted; // Set when an unimplemented instruction is hit
+	uint8_t quirks; // Quirk profile, QUIRKS_*
+	uint8_t hires; // Display geometry, LORES or HIRES
+
+	// The keys 0x0-0xF, a bit each. Other threads change them with
+	// set_key() while the cpu runs.
 	uint16_t keys;
+	uint16_t key_wait; // Keys seen down by an FX0A waiting for a release
 
-	// Timers
+	// Timers, as they were last set. They count down at 60 Hz from the
+	// tick they were set at, see timer_ticks()
 	uint16_t soundTimer;
 	uint16_t delayTimer;
-	
-	uint8_t drawFlag;
-	uint8_t stackPointer; // The stack pointer
-	uint16_t pc; // The PC
-} chip8_t;
 
-/* A function which initializes all values for the cpu */
+	uint64_t dirty; // Rows changed since the last published frame
+	uint32_t ips; // Instructions run per second of emulated time
+	uint64_t cycles; // Number of instructions run
+	uint64_t frame; // Number of 60 Hz frames run
+	uint64_t random; // State of the random number generator used by CXNN
+	uint64_t budget_end; // Cycle the running budget ends at, 0 outside run_cycles()
+	uint64_t soundTick; // Timer tick the sound timer was set at
+	uint64_t delayTick; // Timer tick the delay timer was set at
+
+	uint16_t stack[16]; // The stack (16 levels deep)
+	uint8_t flags[16]; // SUPER-CHIP user flags, FX75 and FX85
+
+	// The screen matris, ROW_WORDS() words per row, see LORES and HIRES.
+	// Only the first DISPLAY_WORDS() are in use.
+	uint64_t display[DISPLAY_WORDS(HIRES)];
+
+	uint8_t memory[4096]; // RAM for the machine
+
+	// Decoded instructions, one for every even address in the memory. An
+	// entry may run a fused sequence of the instructions after it too.
+	instr_t decoded[2048];
+
+	// Attachments, everything from here on survives a reset
+
+	// Translated native code, NULL when only interpreting
+	jit_t *jit;
+
+	// Where finished frames are published for the UI, NULL if headless
+	frame_buffer_t *frames;
+
+	// Where finished frames are streamed to subscribers, NULL if not
+	// serving. Owned by whoever set it, like frames.
+	stream_t *stream;
+
+	// Binary execution trace, NULL when not tracing
+	trace_t *trace;
+
+	// Recording of every frame, NULL when not capturing
+	capture_t *capture;
+} __attribute__((aligned(64)));
+
+/* Bytes of the machine which are reset, everything before the attachments */
+#define CHIP8_STATE_SIZE offsetof(chip8_t, jit)
+
+/* Allocate and initialize a machine, free it with free_chip() */
+chip8_t *chip8_new(void);
+
+/* A function which initializes all values for the cpu, without any
+ * attachments */
 void init_chip(chip8_t *);
 
-/* Free all resources for the cpu */
+/* Put the cpu back in its power on state, keeping the attachments */
+void reset_chip(chip8_t *);
+
+/* Free the attachments and the cpu itself */
 void free_chip(chip8_t *);
 
-/* Load the file into the cpus memory */
-void load_file(chip8_t *, char *);
+/* Seed the random number generator, a reset goes back to DEFAULT_SEED */
+void chip8_seed(chip8_t *, uint64_t);
+
+/* Switch to a quirk profile, a reset goes back to DEFAULT_QUIRKS */
+void set_quirks(chip8_t *, int);
+
+/* Parse the name of a quirk profile, -1 if it isn't one */
+int parse_quirks(const char *);
+
+/* Switch the display to LORES or HIRES, clearing it if that changes the
+ * geometry. A reset goes back to LORES */
+void set_resolution(chip8_t *, int);
+
+/* Load the file into the cpus memory at PROGRAM_START. Returns 0 on
+ * success, files larger than PROGRAM_SIZE are rejected */
+int load_file(chip8_t *, char *);
+
+/* Drop the decoded instructions covering len bytes from addr */
+void invalidate_decoded(chip8_t *, uint16_t, uint16_t);
 
 /* Step and handle one instruction into the program */
 void step(chip8_t *);
 
-/* Tick the timers on the cpu */
-void tick(chip8_t *);
+/* Timer ticks seen by the n-th instruction (counting from 1). The timers
+ * tick at the end of every 60 Hz frame of emulated time, so their values
+ * are worked out from the cycle counter whenever they're read */
+uint64_t timer_ticks(chip8_t *, uint64_t);
+
+/* The delay and sound timers as the next instruction will see them */
+uint8_t delay_timer(chip8_t *);
+uint8_t sound_timer(chip8_t *);
+
+/* Set the timers as the next instruction will see them */
+void set_timers(chip8_t *, uint8_t, uint8_t);
+
+/* Press (down set) or release one of the keys 0x0-0xF. Safe to call from
+ * any thread while the cpu runs */
+void set_key(chip8_t *, int, int);
+
+/* True if the cpu is stuck at an FX0A until a key is pressed or released */
+int waiting_for_key(chip8_t *);
+
+/* Let n frames pass on a cpu which waited for a key through them, the same
+ * as running them */
+void wait_frames(chip8_t *, uint64_t);
+
+/* Publish the display to the frame buffer and stream if it changed since
+ * the last published frame */
+void publish_frame(chip8_t *);
 
-void unset_drawFlag(chip8_t *);
+/* Run up to n instructions, stopping early if the cpu halts. Returns the
+ * number of instructions run */
+uint64_t run_cycles(chip8_t *, uint64_t);
 
-/* Return the display matrix */
-uint8_t *get_display(chip8_t *);
+/* Run the instructions of one 60 Hz frame, then capture and publish the
+ * display */
+void run_frame(chip8_t *);
 
-/* Return the drawFlag */
-uint8_t get_drawFlag(chip8_t *);
+/* Hash the display, used to compare the output of two runs */
+uint64_t display_hash(chip8_t *);
 
-/* Function which steps through the program */
+/* Function which steps through the program as fast as possible */
 void run_chip(chip8_t *);
 
 #endif
@@ -0,0 +1,232 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "clone.h"
+#include "jit.h"
+
+/* Pages of memory, then the ones of the display. A low resolution display
+ * only uses the first display page, the others stay shared */
+#define MEMORY_PAGES (4096 / CLONE_PAGE_SIZE)
+#define DISPLAY_PAGES (sizeof(((chip8_t *)0)->display) / CLONE_PAGE_SIZE)
+#define PAGES (MEMORY_PAGES + DISPLAY_PAGES)
+#define DISPLAY_PAGE MEMORY_PAGES
+
+/* Everything in front of the display in chip8_t: registers, timers,
+ * counters and the stack. Kept as a plain copy */
+#define REGISTERS_SIZE offsetof(chip8_t, display)
+
+typedef struct {
+	int refs;
+	uint8_t data[CLONE_PAGE_SIZE];
+} page_t;
+
+struct clone_s {
+	int refs;
+	page_t *pages[PAGES];
+	uint8_t registers[REGISTERS_SIZE];
+};
+
+struct runner_s {
+	chip8_t *cpu;
+
+	// The pages the machine holds, NULL where it holds something else
+	page_t *pages[PAGES];
+};
+
+static page_t *page_new(const void *data)
+{
+	page_t *page = malloc(sizeof(page_t));
+
+	page->refs = 1;
+	memcpy(page->data, data, CLONE_PAGE_SIZE);
+	return page;
+}
+
+static page_t *page_retain(page_t *page)
+{
+	__atomic_add_fetch(&page->refs, 1, __ATOMIC_RELAXED);
+	return page;
+}
+
+static void page_release(page_t *page)
+{
+	if (page && __atomic_sub_fetch(&page->refs, 1, __ATOMIC_ACQ_REL) == 0)
+		free(page);
+}
+
+/* Where a page lives in a machine */
+static uint8_t *page_in(chip8_t *cpu, int index)
+{
+	if (index >= DISPLAY_PAGE)
+		return (uint8_t *)cpu->display + (index - DISPLAY_PAGE) * CLONE_PAGE_SIZE;
+
+	return &cpu->memory[index * CLONE_PAGE_SIZE];
+}
+
+/* Capture the state of a machine */
+clone_t *clone_capture(chip8_t *cpu)
+{
+	clone_t *clone = malloc(sizeof(clone_t));
+	int i;
+
+	clone->refs = 1;
+	memcpy(clone->registers, cpu, REGISTERS_SIZE);
+
+	for (i = 0; i < PAGES; i++)
+		clone->pages[i] = page_new(page_in(cpu, i));
+
+	return clone;
+}
+
+/* Take another reference to a clone */
+clone_t *clone_retain(clone_t *clone)
+{
+	__atomic_add_fetch(&clone->refs, 1, __ATOMIC_RELAXED);
+	return clone;
+}
+
+/* Drop a reference, the clone is freed with the last one */
+void clone_release(clone_t *clone)
+{
+	int i;
+
+	if (!clone || __atomic_sub_fetch(&clone->refs, 1, __ATOMIC_ACQ_REL) != 0)
+		return;
+
+	for (i = 0; i < PAGES; i++)
+		page_release(clone->pages[i]);
+
+	free(clone);
+}
+
+/* Put a machine in the state of a clone. Attachments are kept */
+void clone_load(clone_t *clone, chip8_t *cpu)
+{
+	int i;
+
+	memcpy(cpu, clone->registers, REGISTERS_SIZE);
+
+	for (i = 0; i < PAGES; i++)
+		memcpy(page_in(cpu, i), clone->pages[i]->data, CLONE_PAGE_SIZE);
+
+	invalidate_decoded(cpu, 0, 4096);
+	cpu->dirty = ~0ULL;
+}
+
+/* Copy the display of a clone, the DISPLAY_WORDS() of its geometry.
+ * Returns the geometry, LORES or HIRES */
+int clone_display(clone_t *clone, uint64_t *display)
+{
+	int hires = clone->registers[offsetof(chip8_t, hires)];
+	uint32_t size = DISPLAY_WORDS(hires) * sizeof(uint64_t), i;
+
+	for (i = 0; i * CLONE_PAGE_SIZE < size; i++)
+		memcpy((uint8_t *)display + i * CLONE_PAGE_SIZE,
+				clone->pages[DISPLAY_PAGE + i]->data, CLONE_PAGE_SIZE);
+
+	return hires;
+}
+
+/* Read a byte of the memory of a clone */
+uint8_t clone_peek(clone_t *clone, uint16_t addr)
+{
+	addr &= 0xFFF;
+	return clone->pages[addr / CLONE_PAGE_SIZE]->data[addr % CLONE_PAGE_SIZE];
+}
+
+/* Read a register of a clone */
+uint8_t clone_register(clone_t *clone, int reg)
+{
+	return clone->registers[offsetof(chip8_t, V) + (reg & 0xF)];
+}
+
+/* Frames run by a clone and whether it has halted */
+uint64_t clone_frame(clone_t *clone)
+{
+	uint64_t frame;
+
+	memcpy(&frame, clone->registers + offsetof(chip8_t, frame), sizeof(frame));
+	return frame;
+}
+
+int clone_halted(clone_t *clone)
+{
+	return clone->registers[offsetof(chip8_t, halted)];
+}
+
+/* Create a machine to run clones on */
+runner_t *runner_create(void)
+{
+	runner_t *runner = calloc(1, sizeof(runner_t));
+
+	runner->cpu = chip8_new();
+	runner->cpu->jit = jit_create();
+	return runner;
+}
+
+/* Free a runner and the pages it holds */
+void runner_free(runner_t *runner)
+{
+	int i;
+
+	for (i = 0; i < PAGES; i++)
+		page_release(runner->pages[i]);
+
+	free_chip(runner->cpu);
+	free(runner);
+}
+
+/* Run a clone forward for the given number of frames, holding down
+ * keys[f] (bit n for key n) in frame f. Stops early if it halts. Returns
+ * the resulting clone, the one run is left alone */
+clone_t *runner_run(runner_t *runner, clone_t *from, const uint16_t *keys, int frames)
+{
+	chip8_t *cpu = runner->cpu;
+	clone_t *clone = malloc(sizeof(clone_t));
+	int i, f;
+
+	uint8_t quirks = cpu->quirks, hires = cpu->hires;
+
+	// Only copy in the pages the machine doesn't hold already, so code
+	// stays decoded across branches
+	memcpy(cpu, from->registers, REGISTERS_SIZE);
+
+	// Code decoded for another quirk profile or geometry has the wrong
+	// handlers
+	if (cpu->quirks != quirks || cpu->hires != hires)
+		invalidate_decoded(cpu, 0, 4096);
+
+	for (i = 0; i < PAGES; i++) {
+		if (runner->pages[i] == from->pages[i])
+			continue;
+
+		memcpy(page_in(cpu, i), from->pages[i]->data, CLONE_PAGE_SIZE);
+		page_release(runner->pages[i]);
+		runner->pages[i] = page_retain(from->pages[i]);
+
+		if (i < DISPLAY_PAGE)
+			invalidate_decoded(cpu, i * CLONE_PAGE_SIZE, CLONE_PAGE_SIZE);
+	}
+
+	for (f = 0; f < frames && !cpu->halted; f++) {
+		cpu->keys = keys[f];
+		run_frame(cpu);
+	}
+
+	// Share every page which is still the same as the parent's
+	clone->refs = 1;
+	memcpy(clone->registers, cpu, REGISTERS_SIZE);
+
+	for (i = 0; i < PAGES; i++) {
+		uint8_t *data = page_in(cpu, i);
+
+		if (memcmp(data, runner->pages[i]->data, CLONE_PAGE_SIZE) != 0) {
+			page_release(runner->pages[i]);
+			runner->pages[i] = page_new(data);
+		}
+
+		clone->pages[i] = page_retain(runner->pages[i]);
+	}
+
+	return clone;
+}
@@ -0,0 +1,67 @@
+#ifndef CLONE_H_
+#define CLONE_H_
+
+#include "chip8.h"
+
+/*
+ * Cheap copies of machine states, for searching over inputs. A clone is a
+ * frozen state whose memory and display are kept in refcounted pages of
+ * 256 bytes. Running a clone forward gives a new clone which shares every
+ * page that didn't change with its parent, so a branch usually costs one
+ * small allocation and a page or two.
+ *
+ * Clones are run on a runner, a machine which remembers the pages it holds
+ * so that going from one clone to the next only copies (and re-decodes)
+ * the pages which differ. Clones can be shared between threads, runners
+ * can't.
+ *
+ *   clone_t *root = clone_capture(cpu);
+ *   clone_t *left = runner_run(runner, root, left_keys, 30);
+ *   clone_t *right = runner_run(runner, root, right_keys, 30);
+ *
+ *   if (clone_peek(left, SCORE) > clone_peek(right, SCORE)) ...
+ */
+
+#define CLONE_PAGE_SIZE 256
+
+typedef struct clone_s clone_t;
+typedef struct runner_s runner_t;
+
+/* Capture the state of a machine */
+clone_t *clone_capture(chip8_t *);
+
+/* Take another reference to a clone */
+clone_t *clone_retain(clone_t *);
+
+/* Drop a reference, the clone is freed with the last one */
+void clone_release(clone_t *);
+
+/* Put a machine in the state of a clone. Attachments are kept */
+void clone_load(clone_t *, chip8_t *);
+
+/* Copy the display of a clone, the DISPLAY_WORDS() of its geometry.
+ * Returns the geometry, LORES or HIRES */
+int clone_display(clone_t *, uint64_t *);
+
+/* Read a byte of the memory of a clone */
+uint8_t clone_peek(clone_t *, uint16_t);
+
+/* Read a register of a clone */
+uint8_t clone_register(clone_t *, int);
+
+/* Frames run by a clone and whether it has halted */
+uint64_t clone_frame(clone_t *);
+int clone_halted(clone_t *);
+
+/* Create a machine to run clones on */
+runner_t *runner_create(void);
+
+/* Free a runner and the pages it holds */
+void runner_free(runner_t *);
+
+/* Run a clone forward for the given number of frames, holding down
+ * keys[f] (bit n for key n) in frame f. Stops early if it halts. Returns
+ * the resulting clone, the one run is left alone */
+clone_t *runner_run(runner_t *, clone_t *, const uint16_t *, int);
+
+#endif
@@ -2,88 +2,537 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <getopt.h>
+#include <time.h>
+#include <signal.h>
 
 #include "monitor.h"
 #include "chip8.h"
-
-/* Include variables from other files */
-extern SDL_Surface *g_scr;
-extern SDL_Event *g_event;
+#include "jit.h"
+#include "batch.h"
+#include "pack.h"
+#include "sched.h"
+#include "trace.h"
+#include "capture.h"
+#include "stream.h"
+#include "snapshot.h"
+#include "profile.h"
 
 /* Define the threads for the monitor- and emulator-runs */
 pthread_t *monitor_thread;
 pthread_t *emulator_thread;
 int quiting = 0;
 
+/* Command line options */
+static struct option options[] = {
+	{ "headless", no_argument, NULL, 'H' },
+	{ "batch", required_argument, NULL, 'b' },
+	{ "threads", required_argument, NULL, 't' },
+	{ "out", required_argument, NULL, 'o' },
+	{ "ips", required_argument, NULL, 'i' },
+	{ "trace", required_argument, NULL, 'T' },
+	{ "capture", required_argument, NULL, 'c' },
+	{ "log-level", required_argument, NULL, 'l' },
+	{ "seed", required_argument, NULL, 's' },
+	{ "quirks", required_argument, NULL, 'q' },
+	{ "pack", required_argument, NULL, 'p' },
+	{ "serve", required_argument, NULL, 'S' },
+	{ NULL, 0, NULL, 0 }
+};
+
+/* Key events on their way to the screen, to measure the latency */
+#define PENDING_KEYS 64
+
+/* Events which haven't shown up after this never changed the screen */
+#define KEY_TIMEOUT_NS 1000000000LL
+
+typedef struct {
+	uint64_t input[PENDING_KEYS]; // Event numbers in the frame buffer
+	int64_t sent[PENDING_KEYS]; // When they went to the machine
+	int head;
+	int count;
+
+	uint64_t shown; // Events which made it to the screen
+	uint64_t unseen; // Events which never changed the screen
+	int64_t total_ns; // Sum of the latencies of the shown events
+	int64_t max_ns;
+} latency_t;
+
+static int64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Note a key event which was just handed to the machine */
+static void key_sent(latency_t *latency, uint64_t input)
+{
+	int i;
+
+	if (!input)
+		return;
+
+	// Too many on their way, the oldest is very unlikely to show up
+	if (latency->count == PENDING_KEYS) {
+		latency->head = (latency->head + 1) % PENDING_KEYS;
+		latency->count--;
+		latency->unseen++;
+	}
+
+	i = (latency->head + latency->count++) % PENDING_KEYS;
+	latency->input[i] = input;
+	latency->sent[i] = now_ns();
+}
+
+/* A frame made after the given number of input events is on the screen */
+static void frame_shown(latency_t *latency, uint64_t input)
+{
+	int64_t now = now_ns();
+
+	while (latency->count > 0) {
+		int i = latency->head;
+		int64_t ns = now - latency->sent[i];
+
+		if (ns > KEY_TIMEOUT_NS) {
+			latency->unseen++;
+		} else if (latency->input[i] <= input) {
+			latency->shown++;
+			latency->total_ns += ns;
+
+			if (ns > latency->max_ns)
+				latency->max_ns = ns;
+		} else {
+			break;
+		}
+
+		latency->head = (i + 1) % PENDING_KEYS;
+		latency->count--;
+	}
+}
+
+/* The keypad on the left of a QWERTY keyboard, -1 for other keys:
+ *
+ *   1 2 3 C      1 2 3 4
+ *   4 5 6 D      Q W E R
+ *   7 8 9 E      A S D F
+ *   A 0 B F      Z X C V
+ */
+static int keypad_key(SDLKey sym)
+{
+	switch (sym)
+	{
+		case SDLK_1: return 0x1;
+		case SDLK_2: return 0x2;
+		case SDLK_3: return 0x3;
+		case SDLK_4: return 0xC;
+		case SDLK_q: return 0x4;
+		case SDLK_w: return 0x5;
+		case SDLK_e: return 0x6;
+		case SDLK_r: return 0xD;
+		case SDLK_a: return 0x7;
+		case SDLK_s: return 0x8;
+		case SDLK_d: return 0x9;
+		case SDLK_f: return 0xE;
+		case SDLK_z: return 0xA;
+		case SDLK_x: return 0x0;
+		case SDLK_c: return 0xB;
+		case SDLK_v: return 0xF;
+		default: return -1;
+	}
+}
+
+/* Wake the UI thread up, called by the emulator thread for every frame */
+static void frame_ready(void)
+{
+	SDL_Event event;
+
+	memset(&event, 0, sizeof(event));
+	event.type = SDL_USEREVENT;
+	SDL_PushEvent(&event);
+}
+
+static void usage(void)
+{
+	printf("Usage: chip [options] <filename>\n");
+	printf("       chip --headless --batch <manifest> [options]\n");
+	printf("       chip --headless --serve <socket> [options] <filename>\n\n");
+	printf("  --headless         Run without a window\n");
+	printf("  --batch FILE       Run every job in the manifest (needs --headless)\n");
+	printf("  --threads N        Threads for batch runs, default one per core\n");
+	printf("  --out FILE         Write batch results to FILE instead of stdout\n");
+	printf("  --ips N            Instructions per second, default %i\n", DEFAULT_IPS);
+	printf("  --trace FILE       Record a binary execution trace to FILE\n");
+	printf("  --capture FILE     Record every frame to FILE, see c8cap\n");
+	printf("  --log-level LEVEL  trace, debug, info, warn, error or off, default warn\n");
+	printf("  --seed N           Seed of the random numbers, default %i\n", DEFAULT_SEED);
+	printf("  --quirks NAME      vip, chip48, schip or xochip, default %s\n",
+			quirk_profiles[DEFAULT_QUIRKS].name);
+	printf("  --pack FILE        Find the ROMs by name or hash in a ROM pack\n");
+	printf("  --serve PATH       Stream the display and take keys on a Unix socket\n");
+}
+
+/* Stop the scheduler on SIGINT or SIGTERM, which every thread blocks.
+ * Returns once the run ended, for whatever reason, so it can be joined
+ * before the scheduler goes away */
+static void *wait_for_signal(void *arg)
+{
+	sched_t *sched = arg;
+	struct timespec poll = { 0, 100 * 1000 * 1000 };
+	sigset_t signals;
+	int signal;
+
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+
+	while (!__atomic_load_n(&sched->ended, __ATOMIC_ACQUIRE)) {
+		if ((signal = sigtimedwait(&signals, NULL, &poll)) > 0) {
+			log_info("Stopping on signal %i.\n", signal);
+			sched_stop(sched);
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+/* Run the machine without a window, for the subscribers of the stream only,
+ * until it halts or is told to stop */
+static int run_session(chip8_t *cpu, char *serve)
+{
+	sched_t sched;
+	pthread_t waiter;
+	uint64_t updates, skipped;
+
+	sched_init(&sched, cpu);
+
+	if (!(cpu->stream = stream_open(serve, &sched))) {
+		sched_destroy(&sched);
+		return 1;
+	}
+
+	pthread_create(&waiter, NULL, wait_for_signal, &sched);
+	sched_run(&sched);
+	pthread_join(waiter, NULL);
+
+	if (cpu->halted)
+		log_warn("Halted on 0x%02X%02X at 0x%X.\n", cpu->memory[cpu->pc & 0xFFF],
+				cpu->memory[(cpu->pc + 1) & 0xFFF], cpu->pc);
+
+	stream_counts(cpu->stream, &updates, &skipped);
+	stream_close(cpu->stream);
+	cpu->stream = NULL;
+
+	printf("Ran %llu frames, %llu resyncs.\n", (unsigned long long)sched.frames,
+			(unsigned long long)sched.resyncs);
+	printf("Streamed %llu updates, subscribers skipped %llu frames.\n",
+			(unsigned long long)updates, (unsigned long long)skipped);
+
+	sched_destroy(&sched);
+	return cpu->halted;
+}
+
+/* Load the program from the pack if there is one, or else from the file.
+ * Returns 0 on success */
+static int load_rom(chip8_t *cpu, char *pack_file, char *name)
+{
+	if (!pack_file)
+		return load_file(cpu, name);
+
+	pack_t *pack = pack_open(pack_file);
+	const pack_entry_t *entry;
+
+	if (!pack)
+		return -1;
+
+	if (!(entry = pack_find(pack, name))) {
+		log_error("'%s' isn't in the pack '%s'.\n", name, pack_file);
+		pack_close(pack);
+		return -1;
+	}
+
+	pack_load(pack, entry, cpu);
+	pack_close(pack);
+	return 0;
+}
+
 int main(int argc, char *argv[])
 {
+	// The ips and quirks given on the command line beat the ones in a pack
+	int headless = 0, threads = 0, ips = 0, quirks = -1, opt;
+	char *manifest = NULL, *out = NULL, *trace = NULL, *pack_file = NULL;
+	char *capture = NULL, *serve = NULL;
+	uint64_t seed = DEFAULT_SEED;
+
+	while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+		switch (opt)
+		{
+			case 'H': headless = 1; break;
+			case 'b': manifest = optarg; break;
+			case 't': threads = atoi(optarg); break;
+			case 'o': out = optarg; break;
+			case 'i': ips = atoi(optarg); break;
+			case 'T': trace = optarg; break;
+			case 'c': capture = optarg; break;
+			case 's': seed = strtoull(optarg, NULL, 0); break;
+			case 'p': pack_file = optarg; break;
+			case 'S': serve = optarg; break;
+			case 'l':
+				if ((g_log_level = log_parse_level(optarg)) < 0) {
+					usage();
+					return 1;
+				}
+				break;
+			case 'q':
+				if ((quirks = parse_quirks(optarg)) < 0) {
+					usage();
+					return 1;
+				}
+				break;
+			default: usage(); return 1;
+		}
+	}
+
+	// A session is stopped with a signal, which every thread blocks so
+	// only the one waiting for it sees it
+	if (headless && serve && !manifest) {
+		sigset_t signals;
+
+		sigemptyset(&signals);
+		sigaddset(&signals, SIGINT);
+		sigaddset(&signals, SIGTERM);
+		pthread_sigmask(SIG_BLOCK, &signals, NULL);
+	}
+
+	// Before any thread starts, they all need SIGUSR1 blocked
+	profile_start();
+
+	// Keep stdout off the emulator and UI threads
+	log_start();
+
+	/* Batch runs never touch SDL */
+	if (headless && (manifest || !serve)) {
+		if (!manifest) {
+			usage();
+			return 1;
+		}
+
+		return run_batch(manifest, out, threads, seed,
+				quirks >= 0 ? quirks : DEFAULT_QUIRKS, pack_file);
+	}
 
 	/* Make the user specify which file to open */
-	if (argc != 2) {
-		printf("Usage: chip <filename>\n");
+	if (optind != argc - 1) {
+		usage();
 		return 1;
-
-		/* Set some dummy values */
-		argc = 2;
-		argv[1] = "programs/MAZE.c8";
 	}
 
+	char *filename = argv[optind];
+
 	// Initialize the emulator
-	chip8_t *cpu;
-	cpu = malloc(sizeof(chip8_t));
-	init_chip(cpu);
+	chip8_t *cpu = chip8_new();
+	chip8_seed(cpu, seed);
 
-	// Initialize the monitor
-	init_monitor(&g_scr, argv[1]);
+	// Use the recompiler if it's built in
+	cpu->jit = jit_create();
+
+	if (trace && !(cpu->trace = trace_open(trace))) {
+		free_chip(cpu);
+		return 1;
+	}
+
+	// Frames are dropped rather than holding up the game
+	if (capture && !(cpu->capture = capture_open(capture, CAPTURE_DROP))) {
+		free_chip(cpu);
+		return 1;
+	}
 
 	// Load the file into the cpu memory
-	load_file(cpu, argv[1]);
+	if (load_rom(cpu, pack_file, filename) != 0) {
+		free_chip(cpu);
+		return 1;
+	}
+
+	if (quirks >= 0)
+		set_quirks(cpu, quirks);
+
+	if (ips > 0)
+		cpu->ips = ips;
+
+	// Sessions never touch SDL either
+	if (headless) {
+		int status = run_session(cpu, serve);
+		free_chip(cpu);
+		return status;
+	}
+
+	// Initialize the monitor
+	init_monitor(&g_scr, filename);
+
+	// Frames come from the emulator thread through the triple buffer
+	frame_buffer_t frames;
+	frame_buffer_init(&frames);
+	cpu->frames = &frames;
+
+	// The rows currently on the screen, to work out which ones changed
+	uint64_t shown[DISPLAY_WORDS(HIRES)];
+	int shown_hires = LORES;
+	memset(shown, 0, sizeof(shown));
+
+	// Totals of what the redraws touched
+	uint64_t redraws = 0, redrawn_rows = 0, redrawn_bytes = 0;
+
+	latency_t latency;
+	memset(&latency, 0, sizeof(latency));
+
+	// Start the threads. The emulator runs at real speed on its own and
+	// tells the UI thread about new frames through the event queue
+	sched_t sched;
+	sched_init(&sched, cpu);
+	sched.on_frame = frame_ready;
+
+	// Subscribers watch and play along with the window
+	if (serve && !(cpu->stream = stream_open(serve, &sched))) {
+		free_monitor(g_scr);
+		free_chip(cpu);
+		sched_destroy(&sched);
+		return 1;
+	}
+
+	// F5 saves next to the ROM, F7 loads it back, Backspace rewinds
+	sched.history = rewind_create(REWIND_STATES, REWIND_BYTES);
+	sched.save_file = malloc(strlen(filename) + sizeof(".state"));
+	sprintf(sched.save_file, "%s.state", filename);
 
-	// Start the threads
 	emulator_thread = malloc(sizeof(pthread_t));
-	pthread_create(emulator_thread, NULL, (void *)&run_chip, cpu);
+	pthread_create(emulator_thread, NULL, sched_run, &sched);
 	
-	// Run the main program
-	while (!quiting) {
-		// TODO: Wait for events instead of spamming
-		// Handle all the events
-		while (SDL_PollEvent(g_event)) {
-			switch (g_event->type)
-			{
-				case SDL_QUIT:
-					quiting = 1;
-					break;
+	// Run the main program. Keys go to the machine as soon as they come,
+	// frames are drawn as soon as they're published.
+	while (!quiting && SDL_WaitEvent(g_event)) {
+		SDLKey sym = g_event->key.keysym.sym;
+		int key;
 
-				default:
-					// Set keys to not pressed
-					break;
-			}
-		}
+		switch (g_event->type)
+		{
+			case SDL_QUIT:
+				quiting = 1;
+				break;
 
-		// TODO: Should try to emulate the speed of the cpu
-		if (get_drawFlag(cpu) == 1) {
-			printf("---> Redrawing..\n");
-			draw_monitor(g_scr, get_display(cpu));
-			unset_drawFlag(cpu);
-		}
+			case SDL_KEYDOWN:
+				if (sym == SDLK_F5)
+					sched_request(&sched, SCHED_SAVE);
+				else if (sym == SDLK_F7)
+					sched_request(&sched, SCHED_LOAD);
+				else if (sym == SDLK_BACKSPACE)
+					sched_rewind(&sched, 1);
+				else if ((key = keypad_key(sym)) >= 0)
+					key_sent(&latency, sched_key(&sched, key, 1));
+				break;
 
-		// Tick the timers
-		tick(cpu);
+			case SDL_KEYUP:
+				if (sym == SDLK_BACKSPACE)
+					sched_rewind(&sched, 0);
+				else if ((key = keypad_key(sym)) >= 0)
+					key_sent(&latency, sched_key(&sched, key, 0));
+				break;
 
-		// Sleep so we get a fps of 60
-		usleep(160 * 1000);
+			case SDL_USEREVENT: {
+				frame_t *frame = frame_acquire(&frames);
+				uint64_t dirty = 0;
+				int word;
+
+				// A new geometry redraws everything
+				if (frame && frame->hires != shown_hires) {
+					shown_hires = frame->hires;
+					memset(shown, 0, sizeof(shown));
+					dirty = ~0ULL;
+				}
+
+				// Frames may have been dropped since the last one, so
+				// compare against what's on the screen instead of
+				// trusting the emulator
+				for (word = 0; frame && word < DISPLAY_WORDS(shown_hires); word++) {
+					if (frame->rows[word] != shown[word]) {
+						shown[word] = frame->rows[word];
+						dirty |= 1ULL << (word >> shown_hires);
+					}
+				}
+
+				if (dirty) {
+					render_stats_t stats;
+
+					log_debug("---> Redrawing..\n");
+					draw_monitor(g_scr, frame->rows, shown_hires, dirty, &stats);
+					frame_shown(&latency, frame->input);
+
+					redraws++;
+					redrawn_rows += stats.rows;
+					redrawn_bytes += stats.bytes;
+				}
+
+				// The emulator thread stops on unimplemented instructions.
+				// The cpu is its own until it's joined, so only ask the
+				// scheduler.
+				if (__atomic_load_n(&sched.ended, __ATOMIC_ACQUIRE))
+					quiting = 1;
+				break;
+			}
+
+			default:
+				break;
+		}
 	}
 
 	// Stop and the threads
-	pthread_cancel(*emulator_thread);
+	sched_stop(&sched);
+	pthread_join(*emulator_thread, NULL);
 	free(emulator_thread);
 
+	if (cpu->halted)
+		log_warn("Halted on 0x%02X%02X at 0x%X.\n", cpu->memory[cpu->pc & 0xFFF],
+				cpu->memory[(cpu->pc + 1) & 0xFFF], cpu->pc);
+
+	if (cpu->stream) {
+		uint64_t updates, skipped;
+
+		stream_counts(cpu->stream, &updates, &skipped);
+		stream_close(cpu->stream);
+		cpu->stream = NULL;
+		printf("Streamed %llu updates, subscribers skipped %llu frames.\n",
+				(unsigned long long)updates, (unsigned long long)skipped);
+	}
+
+	printf("Ran %llu frames, %.3f ms average and %.3f ms max jitter, "
+			"%llu resyncs.\n", (unsigned long long)sched.frames,
+			sched.frames ? sched.total_jitter_ns / 1e6 / sched.frames : 0.0,
+			sched.max_jitter_ns / 1e6, (unsigned long long)sched.resyncs);
+	printf("Ran %llu frames early for keys, %llu passed waiting for a key.\n",
+			(unsigned long long)sched.early, (unsigned long long)sched.parked);
+	printf("Showed %llu key events, %.3f ms average and %.3f ms max latency, "
+			"%llu never changed the screen.\n", (unsigned long long)latency.shown,
+			latency.shown ? latency.total_ns / 1e6 / latency.shown : 0.0,
+			latency.max_ns / 1e6, (unsigned long long)(latency.unseen + latency.count));
+
 	// Clean up
+	int status = cpu->halted;
 	free_monitor(g_scr);
 	free_chip(cpu);
+	rewind_free(sched.history);
+	free(sched.save_file);
+	sched_destroy(&sched);
 
+	uint64_t published, dropped;
+	frame_counts(&frames, &published, &dropped);
+	printf("Published %llu frames, dropped %llu.\n",
+			(unsigned long long)published, (unsigned long long)dropped);
+	printf("Redrew %llu rows (%llu bytes) in %llu redraws.\n",
+			(unsigned long long)redrawn_rows, (unsigned long long)redrawn_bytes,
+			(unsigned long long)redraws);
 	printf("Quiting.\n");
 
-	exit(0);
+	exit(status);
 }
 
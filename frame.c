@@ -0,0 +1,65 @@
+#include <string.h>
+
+#include "frame.h"
+
+/* Set up an empty frame buffer */
+void frame_buffer_init(frame_buffer_t *fb)
+{
+	memset(fb, 0, sizeof(frame_buffer_t));
+
+	fb->back = 0;
+	fb->middle = 1;
+	fb->front = 2;
+}
+
+/* Return the slot the writer should fill in */
+frame_t *frame_back(frame_buffer_t *fb)
+{
+	return &fb->slots[fb->back];
+}
+
+/* Publish the back slot and start on a new one */
+void frame_publish(frame_buffer_t *fb)
+{
+	fb->slots[fb->back].seq = fb->seq++;
+	fb->slots[fb->back].input = __atomic_load_n(&fb->input, __ATOMIC_ACQUIRE);
+
+	// Swap the back slot with the middle one. If the old middle was never
+	// read, that frame is lost.
+	uint8_t old = __atomic_exchange_n(&fb->middle, fb->back | FRAME_FRESH,
+			__ATOMIC_ACQ_REL);
+
+	if (old & FRAME_FRESH)
+		__atomic_fetch_add(&fb->dropped, 1, __ATOMIC_RELAXED);
+
+	__atomic_fetch_add(&fb->published, 1, __ATOMIC_RELAXED);
+	fb->back = old & ~FRAME_FRESH;
+}
+
+/* Take the newest published frame, NULL if nothing new was published since
+ * the last call. The frame stays valid until the next call */
+frame_t *frame_acquire(frame_buffer_t *fb)
+{
+	if (!(__atomic_load_n(&fb->middle, __ATOMIC_RELAXED) & FRAME_FRESH))
+		return NULL;
+
+	// Swap the front slot with the middle one, handing the old front back
+	uint8_t old = __atomic_exchange_n(&fb->middle, fb->front, __ATOMIC_ACQ_REL);
+	fb->front = old & ~FRAME_FRESH;
+
+	return &fb->slots[fb->front];
+}
+
+/* Count an input event which was just handed to the machine. Returns its
+ * number, frames with an input at least that large were made after it */
+uint64_t frame_input(frame_buffer_t *fb)
+{
+	return __atomic_add_fetch(&fb->input, 1, __ATOMIC_RELEASE);
+}
+
+/* Read the published and dropped counters */
+void frame_counts(frame_buffer_t *fb, uint64_t *published, uint64_t *dropped)
+{
+	*published = __atomic_load_n(&fb->published, __ATOMIC_RELAXED);
+	*dropped = __atomic_load_n(&fb->dropped, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,61 @@
+#ifndef FRAME_H_
+#define FRAME_H_
+
+#include <stdint.h>
+
+/*
+ * Triple buffered handoff of finished frames from the emulator thread to
+ * the UI thread. The emulator fills the back slot and publishes it, the UI
+ * takes the newest published slot. Neither side ever waits for the other,
+ * frames the UI doesn't get to in time are dropped and counted.
+ *
+ * Input events are counted here as well, so the UI can tell which frame
+ * is the first one made after a key went to the machine.
+ */
+
+/* One finished frame */
+typedef struct {
+	uint64_t rows[128]; // Same layout as the display, up to 128x64
+	uint8_t hires; // Geometry of the rows, LORES or HIRES
+	uint64_t seq; // Increases by one for every published frame
+	uint64_t input; // Input events handed to the machine before it was published
+} frame_t;
+
+/* The three slots and who owns them */
+typedef struct {
+	frame_t slots[3];
+
+	uint8_t back; // Slot the writer fills, only touched by the writer
+	uint8_t front; // Slot the reader looks at, only touched by the reader
+	uint8_t middle; // Latest published slot, plus FRAME_FRESH if unread
+
+	uint64_t seq; // Sequence number of the next frame
+	uint64_t published; // Frames published
+	uint64_t dropped; // Frames replaced before they were read
+	uint64_t input; // Input events so far, counted by frame_input()
+} frame_buffer_t;
+
+/* Set in middle when it holds a frame the reader hasn't taken */
+#define FRAME_FRESH 0x4
+
+/* Set up an empty frame buffer */
+void frame_buffer_init(frame_buffer_t *);
+
+/* Return the slot the writer should fill in */
+frame_t *frame_back(frame_buffer_t *);
+
+/* Publish the back slot and start on a new one */
+void frame_publish(frame_buffer_t *);
+
+/* Take the newest published frame, NULL if nothing new was published since
+ * the last call. The frame stays valid until the next call */
+frame_t *frame_acquire(frame_buffer_t *);
+
+/* Count an input event which was just handed to the machine. Returns its
+ * number, frames with an input at least that large were made after it */
+uint64_t frame_input(frame_buffer_t *);
+
+/* Read the published and dropped counters */
+void frame_counts(frame_buffer_t *, uint64_t *, uint64_t *);
+
+#endif
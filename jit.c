@@ -0,0 +1,471 @@
+#include "jit.h"
+
+#if defined(CHIP8_JIT) && defined(__x86_64__)
+
+#include <stddef.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* Size of the executable code cache */
+#define CODE_SIZE (1024 * 1024)
+
+/* Longest run of instructions put in one block */
+#define MAX_BLOCK 64
+
+/* Worst case size of one translated instruction, plus the epilogue */
+#define MAX_INSN_BYTES 32
+
+/* Marks a PC where nothing could be translated */
+#define UNTRANSLATABLE ((block_fn)1)
+
+struct jit_s {
+	uint8_t *code; // The executable memory
+	uint32_t used; // Bytes of code emitted so far
+
+	block_fn blocks[4096]; // Translated block for every PC
+	uint8_t lengths[4096]; // Most instructions the block at a PC runs
+	uint8_t covered[4096]; // Set for every byte read by a translation
+};
+
+/* Create an empty code cache, NULL if there's no JIT in this build */
+jit_t *jit_create(void)
+{
+	jit_t *jit = calloc(1, sizeof(jit_t));
+
+	// Code is written while the pages are writable and run once they're
+	// executable, never both at once as hardened systems refuse that. Those
+	// which refuse executable anonymous memory altogether fail here.
+	jit->code = mmap(NULL, CODE_SIZE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (jit->code == MAP_FAILED) {
+		log_warn("Couldn't map memory for the JIT, interpreting instead.\n");
+		free(jit);
+		return NULL;
+	}
+
+	if (mprotect(jit->code, CODE_SIZE, PROT_READ | PROT_EXEC) != 0) {
+		log_warn("Couldn't make memory executable for the JIT, interpreting instead.\n");
+		munmap(jit->code, CODE_SIZE);
+		free(jit);
+		return NULL;
+	}
+
+	return jit;
+}
+
+/* Free the code cache */
+void jit_free(jit_t *jit)
+{
+	if (!jit)
+		return;
+
+	munmap(jit->code, CODE_SIZE);
+	free(jit);
+}
+
+/* Forget every translation */
+static void flush(jit_t *jit)
+{
+	jit->used = 0;
+	memset(jit->blocks, 0, sizeof(jit->blocks));
+	memset(jit->covered, 0, sizeof(jit->covered));
+}
+
+/* Throw away translated code if it covers any of len bytes from addr */
+void jit_invalidate(jit_t *jit, uint16_t addr, uint16_t len)
+{
+	uint16_t i;
+
+	if (!jit)
+		return;
+
+	// Blocks are small and writes into code are rare, so just start over
+	for (i = 0; i < len; i++) {
+		if (jit->covered[(addr + i) & 0xFFF]) {
+			flush(jit);
+			return;
+		}
+	}
+}
+
+/*
+ * The emitter. Translated code gets the cpu in rdi, keeps &cpu->V in rsi and
+ * uses al/cx as scratch.
+ */
+
+static void emit8(uint8_t **p, uint8_t b)
+{
+	*(*p)++ = b;
+}
+
+static void emit16(uint8_t **p, uint16_t w)
+{
+	memcpy(*p, &w, 2);
+	*p += 2;
+}
+
+static void emit32(uint8_t **p, uint32_t d)
+{
+	memcpy(*p, &d, 4);
+	*p += 4;
+}
+
+/* op byte [rsi + reg], al */
+static void emit_v_al(uint8_t **p, uint8_t op, uint8_t reg)
+{
+	emit8(p, op);
+	emit8(p, 0x46);
+	emit8(p, reg);
+}
+
+/* mov al, byte [rsi + reg] */
+static void emit_load_al(uint8_t **p, uint8_t reg)
+{
+	emit_v_al(p, 0x8A, reg);
+}
+
+/* setcc byte [rsi + 0xF], after the flag is set last like the handlers */
+static void emit_set_vf(uint8_t **p, uint8_t setcc)
+{
+	emit8(p, 0x0F);
+	emit8(p, setcc);
+	emit8(p, 0x46);
+	emit8(p, 0xF);
+}
+
+/* mov byte [rsi + 0xF], 0 if the profile clears VF on logic instructions */
+static void emit_vf_reset(uint8_t **p, const quirks_t *quirks)
+{
+	if (!quirks->vf_reset)
+		return;
+
+	emit8(p, 0xC6);
+	emit8(p, 0x46);
+	emit8(p, 0xF);
+	emit8(p, 0);
+}
+
+/* mov word [rdi + offsetof(chip8_t, field)], imm16 */
+static void emit_store16(uint8_t **p, size_t offset, uint16_t imm)
+{
+	emit8(p, 0x66);
+	emit8(p, 0xC7);
+	emit8(p, 0x87);
+	emit32(p, offset);
+	emit16(p, imm);
+}
+
+/* Set the PC to skip if the flags say so, then return */
+static void emit_skip(uint8_t **p, uint16_t addr, uint8_t cmov, int count)
+{
+	// mov ax, addr + 2; mov cx, addr + 4
+	emit8(p, 0x66);
+	emit8(p, 0xB8);
+	emit16(p, addr + 2);
+	emit8(p, 0x66);
+	emit8(p, 0xB9);
+	emit16(p, addr + 4);
+
+	// cmovcc ax, cx
+	emit8(p, 0x66);
+	emit8(p, 0x0F);
+	emit8(p, cmov);
+	emit8(p, 0xC1);
+
+	// mov word [rdi + pc], ax
+	emit8(p, 0x66);
+	emit8(p, 0x89);
+	emit8(p, 0x87);
+	emit32(p, offsetof(chip8_t, pc));
+
+	// mov eax, count; ret
+	emit8(p, 0xB8);
+	emit32(p, count);
+	emit8(p, 0xC3);
+}
+
+/* Set the PC and return the number of instructions run */
+static void emit_exit(uint8_t **p, uint16_t pc, int count)
+{
+	emit_store16(p, offsetof(chip8_t, pc), pc);
+	emit8(p, 0xB8);
+	emit32(p, count);
+	emit8(p, 0xC3);
+}
+
+/* Emit the block starting at pc at the end of the code. Returns NULL if
+ * the first instruction can't be translated */
+static block_fn emit_block(chip8_t *cpu, uint16_t start, uint8_t *length)
+{
+	jit_t *jit = cpu->jit;
+	const quirks_t *quirks = &quirk_profiles[cpu->quirks];
+	uint8_t *begin = jit->code + jit->used;
+	uint8_t *p = begin;
+	uint16_t addr = start;
+	int count = 0;
+
+	// lea rsi, [rdi + offsetof(chip8_t, V)]
+	emit8(&p, 0x48);
+	emit8(&p, 0x8D);
+	emit8(&p, 0xB7);
+	emit32(&p, offsetof(chip8_t, V));
+
+	while (count < MAX_BLOCK && addr < 0xFFF) {
+		uint16_t opcode = (cpu->memory[addr] << 8) | cpu->memory[addr + 1];
+		uint8_t x = (opcode & 0x0F00) >> 8;
+		uint8_t y = (opcode & 0x00F0) >> 4;
+		uint8_t nn = opcode & 0x00FF;
+		int ends = 0;
+
+		switch (opcode & 0xF000)
+		{
+			case 0x1000: { // 1NNN: Jump
+				emit_exit(&p, opcode & 0x0FFF, count + 1);
+				ends = 1;
+				break;
+			}
+
+			case 0x3000: // 3XNN: Skip if VX == NN
+			case 0x4000: { // 4XNN: Skip if VX != NN
+				// cmp byte [rsi + x], nn
+				emit8(&p, 0x80);
+				emit8(&p, 0x7E);
+				emit8(&p, x);
+				emit8(&p, nn);
+				emit_skip(&p, addr, (opcode & 0xF000) == 0x3000 ? 0x44 : 0x45,
+						count + 1);
+				ends = 1;
+				break;
+			}
+
+			case 0x5000: // 5XY0: Skip if VX == VY
+			case 0x9000: { // 9XY0: Skip if VX != VY
+				if (opcode & 0x000F)
+					goto untranslatable;
+
+				// cmp byte [rsi + x], al
+				emit_load_al(&p, y);
+				emit_v_al(&p, 0x38, x);
+				emit_skip(&p, addr, (opcode & 0xF000) == 0x5000 ? 0x44 : 0x45,
+						count + 1);
+				ends = 1;
+				break;
+			}
+
+			case 0x6000: { // 6XNN: mov byte [rsi + x], nn
+				emit8(&p, 0xC6);
+				emit8(&p, 0x46);
+				emit8(&p, x);
+				emit8(&p, nn);
+				break;
+			}
+
+			case 0x7000: { // 7XNN: add byte [rsi + x], nn
+				emit8(&p, 0x80);
+				emit8(&p, 0x46);
+				emit8(&p, x);
+				emit8(&p, nn);
+				break;
+			}
+
+			case 0x8000: {
+				switch (opcode & 0x000F)
+				{
+					case 0x0: // 8XY0: mov
+						emit_load_al(&p, y);
+						emit_v_al(&p, 0x88, x);
+						break;
+
+					case 0x1: // 8XY1: or
+						emit_load_al(&p, y);
+						emit_v_al(&p, 0x08, x);
+						emit_vf_reset(&p, quirks);
+						break;
+
+					case 0x2: // 8XY2: and
+						emit_load_al(&p, y);
+						emit_v_al(&p, 0x20, x);
+						emit_vf_reset(&p, quirks);
+						break;
+
+					case 0x3: // 8XY3: xor
+						emit_load_al(&p, y);
+						emit_v_al(&p, 0x30, x);
+						emit_vf_reset(&p, quirks);
+						break;
+
+					case 0x4: // 8XY4: add, VF is the carry
+						emit_load_al(&p, y);
+						emit_v_al(&p, 0x00, x);
+						emit_set_vf(&p, 0x92);
+						break;
+
+					case 0x5: // 8XY5: sub, VF is the inverted borrow
+						emit_load_al(&p, y);
+						emit_v_al(&p, 0x28, x);
+						emit_set_vf(&p, 0x93);
+						break;
+
+					case 0x7: // 8XY7: VY - VX, VF is the inverted borrow
+						emit_load_al(&p, y);
+						emit_v_al(&p, 0x2A, x);
+						emit_v_al(&p, 0x88, x);
+						emit_set_vf(&p, 0x93);
+						break;
+
+					case 0x6: // 8XY6: shr, VF is the bit shifted out
+					case 0xE: { // 8XYE: shl, VF is the bit shifted out
+						uint8_t shift = (opcode & 0x000F) == 0x6 ? 0x28 : 0x20;
+
+						if (quirks->shift_vy) {
+							// shr/shl al, 1; mov byte [rsi + x], al
+							emit_load_al(&p, y);
+							emit8(&p, 0xD0);
+							emit8(&p, 0xC0 | shift);
+							emit_v_al(&p, 0x88, x);
+						} else {
+							// shr/shl byte [rsi + x], 1
+							emit8(&p, 0xD0);
+							emit8(&p, 0x46 | shift);
+							emit8(&p, x);
+						}
+
+						emit_set_vf(&p, 0x92);
+						break;
+					}
+
+					default:
+						goto untranslatable;
+				}
+				break;
+			}
+
+			case 0xA000: { // ANNN: mov word [rdi + I], nnn
+				emit_store16(&p, offsetof(chip8_t, I), opcode & 0x0FFF);
+				break;
+			}
+
+			default:
+				goto untranslatable;
+		}
+
+		jit->covered[addr] = jit->covered[addr + 1] = 1;
+		addr += 2;
+		count++;
+
+		if (ends) {
+			*length = count;
+			goto done;
+		}
+	}
+
+untranslatable:
+	// Mark the instruction we stopped at so writes to it flush the cache
+	jit->covered[addr & 0xFFF] = jit->covered[(addr + 1) & 0xFFF] = 1;
+
+	if (count == 0)
+		return NULL;
+
+	emit_exit(&p, addr, count);
+	*length = count;
+
+done:
+	jit->used += p - begin;
+	return (block_fn)begin;
+}
+
+/* Set the protection of the pages holding len bytes from at */
+static int protect(uint8_t *at, size_t len, int prot)
+{
+	uintptr_t page = sysconf(_SC_PAGESIZE);
+	uintptr_t first = (uintptr_t)at & ~(page - 1);
+	uintptr_t end = ((uintptr_t)at + len + page - 1) & ~(page - 1);
+
+	return mprotect((void *)first, end - first, prot);
+}
+
+/* Translate the block starting at pc. Returns NULL if the first
+ * instruction can't be translated */
+static block_fn translate(chip8_t *cpu, uint16_t start, uint8_t *length)
+{
+	jit_t *jit = cpu->jit;
+
+	if (jit->used + MAX_BLOCK * MAX_INSN_BYTES > CODE_SIZE)
+		flush(jit);
+
+	// Only the pages the block can go in are writable, and only while
+	// it's emitted
+	uint8_t *begin = jit->code + jit->used;
+
+	if (protect(begin, MAX_BLOCK * MAX_INSN_BYTES, PROT_READ | PROT_WRITE) != 0)
+		return NULL;
+
+	block_fn fn = emit_block(cpu, start, length);
+
+	if (protect(begin, MAX_BLOCK * MAX_INSN_BYTES, PROT_READ | PROT_EXEC) != 0) {
+		// The blocks on those pages can't run any more
+		log_warn("Couldn't make JIT code executable, dropping it.\n");
+		flush(jit);
+		return NULL;
+	}
+
+	return fn;
+}
+
+/* Run the block at the PC, translating it first if needed. Blocks which
+ * could run more than budget instructions are skipped. Returns the number
+ * of instructions run, 0 if nothing at the PC could be run */
+int jit_run(chip8_t *cpu, uint64_t budget)
+{
+	jit_t *jit = cpu->jit;
+	uint16_t pc = cpu->pc;
+
+	if (pc & 1 || pc > 0xFFE)
+		return 0;
+
+	block_fn fn = jit->blocks[pc];
+
+	if (!fn) {
+		fn = translate(cpu, pc, &jit->lengths[pc]);
+
+		if (!fn)
+			fn = UNTRANSLATABLE;
+
+		jit->blocks[pc] = fn;
+	}
+
+	if (fn == UNTRANSLATABLE || jit->lengths[pc] > budget)
+		return 0;
+
+	int count = fn(cpu);
+	cpu->cycles += count;
+
+	return count;
+}
+
+#else
+
+/* Create an empty code cache, NULL if there's no JIT in this build */
+jit_t *jit_create(void)
+{
+	return NULL;
+}
+
+/* Free the code cache */
+void jit_free(jit_t *jit)
+{
+}
+
+/* Run the block at the PC, never translated without the JIT */
+int jit_run(chip8_t *cpu, uint64_t budget)
+{
+	return 0;
+}
+
+/* Throw away translated code, there's none without the JIT */
+void jit_invalidate(jit_t *jit, uint16_t addr, uint16_t len)
+{
+}
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef JIT_H_
+#define JIT_H_
+
+#include "chip8.h"
+
+/*
+ * An optional dynamic recompiler. Straight runs of simple instructions are
+ * translated into native x86-64 code the first time the PC hits them, and
+ * anything which can't be translated is left to step().
+ *
+ * Only built when compiling with -DCHIP8_JIT on x86-64, otherwise
+ * jit_create() returns NULL and the interpreter is used for everything.
+ */
+
+/* A translated block. Runs the instructions, moves the PC past them and
+ * returns how many instructions were run */
+typedef int (*block_fn)(chip8_t *);
+
+/* Create an empty code cache, NULL if there's no JIT in this build */
+jit_t *jit_create(void);
+
+/* Free the code cache */
+void jit_free(jit_t *);
+
+/* Run the block at the PC, translating it first if needed. Blocks which
+ * could run more than budget instructions are skipped. Returns the number
+ * of instructions run, 0 if nothing at the PC could be run */
+int jit_run(chip8_t *, uint64_t);
+
+/* Throw away translated code if it covers any of len bytes from addr */
+void jit_invalidate(jit_t *, uint16_t, uint16_t);
+
+#endif
@@ -0,0 +1,513 @@
+#include "lockstep.h"
+
+/* Machines per block, one vector register of 16-bit lanes. Wider vectors
+ * than the hardware has get their compares split up lane by lane */
+#ifdef __AVX2__
+#define LANES 16
+#else
+#define LANES 8
+#endif
+
+/* Instructions run per round of a frame, the most a lane can count */
+#define ROUND_MAX 0xFFFF
+
+/* Every lane is 16 bits wide, registers included, so no operation has to
+ * widen or narrow masks. SSE2 has no unsigned 16-bit compares, so only
+ * equality is used on them */
+typedef uint16_t u16v __attribute__((vector_size(LANES * 2)));
+typedef int16_t m16v __attribute__((vector_size(LANES * 2)));
+
+/* a where the mask is set, b everywhere else */
+#define SELECT(m, a, b) (((a) & (m)) | ((b) & ~(m)))
+
+/* The lanes of one block of machines */
+typedef struct {
+	u16v V[16]; // Only the low byte is used
+	u16v I;
+	u16v pc;
+	u16v delay;
+	u16v sound;
+	u16v remaining; // Instructions left in this round
+	u16v active; // Lanes with instructions left in this round
+	u16v live; // Lanes with a machine which hasn't halted
+} block_t;
+
+/* Instructions with a vector kernel */
+enum {
+	K_SCALAR, // Everything else, run by step()
+	K_1NNN, K_3XNN, K_4XNN, K_5XY0, K_6XNN, K_7XNN,
+	K_8XY0, K_8XY1, K_8XY2, K_8XY3, K_8XY4, K_8XY5, K_8XY6, K_8XY7, K_8XYE,
+	K_9XY0, K_ANNN, K_FX07, K_FX15, K_FX18
+};
+
+struct lockstep_s {
+	chip8_t **machines; // NULL for the padding lanes of the last block
+	int count;
+	const quirks_t *quirks; // Profile of the machines
+
+	block_t *blocks;
+	int block_count;
+
+	// Per lane, for the current frame
+	uint64_t *start; // Cycles at the start of the round
+	uint32_t *budget; // Instructions in the round
+	uint64_t *left; // Instructions left in the frame after the round
+	uint64_t *ticks; // Timer tick every instruction of the frame sees
+
+	// The program every machine started with, and the addresses where
+	// any machine may have something else since
+	uint8_t code[4096];
+	uint8_t written[4096];
+
+	lockstep_stats_t stats;
+};
+
+/* Run the given machines together. They must all have the same program
+ * loaded and quirk profile, and stay alive until the engine is freed */
+lockstep_t *lockstep_create(chip8_t **machines, int count)
+{
+	lockstep_t *ls = calloc(1, sizeof(lockstep_t));
+	int lanes, i;
+
+	ls->count = count;
+	ls->block_count = (count + LANES - 1) / LANES;
+	lanes = ls->block_count * LANES;
+
+	ls->machines = calloc(lanes, sizeof(chip8_t *));
+	memcpy(ls->machines, machines, count * sizeof(chip8_t *));
+
+	ls->blocks = aligned_alloc(_Alignof(block_t), ls->block_count * sizeof(block_t));
+	memset(ls->blocks, 0, ls->block_count * sizeof(block_t));
+
+	ls->start = calloc(lanes, sizeof(uint64_t));
+	ls->budget = calloc(lanes, sizeof(uint32_t));
+	ls->left = calloc(lanes, sizeof(uint64_t));
+	ls->ticks = calloc(lanes, sizeof(uint64_t));
+
+	if (count > 0) {
+		memcpy(ls->code, machines[0]->memory, sizeof(ls->code));
+		ls->quirks = &quirk_profiles[machines[0]->quirks];
+	}
+
+	for (i = 1; i < count; i++) {
+		int addr;
+
+		for (addr = 0; addr < 4096; addr++)
+			ls->written[addr] |= machines[i]->memory[addr] != ls->code[addr];
+	}
+
+	return ls;
+}
+
+/* Free the engine, the machines are left alone */
+void lockstep_free(lockstep_t *ls)
+{
+	free(ls->machines);
+	free(ls->blocks);
+	free(ls->start);
+	free(ls->budget);
+	free(ls->left);
+	free(ls->ticks);
+	free(ls);
+}
+
+/* Value of a timer set to value at tick set, at tick now. The timers
+ * don't change within a frame, so the lanes hold them as every
+ * instruction of the frame sees them */
+static uint16_t timer_at(uint16_t value, uint64_t set, uint64_t now)
+{
+	return now - set >= value ? 0 : value - (now - set);
+}
+
+/* Copy the registers of a machine into its lane */
+static void load_lane(lockstep_t *ls, int lane)
+{
+	chip8_t *cpu = ls->machines[lane];
+	block_t *b = &ls->blocks[lane / LANES];
+	int l = lane % LANES, r;
+
+	for (r = 0; r < 16; r++)
+		b->V[r][l] = cpu->V[r];
+
+	b->I[l] = cpu->I;
+	b->pc[l] = cpu->pc;
+	b->delay[l] = timer_at(cpu->delayTimer, cpu->delayTick, ls->ticks[lane]);
+	b->sound[l] = timer_at(cpu->soundTimer, cpu->soundTick, ls->ticks[lane]);
+}
+
+/* Copy the lane of a machine back into it */
+static void store_lane(lockstep_t *ls, int lane)
+{
+	chip8_t *cpu = ls->machines[lane];
+	block_t *b = &ls->blocks[lane / LANES];
+	int l = lane % LANES, r;
+
+	for (r = 0; r < 16; r++)
+		cpu->V[r] = b->V[r][l];
+
+	cpu->I = b->I[l];
+	cpu->pc = b->pc[l];
+	cpu->delayTimer = b->delay[l];
+	cpu->delayTick = ls->ticks[lane];
+	cpu->soundTimer = b->sound[l];
+	cpu->soundTick = ls->ticks[lane];
+	cpu->cycles = ls->start[lane] + ls->budget[lane] - b->remaining[l];
+}
+
+/* Run one instruction of a single machine with step() */
+static void step_lane(lockstep_t *ls, int lane)
+{
+	chip8_t *cpu = ls->machines[lane];
+	block_t *b = &ls->blocks[lane / LANES];
+	int l = lane % LANES;
+
+	store_lane(ls, lane);
+
+	uint16_t opcode = (cpu->memory[cpu->pc & 0xFFF] << 8)
+		| cpu->memory[(cpu->pc + 1) & 0xFFF];
+	uint16_t I = cpu->I;
+
+	step(cpu);
+	load_lane(ls, lane);
+
+	b->remaining[l]--;
+	ls->stats.scalar_steps++;
+
+	if (cpu->halted) {
+		b->live[l] = 0;
+		b->active[l] = 0;
+	} else if (b->remaining[l] == 0) {
+		b->active[l] = 0;
+	}
+
+	// FX33 and FX55 are the only instructions which write to memory
+	int len = 0;
+
+	if ((opcode & 0xF0FF) == 0xF033)
+		len = 3;
+	else if ((opcode & 0xF0FF) == 0xF055)
+		len = ((opcode & 0x0F00) >> 8) + 1;
+
+	for (; len > 0 && I < 4096; len--)
+		ls->written[I++] = 1;
+}
+
+/* Pick the vector kernel for an opcode */
+static int kernel_for(uint16_t opcode)
+{
+	switch (opcode & 0xF000)
+	{
+		case 0x1000: return K_1NNN;
+		case 0x3000: return K_3XNN;
+		case 0x4000: return K_4XNN;
+		case 0x5000: return K_5XY0;
+		case 0x6000: return K_6XNN;
+		case 0x7000: return K_7XNN;
+
+		case 0x8000: {
+			switch (opcode & 0x000F)
+			{
+				case 0x0: return K_8XY0;
+				case 0x1: return K_8XY1;
+				case 0x2: return K_8XY2;
+				case 0x3: return K_8XY3;
+				case 0x4: return K_8XY4;
+				case 0x5: return K_8XY5;
+				case 0x6: return K_8XY6;
+				case 0x7: return K_8XY7;
+				case 0xE: return K_8XYE;
+			}
+			break;
+		}
+
+		case 0x9000: return K_9XY0;
+		case 0xA000: return K_ANNN;
+
+		case 0xF000: {
+			switch (opcode & 0x00FF)
+			{
+				case 0x07: return K_FX07;
+				case 0x15: return K_FX15;
+				case 0x18: return K_FX18;
+			}
+			break;
+		}
+	}
+
+	return K_SCALAR;
+}
+
+/* Run one instruction on the lanes of a block in the mask. Does exactly
+ * what the handlers in chip8.c do for the quirk profile */
+static void run_kernel(block_t *b, const quirks_t *quirks, int kernel,
+		uint16_t opcode, const u16v *mask)
+{
+	u16v m = *mask;
+	u16v value;
+	uint8_t x = (opcode & 0x0F00) >> 8;
+	uint8_t y = (opcode & 0x00F0) >> 4;
+	uint16_t nn = opcode & 0x00FF;
+	uint16_t nnn = opcode & 0x0FFF;
+	u16v skip = { 0 };
+
+	switch (kernel)
+	{
+		case K_1NNN: b->pc = SELECT(m, (u16v){ 0 } + nnn, b->pc); return;
+		case K_3XNN: skip = (u16v)(b->V[x] == nn); break;
+		case K_4XNN: skip = (u16v)(b->V[x] != nn); break;
+		case K_5XY0: skip = (u16v)(b->V[x] == b->V[y]); break;
+		case K_9XY0: skip = (u16v)(b->V[x] != b->V[y]); break;
+		case K_6XNN: b->V[x] = SELECT(m, (u16v){ 0 } + nn, b->V[x]); break;
+		case K_7XNN: b->V[x] = SELECT(m, (b->V[x] + nn) & 0xFF, b->V[x]); break;
+		case K_8XY0: b->V[x] = SELECT(m, b->V[y], b->V[x]); break;
+		case K_8XY1: b->V[x] = SELECT(m, b->V[x] | b->V[y], b->V[x]); break;
+		case K_8XY2: b->V[x] = SELECT(m, b->V[x] & b->V[y], b->V[x]); break;
+		case K_8XY3: b->V[x] = SELECT(m, b->V[x] ^ b->V[y], b->V[x]); break;
+
+		// VF is set last in the arithmetic, so it holds the flag even when
+		// it's VX, like op_8xy4()
+		case K_8XY4:
+			value = b->V[x] + b->V[y];
+			b->V[x] = SELECT(m, value & 0xFF, b->V[x]);
+			b->V[0xF] = SELECT(m, value >> 8, b->V[0xF]);
+			break;
+
+		case K_8XY5:
+			value = (u16v)(b->V[x] >= b->V[y]) & 1;
+			b->V[x] = SELECT(m, (b->V[x] - b->V[y]) & 0xFF, b->V[x]);
+			b->V[0xF] = SELECT(m, value, b->V[0xF]);
+			break;
+
+		case K_8XY7:
+			value = (u16v)(b->V[y] >= b->V[x]) & 1;
+			b->V[x] = SELECT(m, (b->V[y] - b->V[x]) & 0xFF, b->V[x]);
+			b->V[0xF] = SELECT(m, value, b->V[0xF]);
+			break;
+
+		case K_8XY6:
+			value = quirks->shift_vy ? b->V[y] : b->V[x];
+			b->V[x] = SELECT(m, value >> 1, b->V[x]);
+			b->V[0xF] = SELECT(m, value & 1, b->V[0xF]);
+			break;
+
+		case K_8XYE:
+			value = quirks->shift_vy ? b->V[y] : b->V[x];
+			b->V[x] = SELECT(m, (value << 1) & 0xFF, b->V[x]);
+			b->V[0xF] = SELECT(m, value >> 7, b->V[0xF]);
+			break;
+
+		case K_ANNN: b->I = SELECT(m, (u16v){ 0 } + nnn, b->I); break;
+		case K_FX07: b->V[x] = SELECT(m, b->delay & 0xFF, b->V[x]); break;
+		case K_FX15: b->delay = SELECT(m, b->V[x], b->delay); break;
+		case K_FX18: b->sound = SELECT(m, b->V[x], b->sound); break;
+	}
+
+	// The logic instructions clear VF on some machines
+	if (quirks->vf_reset && kernel >= K_8XY1 && kernel <= K_8XY3)
+		b->V[0xF] = SELECT(m, (u16v){ 0 }, b->V[0xF]);
+
+	// Every lane moves to the next instruction, and the ones which skip
+	// past it
+	b->pc += m & (2 + (skip & 2));
+}
+
+/* True if any lane of the mask is set */
+static int any_lane(const u16v *m)
+{
+	uint64_t words[LANES / 4];
+	uint64_t any = 0;
+	int i;
+
+	memcpy(words, m, sizeof(words));
+
+	for (i = 0; i < LANES / 4; i++)
+		any |= words[i];
+
+	return any != 0;
+}
+
+/* Number of lanes set in a mask */
+static int lane_count(const u16v *m)
+{
+	int l, count = 0;
+
+	for (l = 0; l < LANES; l++)
+		count += (*m)[l] & 1;
+
+	return count;
+}
+
+/* Fold the PCs of the active lanes of a block into the lowest so far.
+ * Flipping the top bit makes the signed compare an unsigned one */
+static void lowest_lanes(const block_t *b, m16v *lowest)
+{
+	m16v pc = (m16v)SELECT(b->active, b->pc ^ 0x8000, (u16v){ 0 } + 0x7FFF);
+
+	*lowest = SELECT(pc < *lowest, pc, *lowest);
+}
+
+/* Reduce the lowest PCs of every lane to one, -1 if no lane is active */
+static int lowest_of(const m16v *lowest, int active)
+{
+	int16_t pc = 0x7FFF;
+	int l;
+
+	if (!active)
+		return -1;
+
+	for (l = 0; l < LANES; l++)
+		if ((*lowest)[l] < pc)
+			pc = (*lowest)[l];
+
+	return (uint16_t)pc ^ 0x8000;
+}
+
+/* Lowest PC of any machine with instructions left, -1 if there are none */
+static int lowest_pc(lockstep_t *ls)
+{
+	m16v lowest = (m16v){ 0 } + 0x7FFF;
+	int i, active = 0;
+
+	for (i = 0; i < ls->block_count; i++) {
+		lowest_lanes(&ls->blocks[i], &lowest);
+		active |= any_lane(&ls->blocks[i].active);
+	}
+
+	return lowest_of(&lowest, active);
+}
+
+/* Run the instruction at pc on every machine which is there. Returns the
+ * lowest PC after it, -1 if every machine is done */
+static int run_group(lockstep_t *ls, uint16_t pc)
+{
+	uint16_t opcode = (ls->code[pc & 0xFFF] << 8) | ls->code[(pc + 1) & 0xFFF];
+	int kernel = kernel_for(opcode);
+	int written = ls->written[pc & 0xFFF] | ls->written[(pc + 1) & 0xFFF];
+	m16v lowest = (m16v){ 0 } + 0x7FFF;
+	int i, l, active = 0;
+
+	// Instructions at odd addresses are rare, leave them to step()
+	if (pc & 1)
+		kernel = K_SCALAR;
+
+	ls->stats.groups++;
+
+	for (i = 0; i < ls->block_count; i++) {
+		block_t *b = &ls->blocks[i];
+		u16v m = (u16v)(b->pc == pc) & b->active;
+
+		if (!any_lane(&m)) {
+			// The next group is found on the way
+			lowest_lanes(b, &lowest);
+			active |= any_lane(&b->active);
+			continue;
+		}
+
+		// Machines with a different instruction here go on their own
+		if (written) {
+			for (l = 0; l < LANES; l++) {
+				chip8_t *cpu = ls->machines[i * LANES + l];
+
+				if (!m[l])
+					continue;
+
+				if (cpu->memory[pc & 0xFFF] != ls->code[pc & 0xFFF]
+						|| cpu->memory[(pc + 1) & 0xFFF] != ls->code[(pc + 1) & 0xFFF]) {
+					m[l] = 0;
+					step_lane(ls, i * LANES + l);
+				}
+			}
+		}
+
+		if (kernel == K_SCALAR) {
+			for (l = 0; l < LANES; l++)
+				if (m[l])
+					step_lane(ls, i * LANES + l);
+		} else {
+			run_kernel(b, ls->quirks, kernel, opcode, &m);
+
+			// Count the instruction against every lane which ran it
+			b->remaining += m;
+			b->active &= (u16v)(b->remaining != 0);
+			ls->stats.vector_steps += lane_count(&m);
+		}
+
+		lowest_lanes(b, &lowest);
+		active |= any_lane(&b->active);
+	}
+
+	return lowest_of(&lowest, active);
+}
+
+/* Start a round of at most ROUND_MAX instructions per lane. Returns 0 when
+ * every lane has run its whole frame */
+static int start_round(lockstep_t *ls)
+{
+	int lane, started = 0;
+
+	for (lane = 0; lane < ls->count; lane++) {
+		chip8_t *cpu = ls->machines[lane];
+		block_t *b = &ls->blocks[lane / LANES];
+		int l = lane % LANES;
+		uint32_t round = ls->left[lane] < ROUND_MAX ? ls->left[lane] : ROUND_MAX;
+
+		ls->start[lane] = cpu->cycles;
+		ls->budget[lane] = b->live[l] ? round : 0;
+		ls->left[lane] -= ls->budget[lane];
+		b->remaining[l] = ls->budget[lane];
+		b->active[l] = ls->budget[lane] ? 0xFFFF : 0;
+		started |= ls->budget[lane] != 0;
+	}
+
+	return started;
+}
+
+/* Run one 60 Hz frame on every machine which hasn't halted. Returns the
+ * number of machines still running */
+int lockstep_run_frame(lockstep_t *ls)
+{
+	int lane, pc, running = 0;
+
+	// Frames end on whole instructions, just like run_frame()
+	for (lane = 0; lane < ls->count; lane++) {
+		chip8_t *cpu = ls->machines[lane];
+		block_t *b = &ls->blocks[lane / LANES];
+		uint64_t end = (cpu->frame + 1) * cpu->ips / 60;
+
+		ls->ticks[lane] = timer_ticks(cpu, cpu->cycles + 1);
+		load_lane(ls, lane);
+		ls->left[lane] = end > cpu->cycles ? end - cpu->cycles : 0;
+		b->live[lane % LANES] = cpu->halted ? 0 : 0xFFFF;
+	}
+
+	// Lanes only count up to ROUND_MAX, so very fast machines run their
+	// frames in more than one round
+	while (start_round(ls)) {
+		for (pc = lowest_pc(ls); pc >= 0; )
+			pc = run_group(ls, pc);
+
+		for (lane = 0; lane < ls->count; lane++)
+			store_lane(ls, lane);
+	}
+
+	for (lane = 0; lane < ls->count; lane++) {
+		chip8_t *cpu = ls->machines[lane];
+
+		store_lane(ls, lane);
+
+		if (cpu->halted)
+			continue;
+
+		cpu->frame++;
+		publish_frame(cpu);
+		running++;
+	}
+
+	return running;
+}
+
+/* How the work has been split so far */
+void lockstep_stats(lockstep_t *ls, lockstep_stats_t *stats)
+{
+	*stats = ls->stats;
+}
@@ -0,0 +1,47 @@
+#ifndef LOCKSTEP_H_
+#define LOCKSTEP_H_
+
+#include "chip8.h"
+
+/*
+ * Runs many machines with the same program in lockstep. The registers,
+ * I, PC and timers of every machine are kept as 16-bit lanes of vectors,
+ * a block of 16 machines per AVX2 register or 8 per SSE2 register, and
+ * machines at the same PC run simple register instructions together with
+ * one vector operation per block. Everything else (drawing, calls, random
+ * numbers, memory) is run by step() one machine at a time, after which
+ * the machine rejoins the others as soon as its PC matches theirs again.
+ * Machines at the lowest PC run first, so machines which took different
+ * sides of a skip meet up again.
+ *
+ * The kernels are plain vector extensions, built as AVX2 with -mavx2
+ * (make AVX2=1) and as SSE2 otherwise.
+ *
+ * The machines stay authoritative between frames: state is loaded into
+ * the lanes at the start of a frame and written back at the end.
+ */
+
+typedef struct lockstep_s lockstep_t;
+
+/* Counters of how the work was split */
+typedef struct {
+	uint64_t groups; // Instructions run as one vector operation
+	uint64_t vector_steps; // Machine instructions run by those
+	uint64_t scalar_steps; // Machine instructions run by step()
+} lockstep_stats_t;
+
+/* Run the given machines together. They must all have the same program
+ * loaded and quirk profile, and stay alive until the engine is freed */
+lockstep_t *lockstep_create(chip8_t **, int);
+
+/* Free the engine, the machines are left alone */
+void lockstep_free(lockstep_t *);
+
+/* Run one 60 Hz frame on every machine which hasn't halted. Returns the
+ * number of machines still running */
+int lockstep_run_frame(lockstep_t *);
+
+/* How the work has been split so far */
+void lockstep_stats(lockstep_t *, lockstep_stats_t *);
+
+#endif
@@ -0,0 +1,221 @@
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "logger.h"
+
+/* Messages longer than this are cut off */
+#define MESSAGE_SIZE 120
+
+/* Messages every thread can have queued */
+#define QUEUE_SIZE 4096
+
+/* How long the writer sleeps when every queue is empty */
+#define IDLE_NS (5 * 1000 * 1000)
+
+int g_log_level = LOG_WARN;
+
+typedef struct {
+	uint8_t level;
+	uint8_t length;
+	char text[MESSAGE_SIZE];
+} message_t;
+
+/* A single producer, single consumer queue. The thread which owns it moves
+ * the tail, the writer thread moves the head. */
+typedef struct queue_s {
+	message_t messages[QUEUE_SIZE];
+	unsigned head;
+	unsigned tail;
+	int retired; // The thread exited, under the lock
+	struct queue_s *next; // Next queue in the list of all queues
+} queue_t;
+
+/* Every thread gets its own queue on its first message */
+static __thread queue_t *tl_queue;
+
+/* All queues. Only grows, and only under the lock. Queues of threads which
+ * exited are taken over by new threads once they're written out, so
+ * there are never more than threads alive at once */
+static queue_t *queues;
+static pthread_mutex_t queues_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Retires the queue of a thread when it exits */
+static pthread_key_t queue_key;
+static pthread_once_t queue_key_once = PTHREAD_ONCE_INIT;
+
+static pthread_t writer;
+static int running; // Set while the writer thread runs
+static int stopping;
+static unsigned long dropped; // Messages lost to full queues
+
+static const char *level_names[] = {
+	"trace", "debug", "info", "warn", "error", "off"
+};
+
+/* Give the queue of an exiting thread up for reuse */
+static void retire_queue(void *queue)
+{
+	pthread_mutex_lock(&queues_lock);
+	((queue_t *)queue)->retired = 1;
+	pthread_mutex_unlock(&queues_lock);
+}
+
+static void create_queue_key(void)
+{
+	pthread_key_create(&queue_key, retire_queue);
+}
+
+/* Register a queue for the calling thread */
+static queue_t *own_queue(void)
+{
+	queue_t *queue;
+
+	pthread_once(&queue_key_once, create_queue_key);
+	pthread_mutex_lock(&queues_lock);
+
+	// The writer may still be on a retired queue, so only one it's done
+	// with can be taken over
+	for (queue = queues; queue; queue = queue->next)
+		if (queue->retired && __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE) == queue->tail)
+			break;
+
+	if (queue) {
+		queue->retired = 0;
+	} else {
+		queue = calloc(1, sizeof(queue_t));
+		queue->next = queues;
+		__atomic_store_n(&queues, queue, __ATOMIC_RELEASE);
+	}
+
+	pthread_mutex_unlock(&queues_lock);
+	pthread_setspecific(queue_key, queue);
+
+	return queue;
+}
+
+/* Queue a message, use the macros instead */
+void log_write(int level, const char *format, ...)
+{
+	va_list args;
+
+	// Without a writer thread there's nobody to hand it to
+	if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+		va_start(args, format);
+		vfprintf(level >= LOG_WARN ? stderr : stdout, format, args);
+		va_end(args);
+		return;
+	}
+
+	if (!tl_queue)
+		tl_queue = own_queue();
+
+	queue_t *queue = tl_queue;
+	unsigned tail = queue->tail;
+
+	// Never wait for the writer, drop the message if it's behind
+	if (tail - __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE) == QUEUE_SIZE) {
+		__atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	message_t *message = &queue->messages[tail % QUEUE_SIZE];
+	message->level = level;
+
+	va_start(args, format);
+	int length = vsnprintf(message->text, MESSAGE_SIZE, format, args);
+	va_end(args);
+
+	// Negative if it couldn't be formatted
+	if (length < 0)
+		length = 0;
+
+	message->length = length < MESSAGE_SIZE ? length : MESSAGE_SIZE - 1;
+
+	__atomic_store_n(&queue->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/* Write out everything queued. Returns the number of messages written */
+static int drain(void)
+{
+	queue_t *queue = __atomic_load_n(&queues, __ATOMIC_ACQUIRE);
+	int written = 0;
+
+	for (; queue; queue = queue->next) {
+		unsigned head = queue->head;
+		unsigned tail = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+
+		for (; head != tail; head++) {
+			message_t *message = &queue->messages[head % QUEUE_SIZE];
+
+			fwrite(message->text, 1, message->length,
+					message->level >= LOG_WARN ? stderr : stdout);
+			written++;
+		}
+
+		__atomic_store_n(&queue->head, head, __ATOMIC_RELEASE);
+	}
+
+	if (written)
+		fflush(stdout);
+
+	return written;
+}
+
+static void *writer_main(void *arg)
+{
+	struct timespec idle = { 0, IDLE_NS };
+
+	while (!__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+		if (drain() == 0)
+			nanosleep(&idle, NULL);
+	}
+
+	drain();
+	return NULL;
+}
+
+/* Start the writer thread. Until it's started messages are written
+ * directly. Everything queued is written out at exit. */
+void log_start(void)
+{
+	if (running)
+		return;
+
+	stopping = 0;
+	pthread_create(&writer, NULL, writer_main, NULL);
+	__atomic_store_n(&running, 1, __ATOMIC_RELEASE);
+
+	atexit(log_stop);
+}
+
+/* Write out everything queued and stop the writer thread */
+void log_stop(void)
+{
+	if (!running)
+		return;
+
+	__atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+	pthread_join(writer, NULL);
+	__atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+
+	if (dropped)
+		fprintf(stderr, "Dropped %lu log messages.\n", dropped);
+}
+
+/* Parse a level name, -1 if it isn't one */
+int log_parse_level(const char *name)
+{
+	int level;
+
+	for (level = LOG_TRACE; level <= LOG_OFF; level++)
+		if (strcasecmp(name, level_names[level]) == 0)
+			return level;
+
+	return -1;
+}
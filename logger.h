@@ -0,0 +1,52 @@
+#ifndef LOGGER_H_
+#define LOGGER_H_
+
+/*
+ * Leveled logging. Messages are formatted on the calling thread, put in a
+ * lock-free queue owned by that thread and written out by a background
+ * thread, so logging never blocks on stdout.
+ *
+ * Messages below LOG_MIN_LEVEL are removed at compile time, messages below
+ * the runtime level cost a compare. Defaults to LOG_WARN at runtime.
+ */
+
+#define LOG_TRACE 0 // Every instruction
+#define LOG_DEBUG 1
+#define LOG_INFO 2
+#define LOG_WARN 3
+#define LOG_ERROR 4
+#define LOG_OFF 5
+
+/* Anything below this level isn't compiled in */
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL LOG_DEBUG
+#endif
+
+/* Messages below this level are dropped at runtime */
+extern int g_log_level;
+
+#define log_at(level, ...) do { \
+	if ((level) >= LOG_MIN_LEVEL && (level) >= g_log_level) \
+		log_write((level), __VA_ARGS__); \
+} while (0)
+
+#define log_trace(...) log_at(LOG_TRACE, __VA_ARGS__)
+#define log_debug(...) log_at(LOG_DEBUG, __VA_ARGS__)
+#define log_info(...) log_at(LOG_INFO, __VA_ARGS__)
+#define log_warn(...) log_at(LOG_WARN, __VA_ARGS__)
+#define log_error(...) log_at(LOG_ERROR, __VA_ARGS__)
+
+/* Queue a message, use the macros above instead */
+void log_write(int, const char *, ...) __attribute__((format(printf, 2, 3)));
+
+/* Start the writer thread. Until it's started messages are written
+ * directly. Everything queued is written out at exit. */
+void log_start(void);
+
+/* Write out everything queued and stop the writer thread */
+void log_stop(void);
+
+/* Parse a level name, -1 if it isn't one */
+int log_parse_level(const char *);
+
+#endif
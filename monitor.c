@@ -1,4 +1,34 @@
+#include "chip8.h"
 #include "monitor.h"
+#include "profile.h"
+
+/* Variables for the monitor */
+SDL_Surface *g_scr;
+SDL_Event *g_event;
+
+/* Every byte of a display row expanded to the scaled pixels it covers, so
+ * a scanline is built with a copy per byte. One table per geometry */
+static uint32_t expand_lores[256][8 * PIXEL_SIZE];
+static uint32_t expand_hires[256][8 * PIXEL_SIZE / 2];
+
+/* Bytes in one scanline of the surface, the same for both geometries */
+#define SCANLINE_BYTES (DISPLAY_WIDTH(LORES) * PIXEL_SIZE * sizeof(uint32_t))
+
+/* Build the expansion table for the colors of the surface */
+static void init_expand(SDL_Surface *screen)
+{
+	uint32_t on = SDL_MapRGB(screen->format, 0xFF, 0xFF, 0xFF);
+	uint32_t off = SDL_MapRGB(screen->format, 0x00, 0x00, 0x00);
+	int byte, pixel;
+
+	for (byte = 0; byte < 256; byte++) {
+		for (pixel = 0; pixel < 8 * PIXEL_SIZE; pixel++)
+			expand_lores[byte][pixel] = (byte & (0x80 >> (pixel / PIXEL_SIZE))) ? on : off;
+
+		for (pixel = 0; pixel < 8 * PIXEL_SIZE / 2; pixel++)
+			expand_hires[byte][pixel] = (byte & (0x80 >> (pixel / (PIXEL_SIZE / 2)))) ? on : off;
+	}
+}
 
 /* Functions for modifying the SDL Screen */
 void init_monitor(SDL_Surface **screen, char *filename)
@@ -11,10 +41,14 @@ void init_monitor(SDL_Surface **screen, char *filename)
 	/* Set the title bar */
 	SDL_WM_SetCaption("chip8-emu", filename);
 
-	/* Create the window */
-	*screen = SDL_SetVideoMode(640, 320, 32, SDL_DOUBLEBUF | SDL_HWSURFACE);
+	/* Create the window. The rows are written straight into the surface
+	 * and only the changed ones are updated, so no double buffering. It
+	 * fits either geometry */
+	*screen = SDL_SetVideoMode(DISPLAY_WIDTH(LORES) * PIXEL_SIZE,
+			DISPLAY_HEIGHT(LORES) * PIXEL_SIZE, 32,
+			SDL_SWSURFACE);
 
-	/* Should start a thread for refreshing the window here */
+	init_expand(*screen);
 }
 
 /* Functions for freeing all SDL resources */
@@ -24,44 +58,101 @@ void free_monitor(SDL_Surface *screen)
 	SDL_Quit();
 }
 
-/* Draw rectangle at x,y position */
-void draw_pixel(uint8_t x, uint8_t y, SDL_Surface *screen)
+/* Create a surface the size of the window which is never shown, to draw
+ * into without a display. Free it with SDL_FreeSurface() */
+SDL_Surface *create_offscreen(void)
 {
-	// Create a SDL_Rect which will represent a pixel on the screen
-	SDL_Rect pixel;
-	pixel.w = pixel.h = 10;
+	SDL_Surface *surface = SDL_CreateRGBSurface(SDL_SWSURFACE,
+			DISPLAY_WIDTH(LORES) * PIXEL_SIZE, DISPLAY_HEIGHT(LORES) * PIXEL_SIZE, 32,
+			0x00FF0000, 0x0000FF00, 0x000000FF, 0);
 
-	// Put the pixel at the right position
-	pixel.x = x * 10;
-	pixel.y = y * 10;
+	if (surface)
+		init_expand(surface);
 
-	// Print the SDL_Rect to the screen
-	SDL_FillRect(screen, &pixel, 0xFFFFFFFF);
+	return surface;
 }
 
-/* Draw all pixels from the vram to the screen. Runs at a rate of
- * 60Hz (60 fps). */
-void draw_monitor(SDL_Surface *screen, uint8_t *display)
+/* Expand the rows marked in dirty into the surface, noting the rects they
+ * cover. The geometry is fixed by the caller, so each gets its own copy
+ * with the sizes known. Returns the number of rows */
+static inline uint32_t draw_rows(SDL_Surface *screen, uint64_t *display,
+		uint64_t dirty, SDL_Rect *rects, int *count, const int hires)
 {
-	// Fill background with black
-	SDL_FillRect(screen, NULL, 0x000000);
+	const int size = PIXEL_SIZE >> hires, words = ROW_WORDS(hires);
+	const uint32_t *expand = hires ? expand_hires[0] : expand_lores[0];
+	uint32_t rows = 0;
+	int row, word, i;
 
-	uint8_t row = 0;
-	for (; row < 32; row++) {
-		uint8_t column = 0;
+	for (row = 0; row < DISPLAY_HEIGHT(hires); row++) {
+		if (!(dirty & (1ULL << row)))
+			continue;
 
-		// Draw the pixels on the screen
-		for (; column < 64; column++) {
-			uint8_t pixel = display[(64 * row) + column];
+		uint8_t *pixels = (uint8_t *)screen->pixels + row * size * screen->pitch;
+		uint32_t *scanline = (uint32_t *)pixels;
 
-			// Don't paint a pixel if there's not need for it
-			if (pixel == 0)
-				continue;
+		// Expand the row into the first scanline, a byte at a time
+		for (word = 0; word < words; word++) {
+			for (i = 0; i < 8; i++) {
+				uint8_t byte = display[row * words + word] >> (56 - 8 * i);
+				memcpy(&scanline[(word * 8 + i) * 8 * size], &expand[byte * 8 * size],
+						8 * size * sizeof(uint32_t));
+			}
+		}
+
+		// The rest of the pixel is copies of the first scanline
+		for (i = 1; i < size; i++)
+			memcpy(pixels + i * screen->pitch, scanline, SCANLINE_BYTES);
 
-			draw_pixel(column, row, screen);
+		// Merge with the rect of the row above if it was redrawn too
+		if (*count > 0 && (dirty & (1ULL << (row - 1)))) {
+			rects[*count - 1].h += size;
+		} else {
+			rects[*count].x = 0;
+			rects[*count].y = row * size;
+			rects[*count].w = DISPLAY_WIDTH(LORES) * PIXEL_SIZE;
+			rects[*count].h = size;
+			(*count)++;
 		}
+
+		rows++;
 	}
 
-	// Update the screen buffer
-	SDL_Flip(screen);
+	return rows;
+}
+
+/* Redraw the rows marked in dirty, one bit per row, of a display of the
+ * given geometry (LORES or HIRES) and put them on the screen. Fills in the
+ * stats if they're not NULL */
+void draw_monitor(SDL_Surface *screen, uint64_t *display, int hires,
+		uint64_t dirty, render_stats_t *stats)
+{
+	SDL_Rect rects[DISPLAY_HEIGHT(HIRES)];
+	int count = 0;
+	uint32_t rows;
+
+	if (dirty == 0)
+		return;
+
+	PROFILE_BEGIN(start);
+
+	if (SDL_MUSTLOCK(screen))
+		SDL_LockSurface(screen);
+
+	if (hires)
+		rows = draw_rows(screen, display, dirty, rects, &count, HIRES);
+	else
+		rows = draw_rows(screen, display, dirty, rects, &count, LORES);
+
+	if (SDL_MUSTLOCK(screen))
+		SDL_UnlockSurface(screen);
+
+	// Only put the changed rows on the screen
+	SDL_UpdateRects(screen, count, rects);
+
+	PROFILE_END(PROFILE_RENDER, start);
+
+	if (stats) {
+		stats->rows = rows;
+		stats->bytes = rows * (PIXEL_SIZE >> hires) * SCANLINE_BYTES;
+	}
 }
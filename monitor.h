@@ -5,9 +5,19 @@
 
 /* Should define some colors here */
 
+/* Size of one emulated pixel on the screen, half that in high resolution
+ * so the window is the same size for both */
+#define PIXEL_SIZE 10
+
 /* Variables for the monitor */
-SDL_Surface *g_scr;
-SDL_Event *g_event;
+extern SDL_Surface *g_scr;
+extern SDL_Event *g_event;
+
+/* What one redraw of the screen touched */
+typedef struct {
+	uint32_t rows; // Display rows redrawn
+	uint32_t bytes; // Bytes written to the surface
+} render_stats_t;
 
 /* Functions for initializing the SDL resources */
 void init_monitor(SDL_Surface **, char *);
@@ -15,10 +25,13 @@ void init_monitor(SDL_Surface **, char *);
 /* Functions for freeing all SDL resources */
 void free_monitor(SDL_Surface *);
 
-/* Draw rectangle at x,y position */
-void draw_pixel(uint8_t, uint8_t, SDL_Surface *);
+/* Create a surface the size of the window which is never shown, to draw
+ * into without a display. Free it with SDL_FreeSurface() */
+SDL_Surface *create_offscreen(void);
 
-/* A function which handles the refreshing of the screen */
-void draw_monitor(SDL_Surface *, uint8_t *);
+/* Redraw the rows marked in dirty, one bit per row, of a display of the
+ * given geometry (LORES or HIRES) and put them on the screen. Fills in the
+ * stats if they're not NULL */
+void draw_monitor(SDL_Surface *, uint64_t *, int, uint64_t, render_stats_t *);
 
 #endif
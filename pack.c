@@ -0,0 +1,224 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "pack.h"
+
+struct pack_s {
+	const uint8_t *start;
+	size_t size;
+	const pack_entry_t *entries;
+	const uint32_t *names; // Entry numbers sorted by name
+	uint32_t count;
+};
+
+/* Check that every offset in the pack stays inside the file and the index
+ * is sorted, so lookups and loads don't have to. Returns 0 if it's sound */
+static int check(pack_t *pack, char *filename)
+{
+	uint32_t i;
+
+	for (i = 0; i < pack->count; i++) {
+		const pack_entry_t *entry = &pack->entries[i];
+
+		if (entry->size == 0 || entry->size > PROGRAM_SIZE
+				|| entry->offset > pack->size
+				|| entry->size > pack->size - entry->offset) {
+			log_error("'%s': Entry %u has a bad program.\n", filename, i);
+			return -1;
+		}
+
+		if (entry->quirks >= QUIRKS_COUNT && entry->quirks != PACK_NO_QUIRKS) {
+			log_error("'%s': Entry %u has unknown quirks.\n", filename, i);
+			return -1;
+		}
+
+		if (entry->name >= pack->size
+				|| !memchr(pack->start + entry->name, '\0', pack->size - entry->name)) {
+			log_error("'%s': Entry %u has a bad name.\n", filename, i);
+			return -1;
+		}
+
+		if (i > 0 && entry->hash < pack->entries[i - 1].hash) {
+			log_error("'%s': Entries aren't sorted by hash.\n", filename);
+			return -1;
+		}
+	}
+
+	for (i = 0; i < pack->count; i++) {
+		if (pack->names[i] >= pack->count) {
+			log_error("'%s': Name %u points past the entries.\n", filename, i);
+			return -1;
+		}
+
+		if (i > 0 && strcmp(pack_name(pack, &pack->entries[pack->names[i - 1]]),
+					pack_name(pack, &pack->entries[pack->names[i]])) >= 0) {
+			log_error("'%s': Names aren't sorted or unique.\n", filename);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* Map and check a pack, NULL if it couldn't be opened or is damaged */
+pack_t *pack_open(char *filename)
+{
+	struct stat st;
+	pack_header_t header;
+	int fd = open(filename, O_RDONLY);
+
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		log_error("Couldn't open the pack '%s'.\n", filename);
+		if (fd >= 0)
+			close(fd);
+		return NULL;
+	}
+
+	if ((size_t)st.st_size < sizeof(header)) {
+		log_error("'%s' is too short to be a pack.\n", filename);
+		close(fd);
+		return NULL;
+	}
+
+	pack_t *pack = calloc(1, sizeof(pack_t));
+	pack->size = st.st_size;
+	pack->start = mmap(NULL, pack->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (pack->start == MAP_FAILED) {
+		log_error("Couldn't map the pack '%s'.\n", filename);
+		free(pack);
+		return NULL;
+	}
+
+	memcpy(&header, pack->start, sizeof(header));
+
+	if (memcmp(header.magic, PACK_MAGIC, 4) != 0 || header.version != PACK_VERSION) {
+		log_error("'%s' isn't a version %i pack.\n", filename, PACK_VERSION);
+		pack_close(pack);
+		return NULL;
+	}
+
+	// Catches packs which were cut short while being copied
+	if (header.size != pack->size || header.count
+			> (pack->size - sizeof(header)) / (sizeof(pack_entry_t) + sizeof(uint32_t))) {
+		log_error("'%s' is truncated.\n", filename);
+		pack_close(pack);
+		return NULL;
+	}
+
+	pack->count = header.count;
+	pack->entries = (const pack_entry_t *)(pack->start + sizeof(header));
+	pack->names = (const uint32_t *)(pack->entries + pack->count);
+
+	if (check(pack, filename) != 0) {
+		pack_close(pack);
+		return NULL;
+	}
+
+	log_info("Opened the pack '%s' with %u programs.\n", filename, pack->count);
+	return pack;
+}
+
+/* Unmap the pack, entries found in it are no longer valid */
+void pack_close(pack_t *pack)
+{
+	munmap((void *)pack->start, pack->size);
+	free(pack);
+}
+
+/* Binary search of the entries for a hash, the first of equal ones */
+static const pack_entry_t *find_hash(pack_t *pack, uint64_t hash)
+{
+	uint32_t low = 0, high = pack->count;
+
+	while (low < high) {
+		uint32_t middle = low + (high - low) / 2;
+
+		if (pack->entries[middle].hash < hash)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+
+	if (low < pack->count && pack->entries[low].hash == hash)
+		return &pack->entries[low];
+
+	return NULL;
+}
+
+/* Find a program by name, or by its hash as 16 hex digits. NULL if there's
+ * no such program */
+const pack_entry_t *pack_find(pack_t *pack, const char *name)
+{
+	uint32_t low = 0, high = pack->count;
+	char *end;
+
+	while (low < high) {
+		uint32_t middle = low + (high - low) / 2;
+		const pack_entry_t *entry = &pack->entries[pack->names[middle]];
+		int order = strcmp(pack_name(pack, entry), name);
+
+		if (order == 0)
+			return entry;
+
+		if (order < 0)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+
+	// Not a name, maybe a hash
+	uint64_t hash = strtoull(name, &end, 16);
+
+	if (strlen(name) == 16 && *end == '\0')
+		return find_hash(pack, hash);
+
+	return NULL;
+}
+
+/* The entry at the given place in name order, NULL past the last one */
+const pack_entry_t *pack_entry(pack_t *pack, uint32_t index)
+{
+	if (index >= pack->count)
+		return NULL;
+
+	return &pack->entries[pack->names[index]];
+}
+
+/* Name of an entry */
+const char *pack_name(pack_t *pack, const pack_entry_t *entry)
+{
+	return (const char *)pack->start + entry->name;
+}
+
+/* 64-bit FNV-1a hash of a program */
+uint64_t pack_hash(const uint8_t *data, size_t size)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	size_t i;
+
+	for (i = 0; i < size; i++) {
+		hash ^= data[i];
+		hash *= 0x100000001b3ULL;
+	}
+
+	return hash;
+}
+
+/* Load a program into the cpus memory at PROGRAM_START, and switch to the
+ * quirk profile and speed of the entry if it has them */
+void pack_load(pack_t *pack, const pack_entry_t *entry, chip8_t *cpu)
+{
+	if (entry->quirks != PACK_NO_QUIRKS)
+		set_quirks(cpu, entry->quirks);
+
+	if (entry->ips != PACK_NO_IPS)
+		cpu->ips = entry->ips;
+
+	memcpy(&cpu->memory[PROGRAM_START], pack->start + entry->offset, entry->size);
+
+	// Anything decoded before the load is stale now
+	invalidate_decoded(cpu, 0, 4096);
+}
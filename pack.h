@@ -0,0 +1,73 @@
+#ifndef PACK_H_
+#define PACK_H_
+
+#include "chip8.h"
+
+/*
+ * ROM packs, many programs in one file built with c8pack. A pack is mapped
+ * into memory once and a program is loaded with a single copy, instead of
+ * opening and reading a file per program. The file is:
+ *
+ *   pack_header_t  header
+ *   pack_entry_t   entries[count]  sorted by hash
+ *   uint32_t       names[count]    entry numbers, sorted by name
+ *   char           strings[]       NUL terminated names
+ *   uint8_t        data[]          the programs, each stored once
+ *
+ * Every offset is from the start of the file. Entries with the same
+ * contents share their data.
+ */
+
+#define PACK_MAGIC "C8PK"
+#define PACK_VERSION 1
+
+/* Entries which leave the quirks or speed to the caller */
+#define PACK_NO_QUIRKS 0xFF
+#define PACK_NO_IPS 0
+
+/* The file header */
+typedef struct __attribute__((packed)) {
+	char magic[4];
+	uint16_t version;
+	uint16_t reserved;
+	uint32_t count; // Entries
+	uint32_t size; // Of the whole file
+} pack_header_t;
+
+/* One program */
+typedef struct __attribute__((packed)) {
+	uint64_t hash; // pack_hash() of the program
+	uint32_t offset; // Of the program
+	uint16_t size; // Of the program, 1 to PROGRAM_SIZE
+	uint8_t quirks; // QUIRKS_* or PACK_NO_QUIRKS
+	uint8_t reserved;
+	uint32_t ips; // Instructions per second or PACK_NO_IPS
+	uint32_t name; // Offset of the name
+} pack_entry_t;
+
+typedef struct pack_s pack_t;
+
+/* Map and check a pack, NULL if it couldn't be opened or is damaged */
+pack_t *pack_open(char *);
+
+/* Unmap the pack, entries found in it are no longer valid */
+void pack_close(pack_t *);
+
+/* Find a program by name, or by its hash as 16 hex digits. NULL if there's
+ * no such program */
+const pack_entry_t *pack_find(pack_t *, const char *);
+
+/* The entry at the given place in name order, NULL past the last one */
+const pack_entry_t *pack_entry(pack_t *, uint32_t);
+
+/* Name of an entry */
+const char *pack_name(pack_t *, const pack_entry_t *);
+
+/* 64-bit FNV-1a hash of a program */
+uint64_t pack_hash(const uint8_t *, size_t);
+
+/* Load a program into the cpus memory at PROGRAM_START, and switch to the
+ * quirk profile and speed of the entry if it has them */
+void pack_load(pack_t *, const pack_entry_t *, chip8_t *);
+
+#endif
@@ -0,0 +1,233 @@
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "pool.h"
+
+typedef struct {
+	task_fn fn;
+	void *arg;
+} task_t;
+
+/* A worker and its deque of tasks. The owner works from the tail, thieves
+ * take from the head. */
+typedef struct {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	task_t *tasks;
+	int capacity;
+	int head;
+	int tail;
+	pool_t *pool;
+	int index;
+} worker_t;
+
+struct pool_s {
+	worker_t *workers;
+	int size;
+	int next; // Worker which gets the next submitted task
+
+	// Guards the counters below and is used to sleep idle workers
+	pthread_mutex_t lock;
+	pthread_cond_t work; // Signalled when tasks are queued
+	pthread_cond_t done; // Signalled when the pool runs empty
+	int queued; // Tasks in any of the deques
+	int pending; // Tasks queued or running
+	int stopping;
+};
+
+/* Push a task on the tail of the deque, growing it if it's full */
+static void push(worker_t *w, task_t task)
+{
+	pthread_mutex_lock(&w->lock);
+
+	if (w->tail - w->head == w->capacity) {
+		int count = w->tail - w->head;
+		task_t *tasks = malloc(2 * w->capacity * sizeof(task_t));
+		int i;
+
+		for (i = 0; i < count; i++)
+			tasks[i] = w->tasks[(w->head + i) % w->capacity];
+
+		free(w->tasks);
+		w->tasks = tasks;
+		w->capacity *= 2;
+		w->head = 0;
+		w->tail = count;
+	}
+
+	w->tasks[w->tail % w->capacity] = task;
+	w->tail++;
+
+	pthread_mutex_unlock(&w->lock);
+}
+
+/* Take a task from the tail (own deque) or head (stealing). Returns 0 if
+ * the deque was empty */
+static int take(worker_t *w, task_t *task, int steal)
+{
+	int found = 0;
+
+	pthread_mutex_lock(&w->lock);
+
+	if (w->head != w->tail) {
+		if (steal)
+			*task = w->tasks[w->head++ % w->capacity];
+		else
+			*task = w->tasks[--w->tail % w->capacity];
+
+		found = 1;
+	}
+
+	pthread_mutex_unlock(&w->lock);
+	return found;
+}
+
+/* Find the next task for a worker, stealing if its own deque is empty */
+static int find_task(worker_t *w, task_t *task)
+{
+	pool_t *pool = w->pool;
+	int i;
+
+	if (take(w, task, 0))
+		return 1;
+
+	for (i = 1; i < pool->size; i++) {
+		worker_t *victim = &pool->workers[(w->index + i) % pool->size];
+
+		if (take(victim, task, 1))
+			return 1;
+	}
+
+	return 0;
+}
+
+static void *worker_main(void *arg)
+{
+	worker_t *w = arg;
+	pool_t *pool = w->pool;
+	task_t task;
+
+	for (;;) {
+		pthread_mutex_lock(&pool->lock);
+
+		while (pool->queued <= 0 && !pool->stopping)
+			pthread_cond_wait(&pool->work, &pool->lock);
+
+		if (pool->queued <= 0 && pool->stopping) {
+			pthread_mutex_unlock(&pool->lock);
+			return NULL;
+		}
+
+		pthread_mutex_unlock(&pool->lock);
+
+		// Someone else may have got there first, go back to sleep then
+		if (!find_task(w, &task))
+			continue;
+
+		pthread_mutex_lock(&pool->lock);
+		pool->queued--;
+		pthread_mutex_unlock(&pool->lock);
+
+		task.fn(task.arg);
+
+		pthread_mutex_lock(&pool->lock);
+		if (--pool->pending == 0)
+			pthread_cond_broadcast(&pool->done);
+		pthread_mutex_unlock(&pool->lock);
+	}
+}
+
+/* Start a pool with the given number of workers, 0 for one per core */
+pool_t *pool_create(int size)
+{
+	pool_t *pool = calloc(1, sizeof(pool_t));
+	int i;
+
+	if (size <= 0)
+		size = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (size <= 0)
+		size = 1;
+
+	pool->size = size;
+	pool->workers = calloc(size, sizeof(worker_t));
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work, NULL);
+	pthread_cond_init(&pool->done, NULL);
+
+	for (i = 0; i < size; i++) {
+		worker_t *w = &pool->workers[i];
+
+		pthread_mutex_init(&w->lock, NULL);
+		w->capacity = 64;
+		w->tasks = malloc(w->capacity * sizeof(task_t));
+		w->pool = pool;
+		w->index = i;
+	}
+
+	for (i = 0; i < size; i++)
+		pthread_create(&pool->workers[i].thread, NULL, worker_main,
+				&pool->workers[i]);
+
+	return pool;
+}
+
+/* Queue a task, spreading tasks evenly over the workers */
+void pool_submit(pool_t *pool, task_fn fn, void *arg)
+{
+	task_t task = { fn, arg };
+
+	pthread_mutex_lock(&pool->lock);
+	worker_t *w = &pool->workers[pool->next];
+	pool->next = (pool->next + 1) % pool->size;
+	pool->pending++;
+	pthread_mutex_unlock(&pool->lock);
+
+	// Push before the task is counted as queued, so a woken worker finds it
+	push(w, task);
+
+	pthread_mutex_lock(&pool->lock);
+	pool->queued++;
+	pthread_cond_signal(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/* Wait until every queued task has finished */
+void pool_wait(pool_t *pool)
+{
+	pthread_mutex_lock(&pool->lock);
+
+	while (pool->pending > 0)
+		pthread_cond_wait(&pool->done, &pool->lock);
+
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/* Stop the workers and free the pool */
+void pool_free(pool_t *pool)
+{
+	int i;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->stopping = 1;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i = 0; i < pool->size; i++) {
+		pthread_join(pool->workers[i].thread, NULL);
+		pthread_mutex_destroy(&pool->workers[i].lock);
+		free(pool->workers[i].tasks);
+	}
+
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->work);
+	pthread_cond_destroy(&pool->done);
+	free(pool->workers);
+	free(pool);
+}
+
+/* Number of workers in the pool */
+int pool_size(pool_t *pool)
+{
+	return pool->size;
+}
@@ -0,0 +1,32 @@
+#ifndef POOL_H_
+#define POOL_H_
+
+#include <pthread.h>
+
+/*
+ * A work-stealing thread pool. Every worker has its own deque of tasks,
+ * takes new work from the back of it and steals from the front of the
+ * other workers' deques when it runs dry.
+ */
+
+/* A task run by one of the workers */
+typedef void (*task_fn)(void *);
+
+typedef struct pool_s pool_t;
+
+/* Start a pool with the given number of workers, 0 for one per core */
+pool_t *pool_create(int);
+
+/* Queue a task, spreading tasks evenly over the workers */
+void pool_submit(pool_t *, task_fn, void *);
+
+/* Wait until every queued task has finished */
+void pool_wait(pool_t *);
+
+/* Stop the workers and free the pool */
+void pool_free(pool_t *);
+
+/* Number of workers in the pool */
+int pool_size(pool_t *);
+
+#endif
@@ -0,0 +1,344 @@
+#ifdef CHIP8_PROFILE
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "profile.h"
+
+/* Opcode families, in the order of the report */
+static const char *family_names[] = {
+	"00E0", "00EE", "00CN", "00FB", "00FC", "00FD", "00FE", "00FF",
+	"0NNN", "1NNN", "2NNN", "3XNN", "4XNN", "5XY0", "6XNN", "7XNN",
+	"8XY0", "8XY1", "8XY2", "8XY3", "8XY4", "8XY5", "8XY6", "8XY7",
+	"8XYE", "8XY?", "9XY0", "ANNN", "BNNN", "CXNN", "DXYN", "EX9E",
+	"EXA1", "EX??", "FX07", "FX0A", "FX15", "FX18", "FX1E", "FX29",
+	"FX30", "FX33", "FX55", "FX65", "FX75", "FX85", "FX??",
+};
+
+#define FAMILIES (sizeof(family_names) / sizeof(family_names[0]))
+
+/* Hottest addresses listed in the report */
+#define TOP_ADDRESSES 24
+
+/* Hottest pairs of families run back to back listed in the report */
+#define TOP_PAIRS 16
+
+/* Characters of the heatmap, from not run to the hottest address */
+static const char heat[] = " .:-=+*#%@";
+
+/* Counters of one thread */
+typedef struct counters_s {
+	uint64_t families[FAMILIES];
+	uint64_t pairs[FAMILIES * FAMILIES]; // Indexed by first * FAMILIES + second
+	uint64_t pcs[4096];
+	uint16_t opcodes[4096]; // Last opcode seen at every address
+	uint64_t ns[2]; // Time spent in DXYN and redraws
+	uint64_t calls[2];
+	uint16_t last_pc; // Address and family of the last instruction
+	uint8_t last_family;
+	struct counters_s *next;
+} counters_t;
+
+/* Family of every opcode, built on first use */
+static uint8_t family_of[65536];
+static pthread_once_t family_once = PTHREAD_ONCE_INIT;
+
+/* The counters of every thread which ran anything, never freed */
+static counters_t *all_counters;
+static pthread_mutex_t counters_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread counters_t *counters;
+
+/* Index of a family name in family_names, -1 if it isn't one */
+static int family_index(const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < FAMILIES; i++)
+		if (strcmp(family_names[i], name) == 0)
+			return i;
+
+	return -1;
+}
+
+/* Name the family of an opcode, '?' where it isn't a known instruction */
+static void family_name(uint16_t opcode, char *name)
+{
+	static const char *plain[16] = {
+		NULL, "1NNN", "2NNN", "3XNN", "4XNN", "5XY0", "6XNN", "7XNN",
+		NULL, "9XY0", "ANNN", "BNNN", "CXNN", "DXYN", NULL, NULL
+	};
+
+	switch (opcode >> 12)
+	{
+		case 0x0:
+			sprintf(name, "%04X", opcode);
+			if ((opcode & 0xFFF0) == 0x00C0)
+				strcpy(name, "00CN");
+			else if (family_index(name) < 0)
+				strcpy(name, "0NNN");
+			break;
+		case 0x8:
+			sprintf(name, "8XY%X", opcode & 0xF);
+			if (family_index(name) < 0)
+				strcpy(name, "8XY?");
+			break;
+		case 0xE:
+			sprintf(name, "EX%02X", opcode & 0xFF);
+			if (family_index(name) < 0)
+				strcpy(name, "EX??");
+			break;
+		case 0xF:
+			sprintf(name, "FX%02X", opcode & 0xFF);
+			if (family_index(name) < 0)
+				strcpy(name, "FX??");
+			break;
+		default:
+			strcpy(name, plain[opcode >> 12]);
+			break;
+	}
+}
+
+static void build_families(void)
+{
+	char name[8];
+	int opcode;
+
+	for (opcode = 0; opcode < 65536; opcode++) {
+		family_name(opcode, name);
+		family_of[opcode] = family_index(name);
+	}
+}
+
+/* The counters of the calling thread, made on first use */
+static counters_t *mine(void)
+{
+	if (counters)
+		return counters;
+
+	pthread_once(&family_once, build_families);
+	counters = calloc(1, sizeof(counters_t));
+
+	pthread_mutex_lock(&counters_lock);
+	counters->next = all_counters;
+	all_counters = counters;
+	pthread_mutex_unlock(&counters_lock);
+
+	return counters;
+}
+
+void profile_step(uint16_t pc, uint16_t opcode)
+{
+	counters_t *c = mine();
+
+	pc &= 0xFFF;
+	c->families[family_of[opcode]]++;
+	c->pcs[pc]++;
+	c->opcodes[pc] = opcode;
+
+	// Straight line pairs, the candidates for fused handlers
+	if (pc == ((c->last_pc + 2) & 0xFFF))
+		c->pairs[c->last_family * FAMILIES + family_of[opcode]]++;
+
+	c->last_pc = pc;
+	c->last_family = family_of[opcode];
+}
+
+uint64_t profile_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void profile_time(int what, uint64_t start)
+{
+	counters_t *c = mine();
+
+	c->ns[what] += profile_now() - start;
+	c->calls[what]++;
+}
+
+/* Sort indices by their count, highest first */
+static const uint64_t *sort_counts;
+
+static int by_count(const void *a, const void *b)
+{
+	uint64_t x = sort_counts[*(const int *)a], y = sort_counts[*(const int *)b];
+
+	return (x < y) - (x > y);
+}
+
+static void dump_time(const char *what, uint64_t ns, uint64_t calls)
+{
+	fprintf(stderr, "%-8s %12llu calls %10.3f ms %8.0f ns/call\n", what,
+			(unsigned long long)calls, ns / 1e6,
+			calls ? (double)ns / calls : 0.0);
+}
+
+/* Write the report to stderr */
+void profile_dump(void)
+{
+	static pthread_mutex_t dump_lock = PTHREAD_MUTEX_INITIALIZER;
+	static counters_t sum;
+	static int order[FAMILIES * FAMILIES > 4096 ? FAMILIES * FAMILIES : 4096];
+	uint64_t total = 0, hottest = 0;
+	counters_t *c;
+	int i, j;
+
+	pthread_mutex_lock(&dump_lock);
+	memset(&sum, 0, sizeof(sum));
+
+	// Other threads may still be counting, which only makes the numbers
+	// a little stale
+	pthread_mutex_lock(&counters_lock);
+
+	for (c = all_counters; c; c = c->next) {
+		for (i = 0; i < (int)FAMILIES; i++)
+			sum.families[i] += c->families[i];
+
+		for (i = 0; i < (int)(FAMILIES * FAMILIES); i++)
+			sum.pairs[i] += c->pairs[i];
+
+		for (i = 0; i < 4096; i++) {
+			sum.pcs[i] += c->pcs[i];
+
+			if (c->pcs[i])
+				sum.opcodes[i] = c->opcodes[i];
+		}
+
+		for (i = 0; i < 2; i++) {
+			sum.ns[i] += c->ns[i];
+			sum.calls[i] += c->calls[i];
+		}
+	}
+
+	pthread_mutex_unlock(&counters_lock);
+
+	for (i = 0; i < (int)FAMILIES; i++)
+		total += sum.families[i];
+
+	fprintf(stderr, "\nProfile of %llu instructions\n\n",
+			(unsigned long long)total);
+	dump_time("DXYN", sum.ns[PROFILE_DXYN], sum.calls[PROFILE_DXYN]);
+	dump_time("Redraws", sum.ns[PROFILE_RENDER], sum.calls[PROFILE_RENDER]);
+
+	// Opcode families, hottest first
+	fprintf(stderr, "\nOpcode          Count   Share\n");
+
+	for (i = 0; i < (int)FAMILIES; i++)
+		order[i] = i;
+
+	sort_counts = sum.families;
+	qsort(order, FAMILIES, sizeof(int), by_count);
+
+	for (i = 0; i < (int)FAMILIES && sum.families[order[i]]; i++)
+		fprintf(stderr, "%-6s %14llu %6.2f%%\n", family_names[order[i]],
+				(unsigned long long)sum.families[order[i]],
+				100.0 * sum.families[order[i]] / total);
+
+	// Pairs run back to back, hottest first
+	fprintf(stderr, "\nSequence        Count   Share\n");
+
+	for (i = 0; i < (int)(FAMILIES * FAMILIES); i++)
+		order[i] = i;
+
+	sort_counts = sum.pairs;
+	qsort(order, FAMILIES * FAMILIES, sizeof(int), by_count);
+
+	for (i = 0; i < TOP_PAIRS && sum.pairs[order[i]]; i++)
+		fprintf(stderr, "%s %s %9llu %6.2f%%\n",
+				family_names[order[i] / FAMILIES],
+				family_names[order[i] % FAMILIES],
+				(unsigned long long)sum.pairs[order[i]],
+				100.0 * sum.pairs[order[i]] / total);
+
+	// Addresses, hottest first
+	fprintf(stderr, "\nAddress Opcode          Count   Share\n");
+
+	for (i = 0; i < 4096; i++)
+		order[i] = i;
+
+	sort_counts = sum.pcs;
+	qsort(order, 4096, sizeof(int), by_count);
+	hottest = sum.pcs[order[0]];
+
+	for (i = 0; i < TOP_ADDRESSES && sum.pcs[order[i]]; i++)
+		fprintf(stderr, "0x%03X   %04X   %14llu %6.2f%%\n", order[i],
+				sum.opcodes[order[i]],
+				(unsigned long long)sum.pcs[order[i]],
+				100.0 * sum.pcs[order[i]] / total);
+
+	// Heatmap, log scaled against the hottest address
+	fprintf(stderr, "\nHeatmap, 64 addresses per row, '%c' is the hottest\n\n",
+			heat[sizeof(heat) - 2]);
+
+	for (i = 0; i < 4096; i += 64) {
+		char row[65];
+		int ran = 0;
+
+		for (j = 0; j < 64; j++) {
+			uint64_t count = sum.pcs[i + j];
+			int level = 0;
+
+			if (count) {
+				uint64_t step = hottest;
+
+				// One level per factor of 4 below the hottest
+				level = sizeof(heat) - 2;
+				while (level > 1 && count * 4 <= step) {
+					step /= 4;
+					level--;
+				}
+
+				ran = 1;
+			}
+
+			row[j] = heat[level];
+		}
+
+		row[64] = '\0';
+
+		if (ran)
+			fprintf(stderr, "0x%03X |%s|\n", i, row);
+	}
+
+	fprintf(stderr, "\n");
+	pthread_mutex_unlock(&dump_lock);
+}
+
+/* Wait for SIGUSR1 and write the report every time it comes */
+static void *signal_main(void *arg)
+{
+	sigset_t *set = arg;
+	int signal;
+
+	for (;;)
+		if (sigwait(set, &signal) == 0)
+			profile_dump();
+
+	return NULL;
+}
+
+/* Write the report at exit and on SIGUSR1. Call it before starting any
+ * threads, they need SIGUSR1 blocked */
+void profile_start(void)
+{
+	static sigset_t set;
+	pthread_t thread;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	pthread_create(&thread, NULL, signal_main, &set);
+	pthread_detach(thread);
+
+	atexit(profile_dump);
+}
+
+#endif
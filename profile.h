@@ -0,0 +1,57 @@
+#ifndef PROFILE_H_
+#define PROFILE_H_
+
+#include <stdint.h>
+
+/*
+ * An optional profiler, built in with -DCHIP8_PROFILE (make PROFILE=1).
+ * It counts every instruction run by step() per opcode family and per
+ * address, and times DXYN and redraws. The report, a table of the hottest
+ * opcodes, pairs of opcodes run back to back and addresses and a heatmap
+ * of the address space, is written to stderr at exit and whenever the
+ * process gets SIGUSR1. The pairs are where fused handlers pay off.
+ *
+ * Counters are kept per thread, so parallel runs don't fight over them.
+ * The JIT and fused handlers are bypassed in profiling builds so every
+ * instruction is seen, but the vector kernels of the lockstep engine
+ * aren't counted.
+ *
+ * Without CHIP8_PROFILE the hooks below are empty and nothing is built.
+ */
+
+/* What the profiler times */
+#define PROFILE_DXYN 0
+#define PROFILE_RENDER 1
+
+#ifdef CHIP8_PROFILE
+
+/* Count an instruction about to run */
+#define PROFILE_STEP(pc, opcode) profile_step((pc), (opcode))
+
+/* Time a stretch of code, started with PROFILE_BEGIN(name) in the same
+ * scope */
+#define PROFILE_BEGIN(name) uint64_t name = profile_now()
+#define PROFILE_END(what, name) profile_time((what), (name))
+
+/* Write the report at exit and on SIGUSR1. Call it before starting any
+ * threads, they need SIGUSR1 blocked */
+void profile_start(void);
+
+/* Write the report to stderr */
+void profile_dump(void);
+
+void profile_step(uint16_t, uint16_t);
+uint64_t profile_now(void);
+void profile_time(int, uint64_t);
+
+#else
+
+#define PROFILE_STEP(pc, opcode) ((void)0)
+#define PROFILE_BEGIN(name) ((void)0)
+#define PROFILE_END(what, name) ((void)0)
+#define profile_start() ((void)0)
+#define profile_dump() ((void)0)
+
+#endif
+
+#endif
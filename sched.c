@@ -0,0 +1,265 @@
+#include <errno.h>
+#include <time.h>
+
+#include "sched.h"
+
+#define NSEC_PER_SEC 1000000000LL
+
+/* Give up catching up when this many frames behind */
+#define MAX_BEHIND 4
+
+static int64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/* Handle a save or load asked for by another thread */
+static void handle_request(sched_t *sched)
+{
+	int request = __atomic_exchange_n(&sched->request, 0, __ATOMIC_ACQUIRE);
+
+	if (!request || !sched->save_file)
+		return;
+
+	if (request == SCHED_SAVE)
+		snapshot_save(sched->cpu, sched->save_file);
+	else if (request == SCHED_LOAD && snapshot_load(sched->cpu, sched->save_file) == 0)
+		publish_frame(sched->cpu);
+}
+
+/* Count an event and wake the thread up if it sleeps */
+static void wake_up(sched_t *sched)
+{
+	pthread_mutex_lock(&sched->lock);
+	sched->events++;
+	pthread_cond_broadcast(&sched->wake);
+	pthread_mutex_unlock(&sched->lock);
+}
+
+static uint64_t events(sched_t *sched)
+{
+	pthread_mutex_lock(&sched->lock);
+	uint64_t events = sched->events;
+	pthread_mutex_unlock(&sched->lock);
+
+	return events;
+}
+
+/* Sleep until the deadline, ignoring events */
+static void sleep_until(int64_t deadline)
+{
+	struct timespec ts;
+	ts.tv_sec = deadline / NSEC_PER_SEC;
+	ts.tv_nsec = deadline % NSEC_PER_SEC;
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+}
+
+/* Sleep until the deadline or until there are events past the ones
+ * counted in seen. Returns 1 if an event woke it up */
+static int wait_until(sched_t *sched, int64_t deadline, uint64_t seen)
+{
+	struct timespec ts;
+	int status = 0, woken;
+
+	ts.tv_sec = deadline / NSEC_PER_SEC;
+	ts.tv_nsec = deadline % NSEC_PER_SEC;
+
+	pthread_mutex_lock(&sched->lock);
+
+	while (sched->events == seen && status != ETIMEDOUT)
+		status = pthread_cond_timedwait(&sched->wake, &sched->lock, &ts);
+
+	woken = sched->events != seen;
+	pthread_mutex_unlock(&sched->lock);
+	return woken;
+}
+
+/* Sleep until there are events past the ones counted in seen, with keys
+ * pressed meanwhile noted by the FX0A the cpu waits in */
+static void park(sched_t *sched, uint64_t seen)
+{
+	pthread_mutex_lock(&sched->lock);
+	sched->parked_in_fx0a = 1;
+
+	while (sched->events == seen)
+		pthread_cond_wait(&sched->wake, &sched->lock);
+
+	sched->parked_in_fx0a = 0;
+	pthread_mutex_unlock(&sched->lock);
+}
+
+/* Frames published by the cpu so far */
+static uint64_t published(chip8_t *cpu)
+{
+	uint64_t published = 0, dropped;
+
+	if (cpu->frames)
+		frame_counts(cpu->frames, &published, &dropped);
+
+	return published;
+}
+
+/* Set up a scheduler for the cpu, free it with sched_destroy() */
+void sched_init(sched_t *sched, chip8_t *cpu)
+{
+	pthread_condattr_t attr;
+
+	memset(sched, 0, sizeof(sched_t));
+	sched->cpu = cpu;
+
+	// Deadlines are on the monotonic clock
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&sched->wake, &attr);
+	pthread_condattr_destroy(&attr);
+	pthread_mutex_init(&sched->lock, NULL);
+}
+
+/* Free what sched_init() set up, once the run has ended */
+void sched_destroy(sched_t *sched)
+{
+	pthread_cond_destroy(&sched->wake);
+	pthread_mutex_destroy(&sched->lock);
+}
+
+/* Run the cpu in real time until it halts or is stopped. Takes a sched_t,
+ * so it can be used as a thread function */
+void *sched_run(void *arg)
+{
+	sched_t *sched = arg;
+	chip8_t *cpu = sched->cpu;
+	int64_t start = now_ns();
+	uint64_t frame = 0;
+
+	while (!__atomic_load_n(&sched->stop, __ATOMIC_RELAXED) && !cpu->halted) {
+		handle_request(sched);
+
+		// Anything which comes after this may not have been seen by
+		// the frame
+		uint64_t seen = events(sched);
+		uint64_t before = published(cpu);
+		int rewinding = __atomic_load_n(&sched->rewinding, __ATOMIC_RELAXED);
+
+		// Rewinding replaces running, a frame back per frame
+		if (sched->history && rewinding) {
+			if (rewind_pop(sched->history, cpu) == 0)
+				publish_frame(cpu);
+		} else {
+			run_frame(cpu);
+
+			if (sched->history)
+				rewind_push(sched->history, cpu);
+		}
+
+		sched->frames++;
+		frame++;
+
+		if (sched->on_frame && published(cpu) != before)
+			sched->on_frame();
+
+		// Nothing happens in FX0A until a key does, so park until then.
+		// The frames which were due meanwhile would only have run FX0A,
+		// let them pass and run the next one right away. They passed
+		// even if the key which woke it up already ended the wait.
+		if (!rewinding && waiting_for_key(cpu)) {
+			park(sched, seen);
+
+			uint64_t due = (now_ns() - start) * 60 / NSEC_PER_SEC;
+
+			if (due > frame) {
+				wait_frames(cpu, due - frame);
+				sched->parked += due - frame;
+				frame = due;
+			}
+
+			continue;
+		}
+
+		// Deadlines are counted from the start, never from the last
+		// wake up, so a late frame doesn't push back the ones after it
+		int64_t deadline = start + frame * NSEC_PER_SEC / 60;
+		int64_t now = now_ns();
+
+		// Way behind (stopped in a debugger, machine overloaded). Start
+		// counting from here instead of running a burst of frames.
+		if (now > deadline + MAX_BEHIND * NSEC_PER_SEC / 60) {
+			start = now - frame * NSEC_PER_SEC / 60;
+			sched->resyncs++;
+			continue;
+		}
+
+		// A key runs the next frame early, but at most a frame early so
+		// the machine never gets further ahead of real time
+		sleep_until(deadline - NSEC_PER_SEC / 60);
+
+		if (wait_until(sched, deadline, seen)) {
+			sched->early++;
+			continue;
+		}
+
+		int64_t jitter = now_ns() - deadline;
+		sched->total_jitter_ns += jitter;
+
+		if (jitter > sched->max_jitter_ns)
+			sched->max_jitter_ns = jitter;
+	}
+
+	// Let whoever waits for frames know there won't be any more
+	__atomic_store_n(&sched->ended, 1, __ATOMIC_RELEASE);
+
+	if (sched->on_frame)
+		sched->on_frame();
+
+	return NULL;
+}
+
+/* Ask a running scheduler to stop after the current frame */
+void sched_stop(sched_t *sched)
+{
+	__atomic_store_n(&sched->stop, 1, __ATOMIC_RELAXED);
+	wake_up(sched);
+}
+
+/* Ask a running scheduler to save or load the state before the next frame */
+void sched_request(sched_t *sched, int request)
+{
+	__atomic_store_n(&sched->request, request, __ATOMIC_RELEASE);
+	wake_up(sched);
+}
+
+/* While set, step back one frame of history per frame instead of running */
+void sched_rewind(sched_t *sched, int rewinding)
+{
+	__atomic_store_n(&sched->rewinding, rewinding, __ATOMIC_RELAXED);
+	wake_up(sched);
+}
+
+/* Press (down set) or release one of the keys 0x0-0xF. Returns the number
+ * of the event in the frame buffer of the cpu, 0 if it has none */
+uint64_t sched_key(sched_t *sched, int key, int down)
+{
+	chip8_t *cpu = sched->cpu;
+	uint64_t input = 0;
+
+	set_key(cpu, key, down);
+
+	if (cpu->frames)
+		input = frame_input(cpu->frames);
+
+	pthread_mutex_lock(&sched->lock);
+
+	// The parked thread only sees the keys held once it wakes up, so a
+	// press and release which come together would slip past FX0A
+	if (down && sched->parked_in_fx0a)
+		cpu->key_wait |= 1 << (key & 0xF);
+
+	sched->events++;
+	pthread_cond_broadcast(&sched->wake);
+	pthread_mutex_unlock(&sched->lock);
+	return input;
+}
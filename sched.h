@@ -0,0 +1,80 @@
+#ifndef SCHED_H_
+#define SCHED_H_
+
+#include <pthread.h>
+
+#include "chip8.h"
+#include "snapshot.h"
+
+/*
+ * Real-time scheduler. Runs one frame of instructions, then sleeps until
+ * the absolute deadline of the next 60 Hz frame so errors don't add up.
+ * Programs polling the delay timer have the rest of their frame skipped
+ * by the core, so they sleep until the next frame instead of spinning.
+ *
+ * Keys are handed to the machine as they come. A key wakes the scheduler
+ * up to one frame early so the program reacts within the frame, and a
+ * program waiting in FX0A parks the thread until a key comes. The frames
+ * it slept through are then let pass at once, exactly as if FX0A had run
+ * through them.
+ *
+ * Save states and rewinding happen between frames on the emulator thread,
+ * other threads only ask for them.
+ */
+
+/* Requests handled at the start of the next frame */
+#define SCHED_SAVE 1 // Write the state to save_file
+#define SCHED_LOAD 2 // Restore the state from save_file
+
+typedef struct {
+	chip8_t *cpu;
+	int stop; // Set through sched_stop() to end the run
+
+	// Called on the emulator thread after a frame was published and when
+	// the run ends, NULL for none
+	void (*on_frame)(void);
+
+	pthread_mutex_t lock; // Guards events, the thread parks on it
+	pthread_cond_t wake; // Signalled for every event
+	uint64_t events; // Keys, requests and stops so far
+	int parked_in_fx0a; // Guarded by lock, keys pressed go to key_wait
+
+	rewind_t *history; // Pushed every frame, NULL to disable rewinding
+	char *save_file; // Where save states go, NULL to disable them
+	int request; // Set through sched_request()
+	int rewinding; // Set through sched_rewind()
+	int ended; // Set when the run is over, the cpu can be read once joined
+
+	// Measurements, read them once the run has ended
+	uint64_t frames; // Frames run
+	uint64_t resyncs; // Times it fell too far behind and gave up catching up
+	int64_t total_jitter_ns; // Sum of how late every wake up was
+	int64_t max_jitter_ns; // The latest wake up
+	uint64_t early; // Frames run early for a key
+	uint64_t parked; // Frames let pass while parked in FX0A
+} sched_t;
+
+/* Set up a scheduler for the cpu, free it with sched_destroy() */
+void sched_init(sched_t *, chip8_t *);
+
+/* Free what sched_init() set up, once the run has ended */
+void sched_destroy(sched_t *);
+
+/* Run the cpu in real time until it halts or is stopped. Takes a sched_t,
+ * so it can be used as a thread function */
+void *sched_run(void *);
+
+/* Ask a running scheduler to stop after the current frame */
+void sched_stop(sched_t *);
+
+/* Ask a running scheduler to save or load the state before the next frame */
+void sched_request(sched_t *, int);
+
+/* While set, step back one frame of history per frame instead of running */
+void sched_rewind(sched_t *, int);
+
+/* Press (down set) or release one of the keys 0x0-0xF. Returns the number
+ * of the event in the frame buffer of the cpu, 0 if it has none */
+uint64_t sched_key(sched_t *, int, int);
+
+#endif
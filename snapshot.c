@@ -0,0 +1,347 @@
+#include "snapshot.h"
+
+/* Equal bytes needed before it's worth ending a run of changed ones */
+#define MIN_SKIP 4
+
+/* Largest possible delta, see encode_delta() */
+#define MAX_DELTA (sizeof(snapshot_t) + 4)
+
+/* Where a delta is stored in the ring */
+typedef struct {
+	uint32_t offset;
+	uint32_t length;
+} delta_t;
+
+struct rewind_s {
+	// Deltas, stored back to back in a ring of bytes
+	uint8_t *buffer;
+	uint32_t size;
+	uint32_t used;
+	uint32_t end; // Where the next delta goes
+
+	// Oldest delta first
+	delta_t *deltas;
+	int capacity;
+	int first;
+	int count;
+
+	snapshot_t newest; // The last state pushed
+	int primed; // Set once newest holds a state
+
+	snapshot_t current;
+	uint8_t scratch[MAX_DELTA];
+};
+
+/* Copy the state of the cpu into a snapshot */
+void snapshot_take(chip8_t *cpu, snapshot_t *s)
+{
+	memcpy(s->magic, SNAPSHOT_MAGIC, 4);
+	s->version = SNAPSHOT_VERSION;
+	s->size = sizeof(snapshot_t);
+
+	memcpy(s->memory, cpu->memory, sizeof(s->memory));
+	memcpy(s->display, cpu->display, sizeof(s->display));
+	memcpy(s->stack, cpu->stack, sizeof(s->stack));
+	memcpy(s->V, cpu->V, sizeof(s->V));
+	s->I = cpu->I;
+	s->pc = cpu->pc;
+	s->stackPointer = cpu->stackPointer;
+	s->keys = cpu->keys;
+	s->soundTimer = sound_timer(cpu);
+	s->delayTimer = delay_timer(cpu);
+	s->cycles = cpu->cycles;
+	s->frame = cpu->frame;
+	s->ips = cpu->ips;
+	s->halted = cpu->halted;
+	s->random = cpu->random;
+	s->quirks = cpu->quirks;
+	s->key_wait = cpu->key_wait;
+	s->hires = cpu->hires;
+	memcpy(s->flags, cpu->flags, sizeof(s->flags));
+}
+
+/* Put the cpu back in the state of a snapshot. Attachments (JIT, trace,
+ * frame buffer) and the keys held are kept */
+void snapshot_restore(chip8_t *cpu, const snapshot_t *s)
+{
+	// Most restores are a frame apart and don't touch the code, so keep
+	// what's decoded and translated when the memory didn't change
+	if (memcmp(cpu->memory, s->memory, sizeof(s->memory)) != 0) {
+		memcpy(cpu->memory, s->memory, sizeof(s->memory));
+		invalidate_decoded(cpu, 0, 4096);
+	}
+
+	// Before the display, switching the geometry clears it
+	set_resolution(cpu, s->hires);
+	memcpy(cpu->display, s->display, sizeof(s->display));
+	memcpy(cpu->flags, s->flags, sizeof(cpu->flags));
+	memcpy(cpu->stack, s->stack, sizeof(s->stack));
+	memcpy(cpu->V, s->V, sizeof(s->V));
+	cpu->I = s->I;
+	cpu->pc = s->pc;
+	cpu->stackPointer = s->stackPointer;
+	cpu->cycles = s->cycles;
+	cpu->frame = s->frame;
+	cpu->ips = s->ips;
+	set_timers(cpu, s->delayTimer, s->soundTimer);
+	cpu->halted = s->halted;
+	cpu->random = s->random;
+	set_quirks(cpu, s->quirks);
+
+	// The keypad belongs to whoever holds the keys now, not to the
+	// snapshot. An FX0A starts its wait over with the keys held now.
+	cpu->key_wait = 0;
+
+	// The whole screen may have changed
+	cpu->dirty = ~0ULL;
+}
+
+/* Write the state of the cpu to a file. Returns 0 on success */
+int snapshot_save(chip8_t *cpu, char *filename)
+{
+	snapshot_t s;
+	FILE *file = fopen(filename, "wb");
+
+	if (!file) {
+		log_error("Couldn't create the save file '%s'.\n", filename);
+		return -1;
+	}
+
+	snapshot_take(cpu, &s);
+
+	if (fwrite(&s, sizeof(s), 1, file) != 1) {
+		log_error("Couldn't write the save file '%s'.\n", filename);
+		fclose(file);
+		return -1;
+	}
+
+	fclose(file);
+	log_info("Saved the state to '%s'.\n", filename);
+	return 0;
+}
+
+/* Restore the cpu from a file written by snapshot_save(). Returns 0 on
+ * success, the cpu is left alone on errors */
+int snapshot_load(chip8_t *cpu, char *filename)
+{
+	snapshot_t s;
+	FILE *file = fopen(filename, "rb");
+
+	if (!file) {
+		log_error("Couldn't open the save file '%s'.\n", filename);
+		return -1;
+	}
+
+	size_t read = fread(&s, sizeof(s), 1, file);
+	fclose(file);
+
+	if (read != 1 || memcmp(s.magic, SNAPSHOT_MAGIC, 4) != 0
+			|| s.version != SNAPSHOT_VERSION || s.size != sizeof(s)) {
+		log_error("'%s' isn't a save file of this version.\n", filename);
+		return -1;
+	}
+
+	// Save files get shared, and these index into the cpu unchecked
+	if (s.hires > HIRES || s.stackPointer > 16 || s.quirks >= QUIRKS_COUNT
+			|| s.pc > 0xFFF || s.I > 0xFFF) {
+		log_error("'%s' holds a state the machine can't be in.\n", filename);
+		return -1;
+	}
+
+	snapshot_restore(cpu, &s);
+	log_info("Loaded the state from '%s'.\n", filename);
+	return 0;
+}
+
+/*
+ * Deltas are the XOR of two snapshots as a list of
+ *
+ *   uint16_t skip      bytes which are the same in both
+ *   uint16_t count
+ *   uint8_t  xor[]     count bytes which differ
+ *
+ * A run of changed bytes is only ended by MIN_SKIP or more equal ones, so
+ * every record after the first saves at least as much as its header costs
+ * and a delta is never more than 4 bytes larger than a snapshot.
+ */
+
+/* Encode the difference between a and b. Returns the length of the delta */
+static uint32_t encode_delta(const uint8_t *a, const uint8_t *b, uint8_t *out)
+{
+	uint8_t *p = out;
+	uint32_t i = 0, size = sizeof(snapshot_t);
+
+	while (i < size) {
+		uint32_t start = i;
+		uint64_t wa, wb;
+
+		// Almost everything is unchanged, so skip a word at a time
+		for (; i + 8 <= size; i += 8) {
+			memcpy(&wa, a + i, 8);
+			memcpy(&wb, b + i, 8);
+
+			if (wa != wb)
+				break;
+		}
+
+		while (i < size && a[i] == b[i])
+			i++;
+
+		uint16_t skip = i - start;
+		start = i;
+
+		while (i < size) {
+			uint32_t same = i;
+
+			while (same < size && a[same] == b[same] && same - i < MIN_SKIP)
+				same++;
+
+			if (same == size || same - i == MIN_SKIP)
+				break;
+
+			i = same + 1;
+		}
+
+		uint16_t count = i - start;
+
+		// Nothing changed after the last record
+		if (count == 0)
+			break;
+
+		memcpy(p, &skip, 2);
+		memcpy(p + 2, &count, 2);
+		p += 4;
+
+		for (; start < i; start++)
+			*p++ = a[start] ^ b[start];
+	}
+
+	return p - out;
+}
+
+/* XOR a delta into a snapshot */
+static void apply_delta(const uint8_t *p, uint32_t length, uint8_t *state)
+{
+	const uint8_t *end = p + length;
+	uint16_t skip, count;
+
+	while (p < end) {
+		memcpy(&skip, p, 2);
+		memcpy(&count, p + 2, 2);
+		p += 4;
+		state += skip;
+
+		while (count--)
+			*state++ ^= *p++;
+	}
+}
+
+/* Create an empty history holding at most the given number of states in
+ * the given number of bytes */
+rewind_t *rewind_create(int states, uint32_t bytes)
+{
+	rewind_t *rw = calloc(1, sizeof(rewind_t));
+
+	// Always room for at least one delta
+	if (bytes < MAX_DELTA)
+		bytes = MAX_DELTA;
+
+	rw->buffer = malloc(bytes);
+	rw->size = bytes;
+	rw->deltas = malloc(states * sizeof(delta_t));
+	rw->capacity = states;
+
+	return rw;
+}
+
+/* Free a history */
+void rewind_free(rewind_t *rw)
+{
+	if (!rw)
+		return;
+
+	free(rw->buffer);
+	free(rw->deltas);
+	free(rw);
+}
+
+/* Drop the oldest delta */
+static void drop_oldest(rewind_t *rw)
+{
+	rw->used -= rw->deltas[rw->first].length;
+	rw->first = (rw->first + 1) % rw->capacity;
+	rw->count--;
+}
+
+/* Add the current state of the cpu to the history, dropping the oldest
+ * states if it's full */
+void rewind_push(rewind_t *rw, chip8_t *cpu)
+{
+	snapshot_take(cpu, &rw->current);
+
+	if (!rw->primed) {
+		rw->newest = rw->current;
+		rw->primed = 1;
+		return;
+	}
+
+	// What turns the new state back into the previous one
+	uint32_t length = encode_delta((uint8_t *)&rw->newest,
+			(uint8_t *)&rw->current, rw->scratch);
+
+	while (rw->count > 0 && (rw->count == rw->capacity
+				|| rw->used + length > rw->size))
+		drop_oldest(rw);
+
+	// Deltas wrap around the end of the ring
+	uint32_t head = rw->size - rw->end;
+
+	if (length <= head) {
+		memcpy(rw->buffer + rw->end, rw->scratch, length);
+	} else {
+		memcpy(rw->buffer + rw->end, rw->scratch, head);
+		memcpy(rw->buffer, rw->scratch + head, length - head);
+	}
+
+	delta_t *delta = &rw->deltas[(rw->first + rw->count) % rw->capacity];
+	delta->offset = rw->end;
+	delta->length = length;
+
+	rw->count++;
+	rw->used += length;
+	rw->end = (rw->end + length) % rw->size;
+	rw->newest = rw->current;
+}
+
+/* Step the cpu back to the state before the last one pushed. Returns 0 on
+ * success, -1 if the history is empty */
+int rewind_pop(rewind_t *rw, chip8_t *cpu)
+{
+	if (rw->count == 0)
+		return -1;
+
+	delta_t *delta = &rw->deltas[(rw->first + rw->count - 1) % rw->capacity];
+	uint32_t head = rw->size - delta->offset;
+
+	if (delta->length <= head) {
+		memcpy(rw->scratch, rw->buffer + delta->offset, delta->length);
+	} else {
+		memcpy(rw->scratch, rw->buffer + delta->offset, head);
+		memcpy(rw->scratch + head, rw->buffer, delta->length - head);
+	}
+
+	apply_delta(rw->scratch, delta->length, (uint8_t *)&rw->newest);
+
+	rw->count--;
+	rw->used -= delta->length;
+	rw->end = delta->offset;
+
+	snapshot_restore(cpu, &rw->newest);
+	return 0;
+}
+
+/* Number of states the cpu can be stepped back */
+int rewind_count(rewind_t *rw)
+{
+	return rw->count;
+}
@@ -0,0 +1,85 @@
+#ifndef SNAPSHOT_H_
+#define SNAPSHOT_H_
+
+#include "chip8.h"
+
+/*
+ * Snapshots of the complete machine state, save files and a rewind
+ * history.
+ *
+ * A save file is a snapshot_t written as is. The rewind history keeps
+ * the newest state in full and every older state as the XOR of it and
+ * the state after it, with the unchanged bytes run length encoded away.
+ * A frame usually only touches a few dozen bytes, so a minute of history
+ * fits in well under a megabyte.
+ */
+
+#define SNAPSHOT_MAGIC "C8SS"
+#define SNAPSHOT_VERSION 5
+
+/* Rewind history kept by default, a minute of frames in at most 2 MB */
+#define REWIND_STATES (60 * 60)
+#define REWIND_BYTES (2 * 1024 * 1024)
+
+/* The state of a machine, exactly as it's saved */
+typedef struct __attribute__((packed)) {
+	char magic[4];
+	uint16_t version;
+	uint16_t size; // Size of the whole snapshot, catches other layouts
+
+	uint8_t memory[4096];
+	uint64_t display[128]; // 32 words before version 5
+	uint16_t stack[16];
+	uint8_t V[16];
+	uint16_t I;
+	uint16_t pc;
+	uint8_t stackPointer;
+	uint16_t keys; // Only informative, restoring keeps the keys held
+	uint16_t soundTimer;
+	uint16_t delayTimer;
+	uint64_t cycles;
+	uint64_t frame;
+	uint32_t ips;
+	uint8_t halted;
+	uint64_t random; // Since version 2
+	uint8_t quirks; // Since version 3
+	uint16_t key_wait; // Since version 4, only informative
+	uint8_t hires; // Since version 5
+	uint8_t flags[16]; // Since version 5
+} snapshot_t;
+
+typedef struct rewind_s rewind_t;
+
+/* Copy the state of the cpu into a snapshot */
+void snapshot_take(chip8_t *, snapshot_t *);
+
+/* Put the cpu back in the state of a snapshot. Attachments (JIT, trace,
+ * frame buffer) and the keys held are kept */
+void snapshot_restore(chip8_t *, const snapshot_t *);
+
+/* Write the state of the cpu to a file. Returns 0 on success */
+int snapshot_save(chip8_t *, char *);
+
+/* Restore the cpu from a file written by snapshot_save(). Returns 0 on
+ * success, the cpu is left alone on errors */
+int snapshot_load(chip8_t *, char *);
+
+/* Create an empty history holding at most the given number of states in
+ * the given number of bytes */
+rewind_t *rewind_create(int, uint32_t);
+
+/* Free a history */
+void rewind_free(rewind_t *);
+
+/* Add the current state of the cpu to the history, dropping the oldest
+ * states if it's full */
+void rewind_push(rewind_t *, chip8_t *);
+
+/* Step the cpu back to the state before the last one pushed. Returns 0 on
+ * success, -1 if the history is empty */
+int rewind_pop(rewind_t *, chip8_t *);
+
+/* Number of states the cpu can be stepped back */
+int rewind_count(rewind_t *);
+
+#endif
@@ -0,0 +1,399 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "stream.h"
+
+/* Most an update takes */
+#define UPDATE_MAX (sizeof(stream_update_t) + DISPLAY_WORDS(HIRES) * sizeof(uint64_t))
+
+/* A connected subscriber */
+typedef struct {
+	int fd;
+	uint64_t rows[DISPLAY_WORDS(HIRES)]; // What it has once out is sent
+	uint8_t hires; // Geometry of the rows
+	uint64_t frame; // Frame it has once out is sent, 0 for none yet
+	uint8_t out[sizeof(stream_hello_t) + UPDATE_MAX];
+	uint32_t out_len;
+	uint32_t out_pos;
+	uint16_t held; // Keys it holds down
+} client_t;
+
+struct stream_s {
+	char *path;
+	int listen_fd;
+	int wake[2]; // Pipe the emulator thread wakes the server up with
+	sched_t *sched;
+	pthread_t thread;
+	int stopping;
+	int pending; // Set while a wake up is in the pipe
+
+	// The newest frame, behind a sequence lock. seq is odd while the
+	// emulator thread writes rows, and goes up by 2 for every frame.
+	uint64_t seq;
+	uint64_t rows[DISPLAY_WORDS(HIRES)];
+	uint8_t hires;
+
+	// Only touched by the server thread
+	uint64_t latest[DISPLAY_WORDS(HIRES)]; // Copy of the newest frame
+	uint8_t latest_hires;
+	uint64_t frame;
+	client_t *clients;
+	int count;
+	int capacity;
+
+	// Counters, read with stream_counts()
+	uint64_t updates;
+	uint64_t skipped;
+};
+
+/* Wake the server thread up, unless it already has a wake up coming */
+static void wake_server(stream_t *stream)
+{
+	if (!__atomic_exchange_n(&stream->pending, 1, __ATOMIC_SEQ_CST)) {
+		char byte = 0;
+
+		// The pipe never blocks, and is never full with one byte in it
+		if (write(stream->wake[1], &byte, 1) != 1)
+			log_warn("Couldn't wake up the stream server.\n");
+	}
+}
+
+/* Make the display of the given geometry (LORES or HIRES) the newest
+ * frame. Called on the emulator thread, never blocks */
+void stream_publish(stream_t *stream, const uint64_t *rows, int hires)
+{
+	uint64_t seq = stream->seq;
+	int word;
+
+	__atomic_store_n(&stream->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	__atomic_store_n(&stream->hires, hires, __ATOMIC_RELAXED);
+
+	for (word = 0; word < DISPLAY_WORDS(hires); word++)
+		__atomic_store_n(&stream->rows[word], rows[word], __ATOMIC_RELAXED);
+
+	__atomic_store_n(&stream->seq, seq + 2, __ATOMIC_RELEASE);
+
+	wake_server(stream);
+}
+
+/* Copy the newest frame, retrying if the emulator thread was writing it */
+static void read_frame(stream_t *stream)
+{
+	uint64_t before, after;
+	int word;
+
+	do {
+		before = __atomic_load_n(&stream->seq, __ATOMIC_ACQUIRE);
+		stream->latest_hires = __atomic_load_n(&stream->hires, __ATOMIC_RELAXED);
+
+		for (word = 0; word < DISPLAY_WORDS(stream->latest_hires); word++)
+			stream->latest[word] = __atomic_load_n(&stream->rows[word], __ATOMIC_RELAXED);
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		after = __atomic_load_n(&stream->seq, __ATOMIC_RELAXED);
+	} while (before != after || (before & 1));
+
+	stream->frame = before / 2;
+}
+
+/* Send what's queued for a client. Returns -1 if it went away */
+static int flush_client(client_t *client)
+{
+	while (client->out_pos < client->out_len) {
+		ssize_t n = send(client->fd, client->out + client->out_pos,
+				client->out_len - client->out_pos, MSG_DONTWAIT | MSG_NOSIGNAL);
+
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return 0;
+
+		if (n <= 0)
+			return -1;
+
+		client->out_pos += n;
+	}
+
+	client->out_pos = client->out_len = 0;
+	return 0;
+}
+
+/* Queue the rows which changed since the client's last update, once the
+ * last one is sent. Frames published meanwhile are skipped */
+static void update_client(stream_t *stream, client_t *client)
+{
+	const int hires = stream->latest_hires, words = ROW_WORDS(hires);
+	stream_update_t update = {
+		stream->frame, 0, DISPLAY_WIDTH(hires), DISPLAY_HEIGHT(hires), 0
+	};
+	uint8_t *out = client->out + client->out_len;
+	int row, resized = 0;
+
+	if (client->out_len || client->frame == stream->frame)
+		return;
+
+	// A new geometry starts from a blank display
+	if (client->hires != hires) {
+		memset(client->rows, 0, sizeof(client->rows));
+		client->hires = hires;
+		resized = 1;
+	}
+
+	out += sizeof(update);
+
+	for (row = 0; row < DISPLAY_HEIGHT(hires); row++) {
+		const uint64_t *latest = &stream->latest[row * words];
+		uint64_t *rows = &client->rows[row * words];
+
+		if (memcmp(latest, rows, words * sizeof(uint64_t)) == 0)
+			continue;
+
+		memcpy(rows, latest, words * sizeof(uint64_t));
+		update.rows |= 1ULL << row;
+		memcpy(out, latest, words * sizeof(uint64_t));
+		out += words * sizeof(uint64_t);
+	}
+
+	// A new client starts from nothing rather than skipping frames
+	if (client->frame && stream->frame > client->frame + 1)
+		__atomic_fetch_add(&stream->skipped, stream->frame - client->frame - 1,
+				__ATOMIC_RELAXED);
+
+	client->frame = stream->frame;
+
+	// Frames which only changed rows back to what the client has
+	if (!update.rows && !resized)
+		return;
+
+	memcpy(client->out + client->out_len, &update, sizeof(update));
+	client->out_len = out - client->out;
+	__atomic_fetch_add(&stream->updates, 1, __ATOMIC_RELAXED);
+}
+
+/* Take a new subscriber and queue the hello for it */
+static void accept_client(stream_t *stream)
+{
+	int fd = accept(stream->listen_fd, NULL, NULL);
+
+	if (fd < 0)
+		return;
+
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+	if (stream->count == stream->capacity) {
+		stream->capacity = stream->capacity ? 2 * stream->capacity : 8;
+		stream->clients = realloc(stream->clients, stream->capacity * sizeof(client_t));
+	}
+
+	client_t *client = &stream->clients[stream->count++];
+	stream_hello_t hello = { STREAM_MAGIC, STREAM_VERSION, 0 };
+
+	memset(client, 0, sizeof(client_t));
+	client->fd = fd;
+	memcpy(client->out, &hello, sizeof(hello));
+	client->out_len = sizeof(hello);
+
+	log_info("Stream subscriber %i connected.\n", fd);
+}
+
+/* Hand the keys a client sent to the machine. Returns -1 if it went away */
+static int read_keys_from(stream_t *stream, client_t *client)
+{
+	uint8_t events[64];
+	ssize_t n, i;
+
+	n = recv(client->fd, events, sizeof(events), MSG_DONTWAIT);
+
+	if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return 0;
+
+	if (n <= 0)
+		return -1;
+
+	for (i = 0; i < n; i++) {
+		int key = events[i] & 0xF, down = (events[i] & STREAM_KEY_DOWN) != 0;
+
+		if (down)
+			client->held |= 1 << key;
+		else
+			client->held &= ~(1 << key);
+
+		sched_key(stream->sched, key, down);
+	}
+
+	return 0;
+}
+
+/* Disconnect a client, releasing the keys it held */
+static void drop_client(stream_t *stream, int index)
+{
+	client_t *client = &stream->clients[index];
+	int key;
+
+	for (key = 0; key < 16; key++)
+		if (client->held & (1 << key))
+			sched_key(stream->sched, key, 0);
+
+	log_info("Stream subscriber %i went away.\n", client->fd);
+	close(client->fd);
+	stream->clients[index] = stream->clients[--stream->count];
+}
+
+static void *server_main(void *arg)
+{
+	stream_t *stream = arg;
+	struct pollfd *fds = NULL;
+	int i, capacity = 0;
+
+	while (!__atomic_load_n(&stream->stopping, __ATOMIC_RELAXED)) {
+		if (capacity < stream->count + 2) {
+			capacity = stream->capacity + 2;
+			fds = realloc(fds, capacity * sizeof(struct pollfd));
+		}
+
+		fds[0] = (struct pollfd){ stream->wake[0], POLLIN, 0 };
+		fds[1] = (struct pollfd){ stream->listen_fd, POLLIN, 0 };
+
+		// Clients with something left to send are waited on to drain
+		for (i = 0; i < stream->count; i++) {
+			fds[i + 2].fd = stream->clients[i].fd;
+			fds[i + 2].events = POLLIN | (stream->clients[i].out_len ? POLLOUT : 0);
+			fds[i + 2].revents = 0;
+		}
+
+		if (poll(fds, stream->count + 2, -1) < 0 && errno != EINTR)
+			break;
+
+		if (fds[0].revents & POLLIN) {
+			char bytes[64];
+
+			while (read(stream->wake[0], bytes, sizeof(bytes)) > 0)
+				;
+
+			// Clear the flag before reading the frame, so a frame
+			// published after the read wakes the server up again
+			__atomic_store_n(&stream->pending, 0, __ATOMIC_SEQ_CST);
+			read_frame(stream);
+		}
+
+		// Go through the clients polled before taking new ones, from the
+		// end so dropping one doesn't skip another
+		for (i = stream->count - 1; i >= 0; i--) {
+			client_t *client = &stream->clients[i];
+			short revents = fds[i + 2].revents;
+
+			if ((revents & POLLIN) && read_keys_from(stream, client) != 0) {
+				drop_client(stream, i);
+				continue;
+			}
+
+			if ((revents & (POLLERR | POLLHUP)) && !(revents & POLLIN)) {
+				drop_client(stream, i);
+				continue;
+			}
+
+			if (flush_client(client) != 0) {
+				drop_client(stream, i);
+				continue;
+			}
+
+			update_client(stream, client);
+
+			if (flush_client(client) != 0)
+				drop_client(stream, i);
+		}
+
+		if (fds[1].revents & POLLIN)
+			accept_client(stream);
+	}
+
+	for (i = stream->count - 1; i >= 0; i--)
+		drop_client(stream, i);
+
+	free(fds);
+	return NULL;
+}
+
+/* Listen on the socket at path and hand keys to the scheduler. NULL if the
+ * socket couldn't be set up */
+stream_t *stream_open(char *path, sched_t *sched)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		log_error("The socket path '%s' is too long.\n", path);
+		return NULL;
+	}
+
+	strcpy(addr.sun_path, path);
+
+	// A socket left behind by an earlier run would be in the way
+	unlink(path);
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0
+			|| bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0
+			|| listen(fd, 16) != 0) {
+		log_error("Couldn't listen on '%s'.\n", path);
+
+		if (fd >= 0)
+			close(fd);
+
+		return NULL;
+	}
+
+	stream_t *stream = calloc(1, sizeof(stream_t));
+	stream->path = strdup(path);
+	stream->listen_fd = fd;
+	stream->sched = sched;
+
+	if (pipe(stream->wake) != 0) {
+		log_error("Couldn't set up the stream server.\n");
+		close(fd);
+		free(stream->path);
+		free(stream);
+		return NULL;
+	}
+
+	fcntl(stream->wake[0], F_SETFL, O_NONBLOCK);
+	fcntl(stream->wake[1], F_SETFL, O_NONBLOCK);
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+
+	pthread_create(&stream->thread, NULL, server_main, stream);
+	log_info("Streaming on '%s'.\n", path);
+	return stream;
+}
+
+/* Disconnect every subscriber and remove the socket */
+void stream_close(stream_t *stream)
+{
+	if (!stream)
+		return;
+
+	__atomic_store_n(&stream->stopping, 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&stream->pending, 0, __ATOMIC_SEQ_CST);
+	wake_server(stream);
+	pthread_join(stream->thread, NULL);
+
+	close(stream->listen_fd);
+	close(stream->wake[0]);
+	close(stream->wake[1]);
+	unlink(stream->path);
+
+	free(stream->path);
+	free(stream->clients);
+	free(stream);
+}
+
+/* Read the updates sent and the frames subscribers skipped */
+void stream_counts(stream_t *stream, uint64_t *updates, uint64_t *skipped)
+{
+	*updates = __atomic_load_n(&stream->updates, __ATOMIC_RELAXED);
+	*skipped = __atomic_load_n(&stream->skipped, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,68 @@
+#ifndef STREAM_H_
+#define STREAM_H_
+
+#include "sched.h"
+
+/*
+ * Streams the display to any number of local subscribers over a Unix
+ * domain socket, and takes their keys on the same connection. On
+ * connecting a subscriber gets a stream_hello_t, then an update whenever
+ * the display changed:
+ *
+ *   stream_update_t  header
+ *   uint64_t         rows[]  width / 64 words for every bit set in
+ *                            header.rows, row 0 first, leftmost pixel in
+ *                            the top bit of the first word
+ *
+ * Rows are only sent when they differ from what the subscriber has,
+ * which starts out as a blank 64x32 display. An update with another
+ * geometry than the last one starts from a blank display of the new
+ * geometry, and is sent even if it stays blank. A subscriber which can't
+ * keep up isn't queued frames for: once it has taken its last update it
+ * gets one with the rows that changed since, so the frames in between are
+ * skipped and the emulator thread never waits.
+ *
+ * Subscribers send one byte per key event, the key 0x0-0xF plus
+ * STREAM_KEY_DOWN if it was pressed. Keys still held by a subscriber
+ * which goes away are released.
+ */
+
+#define STREAM_MAGIC "C8ST"
+#define STREAM_VERSION 2
+
+/* Set in a key event for a press */
+#define STREAM_KEY_DOWN 0x80
+
+/* Sent once on connecting */
+typedef struct __attribute__((packed)) {
+	char magic[4];
+	uint16_t version;
+	uint16_t reserved;
+} stream_hello_t;
+
+/* The start of an update */
+typedef struct __attribute__((packed)) {
+	uint64_t frame; // Frames published so far, skipped ones included
+	uint64_t rows; // Bit n set if row n follows
+	uint8_t width; // Pixels per row, 64 or 128
+	uint8_t height; // Rows, 32 or 64
+	uint16_t reserved;
+} stream_update_t;
+
+typedef struct stream_s stream_t;
+
+/* Listen on the socket at path and hand keys to the scheduler. NULL if the
+ * socket couldn't be set up */
+stream_t *stream_open(char *, sched_t *);
+
+/* Disconnect every subscriber and remove the socket */
+void stream_close(stream_t *);
+
+/* Make the display of the given geometry (LORES or HIRES) the newest
+ * frame. Called on the emulator thread, never blocks */
+void stream_publish(stream_t *, const uint64_t *, int);
+
+/* Read the updates sent and the frames subscribers skipped */
+void stream_counts(stream_t *, uint64_t *, uint64_t *);
+
+#endif
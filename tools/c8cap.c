@@ -0,0 +1,294 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "../capture.h"
+
+/*
+ * Offline tool for frame captures written with --capture or capture=.
+ *
+ *   c8cap info FILE                      print what the capture holds
+ *   c8cap pbm FILE DIR [FIRST [COUNT]]   write frames as DIR/NNNNNNNN.pbm
+ *
+ * pbm writes one 64x32 or 128x64 image per frame, by frame number, frames
+ * which weren't recorded included. It starts decoding at the last key
+ * frame before FIRST.
+ */
+
+/* A capture mapped into memory, with its key frames */
+typedef struct {
+	const uint8_t *start;
+	size_t size;
+	const uint8_t *records; // First record
+	const uint8_t *end; // Past the last record
+	capture_key_t *keys;
+	uint32_t key_count;
+	uint64_t frames; // Number of the last frame
+	int indexed; // Closed properly, with an index
+} mapped_t;
+
+/* Go through the records to find the key frames of a capture without an
+ * index. Stops at the first damaged record */
+static void scan(mapped_t *map)
+{
+	const uint8_t *at = map->records;
+	uint32_t capacity = 0;
+	capture_rec_t rec;
+
+	while (at + sizeof(rec) <= map->end) {
+		memcpy(&rec, at, sizeof(rec));
+
+		if (rec.length > CAPTURE_MAX_DATA || at + sizeof(rec) + rec.length > map->end)
+			break;
+
+		if (rec.type == CAPTURE_KEY) {
+			if (map->key_count == capacity) {
+				capacity = capacity ? 2 * capacity : 64;
+				map->keys = realloc(map->keys, capacity * sizeof(capture_key_t));
+			}
+
+			map->keys[map->key_count].frame = rec.frame;
+			map->keys[map->key_count].offset = at - map->start;
+			map->key_count++;
+		}
+
+		map->frames = rec.frame;
+		at += sizeof(rec) + rec.length;
+	}
+
+	map->end = at;
+}
+
+static int map_capture(char *filename, mapped_t *map)
+{
+	struct stat st;
+	capture_header_t header;
+	capture_footer_t footer;
+	int fd = open(filename, O_RDONLY);
+
+	memset(map, 0, sizeof(mapped_t));
+
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		printf("Couldn't open the capture '%s'.\n", filename);
+		return -1;
+	}
+
+	map->size = st.st_size;
+
+	if (map->size < sizeof(header)) {
+		printf("'%s' is too short to be a capture.\n", filename);
+		close(fd);
+		return -1;
+	}
+
+	map->start = mmap(NULL, map->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (map->start == MAP_FAILED) {
+		printf("Couldn't map the capture '%s'.\n", filename);
+		return -1;
+	}
+
+	memcpy(&header, map->start, sizeof(header));
+
+	if (memcmp(header.magic, CAPTURE_MAGIC, 4) != 0
+			|| header.version != CAPTURE_VERSION) {
+		printf("'%s' isn't a version %i capture.\n", filename, CAPTURE_VERSION);
+		return -1;
+	}
+
+	map->records = map->start + sizeof(header);
+	map->end = map->start + map->size;
+
+	// Use the index if the capture was closed, or else find the key frames
+	if (map->size >= sizeof(header) + sizeof(footer)) {
+		memcpy(&footer, map->end - sizeof(footer), sizeof(footer));
+
+		map->indexed = memcmp(footer.magic, CAPTURE_INDEX_MAGIC, 4) == 0
+				&& footer.offset >= sizeof(header)
+				&& footer.offset <= map->size - sizeof(footer)
+				&& footer.count == (map->size - sizeof(footer) - footer.offset)
+						/ sizeof(capture_key_t);
+	}
+
+	if (map->indexed) {
+		uint32_t i;
+
+		map->key_count = footer.count;
+		map->keys = malloc(footer.count * sizeof(capture_key_t) + 1);
+		memcpy(map->keys, map->start + footer.offset, footer.count * sizeof(capture_key_t));
+		map->frames = footer.frames;
+		map->end = map->start + footer.offset;
+
+		for (i = 0; i < map->key_count; i++)
+			if (map->keys[i].offset < sizeof(header) || map->keys[i].offset >= footer.offset)
+				map->indexed = 0;
+	}
+
+	if (!map->indexed) {
+		free(map->keys);
+		map->keys = NULL;
+		map->key_count = 0;
+		map->frames = 0;
+		map->end = map->start + map->size;
+		printf("'%s' wasn't closed, reading it from the start.\n", filename);
+		scan(map);
+	}
+
+	return 0;
+}
+
+static int info(mapped_t *map)
+{
+	const uint8_t *at = map->records;
+	uint64_t records = 0, drops = 0, bytes = 0;
+	capture_rec_t rec;
+
+	while (at + sizeof(rec) <= map->end) {
+		memcpy(&rec, at, sizeof(rec));
+
+		if (at + sizeof(rec) + rec.length > map->end)
+			break;
+
+		records++;
+		bytes += rec.length;
+
+		if (rec.flags & CAPTURE_AFTER_DROP)
+			drops++;
+
+		at += sizeof(rec) + rec.length;
+	}
+
+	printf("%llu frames, %llu recorded in %llu bytes, %u key frames%s\n",
+			(unsigned long long)map->frames, (unsigned long long)records,
+			(unsigned long long)bytes, map->key_count,
+			map->indexed ? "" : " (no index)");
+
+	if (drops)
+		printf("Frames were dropped before %llu of the records.\n",
+				(unsigned long long)drops);
+
+	return 0;
+}
+
+static int write_pbm(char *dir, uint64_t frame, const uint64_t *rows, int hires)
+{
+	char filename[4096];
+	int word;
+
+	snprintf(filename, sizeof(filename), "%s/%08llu.pbm", dir,
+			(unsigned long long)frame);
+
+	FILE *file = fopen(filename, "wb");
+
+	if (!file) {
+		printf("Couldn't create '%s'.\n", filename);
+		return -1;
+	}
+
+	// Binary PBM, set bits are black and the leftmost pixel comes first
+	fprintf(file, "P4\n%i %i\n", DISPLAY_WIDTH(hires), DISPLAY_HEIGHT(hires));
+
+	for (word = 0; word < DISPLAY_WORDS(hires); word++) {
+		uint64_t bits = __builtin_bswap64(rows[word]);
+		fwrite(&bits, 8, 1, file);
+	}
+
+	fclose(file);
+	return 0;
+}
+
+/* Write the frames first to last as images */
+static int pbm(mapped_t *map, char *dir, uint64_t first, uint64_t last)
+{
+	const uint8_t *at = map->records;
+	uint64_t rows[DISPLAY_WORDS(HIRES)] = { 0 }, shown = 0, frame;
+	uint32_t low = 0, high = map->key_count;
+	int hires = LORES;
+	capture_rec_t rec;
+
+	if (last > map->frames)
+		last = map->frames;
+
+	// Start at the last key frame at or before the first one wanted
+	while (low < high) {
+		uint32_t middle = low + (high - low) / 2;
+
+		if (map->keys[middle].frame <= first)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+
+	if (low > 0)
+		at = map->start + map->keys[low - 1].offset;
+
+	while (at + sizeof(rec) <= map->end) {
+		memcpy(&rec, at, sizeof(rec));
+
+		if (rec.frame > last || at + sizeof(rec) + rec.length > map->end)
+			break;
+
+		// The frames since the one shown look the same as it
+		for (frame = shown > first ? shown : first; shown && frame < rec.frame; frame++)
+			if (write_pbm(dir, frame, rows, hires) != 0)
+				return 2;
+
+		if (rec.type == CAPTURE_KEY)
+			memset(rows, 0, sizeof(rows));
+
+		hires = (rec.flags & CAPTURE_HIRES) != 0;
+
+		if (capture_decode(at + sizeof(rec), rec.length, hires, rows) != 0) {
+			printf("The record of frame %llu is damaged.\n",
+					(unsigned long long)rec.frame);
+			return 2;
+		}
+
+		shown = rec.frame;
+		at += sizeof(rec) + rec.length;
+	}
+
+	for (frame = shown > first ? shown : first; shown && frame <= last; frame++)
+		if (write_pbm(dir, frame, rows, hires) != 0)
+			return 2;
+
+	return 0;
+}
+
+static void usage(void)
+{
+	printf("Usage: c8cap info <capture>\n");
+	printf("       c8cap pbm <capture> <dir> [first [count]]\n");
+}
+
+int main(int argc, char *argv[])
+{
+	mapped_t map;
+
+	if (argc < 3) {
+		usage();
+		return 2;
+	}
+
+	if (map_capture(argv[2], &map) != 0)
+		return 2;
+
+	if (strcmp(argv[1], "info") == 0)
+		return info(&map);
+
+	if (strcmp(argv[1], "pbm") == 0 && argc > 3) {
+		uint64_t first = argc > 4 ? strtoull(argv[4], NULL, 0) : 1;
+		uint64_t count = argc > 5 ? strtoull(argv[5], NULL, 0) : UINT64_MAX - first;
+
+		if (first == 0 || count == 0) {
+			usage();
+			return 2;
+		}
+
+		return pbm(&map, argv[3], first, first + count - 1);
+	}
+
+	usage();
+	return 2;
+}
@@ -0,0 +1,331 @@
+#include "../pack.h"
+
+/*
+ * Builds and lists ROM packs, see pack.h.
+ *
+ *   c8pack build PACK LIST   pack the programs named in LIST
+ *   c8pack list PACK         print every program in a pack
+ *
+ * LIST has one program per line, a file followed by options:
+ *
+ *   programs/pong2.c8    name=pong quirks=chip48 ips=1000
+ *
+ * name= is what the program is found by, the file name by default.
+ * quirks= and ips= are applied when the program is loaded, unless the
+ * emulator is told otherwise. Blank lines and lines starting with '#' are
+ * skipped. Programs which are larger than PROGRAM_SIZE, or reuse a name
+ * for different contents, are left out and make build return 1.
+ */
+
+/* A program to pack */
+typedef struct {
+	char *name;
+	uint8_t *data; // Shared by programs with the same contents
+	uint16_t size;
+	uint64_t hash;
+	uint8_t quirks;
+	uint32_t ips;
+	uint32_t offset; // Of the data in the pack
+	uint32_t name_offset;
+} rom_t;
+
+static rom_t *roms;
+static int rom_count;
+
+/* Read a program, NULL if it can't be read or doesn't fit */
+static uint8_t *read_rom(char *filename, uint16_t *size)
+{
+	FILE *file = fopen(filename, "rb");
+	uint8_t *data = malloc(PROGRAM_SIZE + 1);
+	size_t read_bytes;
+
+	if (!file) {
+		printf("Couldn't open '%s'.\n", filename);
+		free(data);
+		return NULL;
+	}
+
+	read_bytes = fread(data, 1, PROGRAM_SIZE + 1, file);
+	fclose(file);
+
+	if (read_bytes == 0 || read_bytes > PROGRAM_SIZE) {
+		printf("'%s' is %s, programs are 1 to %i bytes.\n", filename,
+				read_bytes ? "too large" : "empty", PROGRAM_SIZE);
+		free(data);
+		return NULL;
+	}
+
+	*size = read_bytes;
+	return data;
+}
+
+/* Add the program on a line of the list. Returns 0 if it was added or is
+ * already there, 1 if it was rejected and 2 if the line is wrong */
+static int add_rom(char *list, int line, char *path, char *save)
+{
+	rom_t rom = { .name = path, .quirks = PACK_NO_QUIRKS, .ips = PACK_NO_IPS };
+	char *token;
+	int i;
+
+	while ((token = strtok_r(NULL, " \t\r\n", &save))) {
+		char *value = strchr(token, '=');
+
+		if (value)
+			*value++ = '\0';
+
+		if (value && strcmp(token, "name") == 0) {
+			rom.name = value;
+		} else if (value && strcmp(token, "quirks") == 0) {
+			int quirks = parse_quirks(value);
+
+			if (quirks < 0) {
+				printf("%s:%i: Unknown quirks '%s'.\n", list, line, value);
+				return 2;
+			}
+
+			rom.quirks = quirks;
+		} else if (value && strcmp(token, "ips") == 0) {
+			rom.ips = strtoul(value, NULL, 0);
+		} else {
+			printf("%s:%i: Unknown option '%s'.\n", list, line, token);
+			return 2;
+		}
+	}
+
+	if (!(rom.data = read_rom(path, &rom.size)))
+		return 1;
+
+	rom.hash = pack_hash(rom.data, rom.size);
+
+	for (i = 0; i < rom_count; i++) {
+		rom_t *other = &roms[i];
+
+		if (strcmp(other->name, rom.name) != 0)
+			continue;
+
+		int same = other->size == rom.size && memcmp(other->data, rom.data, rom.size) == 0;
+		free(rom.data);
+
+		if (!same) {
+			printf("%s:%i: '%s' is already a different program.\n", list, line, rom.name);
+			return 1;
+		}
+
+		// Listed twice is fine, but only one set of options can go in
+		if (other->quirks != rom.quirks || other->ips != rom.ips) {
+			printf("%s:%i: '%s' is already listed with other options.\n", list, line, rom.name);
+			return 1;
+		}
+
+		return 0;
+	}
+
+	// Keep one copy of each program
+	for (i = 0; i < rom_count; i++) {
+		rom_t *other = &roms[i];
+
+		if (other->hash == rom.hash && other->size == rom.size
+				&& memcmp(other->data, rom.data, rom.size) == 0) {
+			free(rom.data);
+			rom.data = other->data;
+			break;
+		}
+	}
+
+	rom.name = strdup(rom.name);
+	roms = realloc(roms, (rom_count + 1) * sizeof(rom_t));
+	roms[rom_count++] = rom;
+	return 0;
+}
+
+static int by_hash(const void *a, const void *b)
+{
+	const rom_t *x = a, *y = b;
+
+	if (x->hash != y->hash)
+		return x->hash < y->hash ? -1 : 1;
+
+	return strcmp(x->name, y->name);
+}
+
+static int by_name(const void *a, const void *b)
+{
+	return strcmp(roms[*(const uint32_t *)a].name, roms[*(const uint32_t *)b].name);
+}
+
+/* Write the pack. Returns 0 if it was written */
+static int write_pack(char *filename)
+{
+	pack_header_t header = { .version = PACK_VERSION, .count = rom_count };
+	uint32_t *names = malloc(rom_count * sizeof(uint32_t) + 1);
+	uint32_t offset, data_start;
+	FILE *file;
+	int i, j;
+
+	qsort(roms, rom_count, sizeof(rom_t), by_hash);
+
+	for (i = 0; i < rom_count; i++)
+		names[i] = i;
+
+	qsort(names, rom_count, sizeof(uint32_t), by_name);
+
+	// Lay out the names and then the data, which is shared between copies
+	offset = sizeof(header) + rom_count * (sizeof(pack_entry_t) + sizeof(uint32_t));
+
+	for (i = 0; i < rom_count; i++) {
+		roms[i].name_offset = offset;
+		offset += strlen(roms[i].name) + 1;
+	}
+
+	data_start = offset;
+
+	for (i = 0; i < rom_count; i++) {
+		for (j = 0; j < i && roms[j].data != roms[i].data; j++)
+			;
+
+		if (j < i) {
+			roms[i].offset = roms[j].offset;
+		} else {
+			roms[i].offset = offset;
+			offset += roms[i].size;
+		}
+	}
+
+	memcpy(header.magic, PACK_MAGIC, 4);
+	header.size = offset;
+
+	if (!(file = fopen(filename, "wb"))) {
+		printf("Couldn't create '%s'.\n", filename);
+		free(names);
+		return -1;
+	}
+
+	fwrite(&header, sizeof(header), 1, file);
+
+	for (i = 0; i < rom_count; i++) {
+		pack_entry_t entry = {
+			.hash = roms[i].hash,
+			.offset = roms[i].offset,
+			.size = roms[i].size,
+			.quirks = roms[i].quirks,
+			.ips = roms[i].ips,
+			.name = roms[i].name_offset,
+		};
+
+		fwrite(&entry, sizeof(entry), 1, file);
+	}
+
+	fwrite(names, sizeof(uint32_t), rom_count, file);
+
+	for (i = 0; i < rom_count; i++)
+		fwrite(roms[i].name, strlen(roms[i].name) + 1, 1, file);
+
+	// Data in layout order, each shared program once
+	for (offset = data_start, i = 0; i < rom_count; i++) {
+		if (roms[i].offset != offset)
+			continue;
+
+		fwrite(roms[i].data, roms[i].size, 1, file);
+		offset += roms[i].size;
+	}
+
+	free(names);
+
+	if (fclose(file) != 0 || offset != header.size) {
+		printf("Couldn't write '%s'.\n", filename);
+		return -1;
+	}
+
+	printf("Packed %i programs, %u bytes of programs.\n", rom_count,
+			header.size - data_start);
+	return 0;
+}
+
+static int build(char *filename, char *list)
+{
+	FILE *file = fopen(list, "r");
+	char buffer[1024];
+	int line = 0, rejected = 0;
+
+	if (!file) {
+		printf("Couldn't open the list '%s'.\n", list);
+		return 2;
+	}
+
+	while (fgets(buffer, sizeof(buffer), file)) {
+		char *save, *path;
+		line++;
+
+		path = strtok_r(buffer, " \t\r\n", &save);
+
+		// Skip blank lines and comments
+		if (!path || path[0] == '#')
+			continue;
+
+		switch (add_rom(list, line, path, save))
+		{
+			case 1:
+				rejected++;
+				break;
+			case 2:
+				fclose(file);
+				return 2;
+		}
+	}
+
+	fclose(file);
+
+	if (write_pack(filename) != 0)
+		return 2;
+
+	if (rejected) {
+		printf("Left out %i programs.\n", rejected);
+		return 1;
+	}
+
+	return 0;
+}
+
+static int list(char *filename)
+{
+	pack_t *pack = pack_open(filename);
+	const pack_entry_t *entry;
+	uint32_t i;
+
+	if (!pack)
+		return 2;
+
+	for (i = 0; (entry = pack_entry(pack, i)); i++) {
+		printf("%016llx %5u %-7s ", (unsigned long long)entry->hash, entry->size,
+				entry->quirks == PACK_NO_QUIRKS ? "-" : quirk_profiles[entry->quirks].name);
+
+		if (entry->ips == PACK_NO_IPS)
+			printf("%7s ", "-");
+		else
+			printf("%7u ", entry->ips);
+
+		printf("%s\n", pack_name(pack, entry));
+	}
+
+	pack_close(pack);
+	return 0;
+}
+
+static void usage(void)
+{
+	printf("Usage: c8pack build <pack> <list>\n");
+	printf("       c8pack list <pack>\n\n");
+	printf("List lines: <file> [name=NAME] [quirks=PROFILE] [ips=N]\n");
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc == 4 && strcmp(argv[1], "build") == 0)
+		return build(argv[2], argv[3]);
+
+	if (argc == 3 && strcmp(argv[1], "list") == 0)
+		return list(argv[2]);
+
+	usage();
+	return 2;
+}
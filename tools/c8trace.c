@@ -0,0 +1,267 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "../trace.h"
+
+/*
+ * Offline tool for binary traces written with --trace.
+ *
+ *   c8trace dump FILE [FIRST [COUNT]]   print records, by record number
+ *   c8trace find FILE PATTERN...        print records matching every pattern
+ *   c8trace diff FILE FILE              find where two runs diverge
+ *
+ * Patterns are pc=ADDR, cycle=N, op=XXXX where any hex digit of the opcode
+ * can be '?', writes=ADDR for records writing to ADDR, and v=X for records
+ * changing VX.
+ */
+
+/* A trace mapped into memory */
+typedef struct {
+	const uint8_t *start;
+	const uint8_t *end;
+	size_t size;
+} mapped_t;
+
+static int map_trace(char *filename, mapped_t *map)
+{
+	struct stat st;
+	trace_header_t header;
+	int fd = open(filename, O_RDONLY);
+
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		printf("Couldn't open the trace '%s'.\n", filename);
+		return -1;
+	}
+
+	map->size = st.st_size;
+
+	if (map->size < sizeof(header)) {
+		printf("'%s' is too short to be a trace.\n", filename);
+		close(fd);
+		return -1;
+	}
+
+	map->start = mmap(NULL, map->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (map->start == MAP_FAILED) {
+		printf("Couldn't map the trace '%s'.\n", filename);
+		return -1;
+	}
+
+	memcpy(&header, map->start, sizeof(header));
+
+	if (memcmp(header.magic, TRACE_MAGIC, 4) != 0
+			|| header.version != TRACE_VERSION) {
+		printf("'%s' isn't a version %i trace.\n", filename, TRACE_VERSION);
+		return -1;
+	}
+
+	// Traces are read sequentially, let the kernel read ahead
+	madvise((void *)map->start, map->size, MADV_SEQUENTIAL);
+
+	map->end = map->start + map->size;
+	map->start += sizeof(header);
+	return 0;
+}
+
+static void print_record(uint64_t index, trace_rec_t *rec)
+{
+	int i;
+
+	printf("#%llu cycle %llu pc 0x%03X op %04X I=%03X",
+			(unsigned long long)index, (unsigned long long)rec->cycle,
+			rec->pc, rec->opcode, rec->I);
+
+	for (i = 0; i < 16; i++)
+		if (rec->vmask & (1 << i))
+			printf(" V%X=%02X", i, rec->v[i]);
+
+	if (rec->mem_len) {
+		printf(" [%03X]=", rec->mem_addr);
+
+		for (i = 0; i < rec->mem_len; i++)
+			printf("%02X", rec->mem[i]);
+	}
+
+	printf("\n");
+}
+
+static int dump(mapped_t *map, uint64_t first, uint64_t count)
+{
+	const uint8_t *p = map->start;
+	trace_rec_t rec;
+	uint64_t index = 0;
+
+	while ((p = trace_decode(p, map->end, &rec)) && count > 0) {
+		if (index >= first) {
+			print_record(index, &rec);
+			count--;
+		}
+
+		index++;
+	}
+
+	return 0;
+}
+
+/* Check one pattern against a record */
+static int matches(char *pattern, trace_rec_t *rec)
+{
+	char *value = strchr(pattern, '=');
+	int i;
+
+	if (!value)
+		return 0;
+
+	value++;
+
+	if (strncmp(pattern, "pc=", 3) == 0)
+		return rec->pc == strtoul(value, NULL, 16);
+
+	if (strncmp(pattern, "cycle=", 6) == 0)
+		return rec->cycle == strtoull(value, NULL, 0);
+
+	if (strncmp(pattern, "v=", 2) == 0)
+		return (rec->vmask >> (strtoul(value, NULL, 16) & 0xF)) & 1;
+
+	if (strncmp(pattern, "writes=", 7) == 0) {
+		uint16_t addr = strtoul(value, NULL, 16);
+		return rec->mem_len && addr >= rec->mem_addr
+				&& addr < rec->mem_addr + rec->mem_len;
+	}
+
+	if (strncmp(pattern, "op=", 3) == 0 && strlen(value) == 4) {
+		for (i = 0; i < 4; i++) {
+			char digit[2] = { value[i], '\0' };
+			uint8_t nibble = (rec->opcode >> (12 - 4 * i)) & 0xF;
+
+			if (digit[0] != '?' && strtoul(digit, NULL, 16) != nibble)
+				return 0;
+		}
+
+		return 1;
+	}
+
+	return 0;
+}
+
+static int find(mapped_t *map, int count, char **patterns)
+{
+	const uint8_t *p = map->start;
+	trace_rec_t rec;
+	uint64_t index = 0, found = 0;
+	int i;
+
+	while ((p = trace_decode(p, map->end, &rec))) {
+		for (i = 0; i < count; i++)
+			if (!matches(patterns[i], &rec))
+				break;
+
+		if (i == count) {
+			print_record(index, &rec);
+			found++;
+		}
+
+		index++;
+	}
+
+	printf("%llu of %llu records matched.\n", (unsigned long long)found,
+			(unsigned long long)index);
+	return found ? 0 : 1;
+}
+
+/* Compare two records, ignoring registers which aren't in the mask */
+static int same(trace_rec_t *a, trace_rec_t *b)
+{
+	int i;
+
+	if (a->cycle != b->cycle || a->pc != b->pc || a->opcode != b->opcode
+			|| a->I != b->I || a->vmask != b->vmask
+			|| a->mem_len != b->mem_len)
+		return 0;
+
+	for (i = 0; i < 16; i++)
+		if ((a->vmask & (1 << i)) && a->v[i] != b->v[i])
+			return 0;
+
+	if (a->mem_len && (a->mem_addr != b->mem_addr
+			|| memcmp(a->mem, b->mem, a->mem_len) != 0))
+		return 0;
+
+	return 1;
+}
+
+static int diff(mapped_t *a, mapped_t *b)
+{
+	const uint8_t *pa = a->start, *pb = b->start;
+	trace_rec_t ra, rb;
+	uint64_t index = 0;
+
+	for (;;) {
+		pa = trace_decode(pa, a->end, &ra);
+		pb = trace_decode(pb, b->end, &rb);
+
+		if (!pa || !pb)
+			break;
+
+		if (!same(&ra, &rb)) {
+			printf("Runs diverge at record %llu:\n", (unsigned long long)index);
+			printf("< ");
+			print_record(index, &ra);
+			printf("> ");
+			print_record(index, &rb);
+			return 1;
+		}
+
+		index++;
+	}
+
+	if (pa || pb) {
+		printf("Identical for %llu records, then the %s trace ends.\n",
+				(unsigned long long)index, pa ? "second" : "first");
+		return 1;
+	}
+
+	printf("Identical, %llu records.\n", (unsigned long long)index);
+	return 0;
+}
+
+static void usage(void)
+{
+	printf("Usage: c8trace dump <trace> [first [count]]\n");
+	printf("       c8trace find <trace> <pattern>...\n");
+	printf("       c8trace diff <trace> <trace>\n\n");
+	printf("Patterns: pc=ADDR cycle=N op=D??? writes=ADDR v=X\n");
+}
+
+int main(int argc, char *argv[])
+{
+	mapped_t a, b;
+
+	if (argc < 3) {
+		usage();
+		return 2;
+	}
+
+	if (map_trace(argv[2], &a) != 0)
+		return 2;
+
+	if (strcmp(argv[1], "dump") == 0)
+		return dump(&a, argc > 3 ? strtoull(argv[3], NULL, 0) : 0,
+				argc > 4 ? strtoull(argv[4], NULL, 0) : UINT64_MAX);
+
+	if (strcmp(argv[1], "find") == 0 && argc > 3)
+		return find(&a, argc - 3, &argv[3]);
+
+	if (strcmp(argv[1], "diff") == 0 && argc == 4) {
+		if (map_trace(argv[3], &b) != 0)
+			return 2;
+
+		return diff(&a, &b);
+	}
+
+	usage();
+	return 2;
+}
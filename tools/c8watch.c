@@ -0,0 +1,275 @@
+#include <errno.h>
+#include <poll.h>
+#include <termios.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "../stream.h"
+
+/*
+ * Terminal subscriber for a display streamed with --serve.
+ *
+ *   c8watch SOCKET
+ *
+ * Draws the display two rows per line and plays the keypad on the left of
+ * a QWERTY keyboard, the same keys as the window. Terminals don't report
+ * key releases, so a key is released once it hasn't repeated for a while.
+ * Escape or Ctrl-C quits.
+ */
+
+/* A key which doesn't repeat for this long was let go */
+#define RELEASE_NS 150000000LL
+
+static struct termios saved;
+
+static int64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* The keypad on the left of a QWERTY keyboard, -1 for other keys */
+static int keypad_key(char c)
+{
+	switch (c)
+	{
+		case '1': return 0x1;
+		case '2': return 0x2;
+		case '3': return 0x3;
+		case '4': return 0xC;
+		case 'q': return 0x4;
+		case 'w': return 0x5;
+		case 'e': return 0x6;
+		case 'r': return 0xD;
+		case 'a': return 0x7;
+		case 's': return 0x8;
+		case 'd': return 0x9;
+		case 'f': return 0xE;
+		case 'z': return 0xA;
+		case 'x': return 0x0;
+		case 'c': return 0xB;
+		case 'v': return 0xF;
+		default: return -1;
+	}
+}
+
+static int connect_to(char *path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		printf("The socket path '%s' is too long.\n", path);
+		return -1;
+	}
+
+	strcpy(addr.sun_path, path);
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0
+			|| connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+		printf("Couldn't connect to '%s'.\n", path);
+
+		if (fd >= 0)
+			close(fd);
+
+		return -1;
+	}
+
+	return fd;
+}
+
+/* Read exactly size bytes. Returns -1 if the stream ended */
+static int read_all(int fd, void *buffer, size_t size)
+{
+	uint8_t *at = buffer;
+
+	while (size) {
+		ssize_t n = read(fd, at, size);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+
+		if (n <= 0)
+			return -1;
+
+		at += n;
+		size -= n;
+	}
+
+	return 0;
+}
+
+static void send_key(int fd, int key, int down)
+{
+	uint8_t event = key | (down ? STREAM_KEY_DOWN : 0);
+
+	// A closed stream shows up as the end of the updates
+	send(fd, &event, 1, MSG_NOSIGNAL);
+}
+
+/* Redraw the lines holding the changed rows, two rows per line */
+static void draw(const uint64_t *rows, int width, int height, uint64_t changed)
+{
+	int words = width / 64, line, column;
+
+	for (line = 0; line < height / 2; line++) {
+		if (!(changed & (3ULL << (2 * line))))
+			continue;
+
+		const uint64_t *top = &rows[2 * line * words], *bottom = top + words;
+
+		printf("\033[%i;1H", line + 1);
+
+		for (column = 0; column < width; column++) {
+			int shift = 63 - column % 64, word = column / 64;
+			int bits = (top[word] >> shift & 1) << 1 | (bottom[word] >> shift & 1);
+
+			fputs(bits == 3 ? "█" : bits == 2 ? "▀" : bits == 1 ? "▄" : " ", stdout);
+		}
+	}
+
+	printf("\033[%i;1H", height / 2 + 1);
+	fflush(stdout);
+}
+
+static void restore_terminal(void)
+{
+	tcsetattr(STDIN_FILENO, TCSANOW, &saved);
+	printf("\033[?25h\n");
+}
+
+int main(int argc, char *argv[])
+{
+	stream_hello_t hello;
+	stream_update_t update;
+	uint64_t rows[128] = { 0 }, data[128];
+	int64_t release[16] = { 0 };
+	int fd, key, row, quit = 0, input = STDIN_FILENO;
+	int width = 64, height = 32;
+
+	if (argc != 2) {
+		printf("Usage: c8watch <socket>\n");
+		return 2;
+	}
+
+	if ((fd = connect_to(argv[1])) < 0)
+		return 2;
+
+	if (read_all(fd, &hello, sizeof(hello)) != 0
+			|| memcmp(hello.magic, STREAM_MAGIC, 4) != 0
+			|| hello.version != STREAM_VERSION) {
+		printf("'%s' isn't a version %i stream.\n", argv[1], STREAM_VERSION);
+		close(fd);
+		return 2;
+	}
+
+	// Keys as they're typed, without echo or signals
+	struct termios raw;
+	tcgetattr(STDIN_FILENO, &saved);
+	raw = saved;
+	raw.c_lflag &= ~(ICANON | ECHO | ISIG);
+	raw.c_cc[VMIN] = 0;
+	raw.c_cc[VTIME] = 0;
+	tcsetattr(STDIN_FILENO, TCSANOW, &raw);
+	atexit(restore_terminal);
+
+	printf("\033[2J\033[?25l");
+	draw(rows, width, height, ~0ULL);
+
+	while (!quit) {
+		struct pollfd fds[2] = {
+			{ fd, POLLIN, 0 },
+			{ input, POLLIN, 0 },
+		};
+		int64_t now = now_ns(), next = 0;
+
+		// Let go of the keys which stopped repeating
+		for (key = 0; key < 16; key++) {
+			if (release[key] && release[key] <= now) {
+				send_key(fd, key, 0);
+				release[key] = 0;
+			} else if (release[key] && (!next || release[key] < next)) {
+				next = release[key];
+			}
+		}
+
+		if (poll(fds, 2, next ? (int)((next - now) / 1000000 + 1) : -1) < 0) {
+			if (errno == EINTR)
+				continue;
+
+			break;
+		}
+
+		if (fds[0].revents & (POLLIN | POLLHUP)) {
+			uint32_t count, words;
+			uint64_t changed;
+
+			if (read_all(fd, &update, sizeof(update)) != 0)
+				break;
+
+			if ((update.width != 64 && update.width != 128)
+					|| (update.height != 32 && update.height != 64))
+				break;
+
+			changed = update.rows;
+
+			// Another geometry starts from a blank display
+			if (update.width != width || update.height != height) {
+				width = update.width;
+				height = update.height;
+				memset(rows, 0, sizeof(rows));
+				printf("\033[2J");
+				changed = ~0ULL;
+			}
+
+			words = width / 64;
+			count = __builtin_popcountll(update.rows & (~0ULL >> (64 - height)));
+
+			if (read_all(fd, data, count * words * sizeof(uint64_t)) != 0)
+				break;
+
+			for (row = 0, count = 0; row < height; row++) {
+				if (update.rows & (1ULL << row)) {
+					memcpy(&rows[row * words], &data[count * words], words * sizeof(uint64_t));
+					count++;
+				}
+			}
+
+			draw(rows, width, height, changed);
+		}
+
+		if (fds[1].revents & POLLIN) {
+			char typed[64];
+			ssize_t n = read(STDIN_FILENO, typed, sizeof(typed)), i;
+
+			// Keep watching once the input is closed
+			if (n <= 0)
+				input = -1;
+
+			for (i = 0; i < n; i++) {
+				// Escape or Ctrl-C
+				if (typed[i] == 0x1B || typed[i] == 0x03) {
+					quit = 1;
+					break;
+				}
+
+				if ((key = keypad_key(typed[i])) < 0)
+					continue;
+
+				if (!release[key])
+					send_key(fd, key, 1);
+
+				release[key] = now_ns() + RELEASE_NS;
+			}
+		}
+	}
+
+	close(fd);
+	return 0;
+}
@@ -0,0 +1,188 @@
+#include <fcntl.h>
+
+#include "trace.h"
+
+/* Size of one block written to the file */
+#define BLOCK_SIZE (1024 * 1024)
+
+/* Largest possible record */
+#define MAX_RECORD (17 + 2 + 16 + 16)
+
+struct trace_s {
+	int fd;
+	uint8_t *buffer;
+	uint32_t used;
+
+	// State from before the current instruction
+	trace_rec_t rec;
+	uint8_t V[16];
+};
+
+/* Write everything buffered to the file */
+static void flush(trace_t *trace)
+{
+	uint32_t done = 0;
+
+	while (done < trace->used) {
+		ssize_t n = write(trace->fd, trace->buffer + done, trace->used - done);
+
+		if (n <= 0) {
+			log_error("Couldn't write to the trace, dropping %u bytes.\n",
+					trace->used - done);
+			break;
+		}
+
+		done += n;
+	}
+
+	trace->used = 0;
+}
+
+/* Start a trace in the given file, NULL if it couldn't be created */
+trace_t *trace_open(char *filename)
+{
+	int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+	if (fd < 0) {
+		log_error("Couldn't create the trace '%s'.\n", filename);
+		return NULL;
+	}
+
+	trace_t *trace = calloc(1, sizeof(trace_t));
+	trace->fd = fd;
+	trace->buffer = malloc(BLOCK_SIZE);
+
+	trace_header_t header = { TRACE_MAGIC, TRACE_VERSION, 0 };
+	memcpy(trace->buffer, &header, sizeof(header));
+	trace->used = sizeof(header);
+
+	return trace;
+}
+
+/* Write out what's buffered and close the file */
+void trace_close(trace_t *trace)
+{
+	if (!trace)
+		return;
+
+	flush(trace);
+	close(trace->fd);
+	free(trace->buffer);
+	free(trace);
+}
+
+/* Remember the state before an instruction runs */
+void trace_before(trace_t *trace, chip8_t *cpu)
+{
+	trace->rec.cycle = cpu->cycles;
+	trace->rec.pc = cpu->pc;
+	trace->rec.opcode = (cpu->memory[cpu->pc & 0xFFF] << 8)
+			| cpu->memory[(cpu->pc + 1) & 0xFFF];
+	trace->rec.mem_len = 0;
+	memcpy(trace->V, cpu->V, 16);
+}
+
+/* Note that the instruction wrote len bytes of memory at addr */
+void trace_memory(trace_t *trace, chip8_t *cpu, uint16_t addr, uint16_t len)
+{
+	uint16_t i;
+
+	if (len > 16)
+		len = 16;
+
+	trace->rec.mem_addr = addr;
+	trace->rec.mem_len = len;
+
+	for (i = 0; i < len; i++)
+		trace->rec.mem[i] = cpu->memory[(addr + i) & 0xFFF];
+}
+
+static void put(uint8_t **p, const void *data, size_t size)
+{
+	memcpy(*p, data, size);
+	*p += size;
+}
+
+/* Write the record for the instruction which just ran */
+void trace_after(trace_t *trace, chip8_t *cpu)
+{
+	trace_rec_t *rec = &trace->rec;
+	int i;
+
+	if (trace->used + MAX_RECORD > BLOCK_SIZE)
+		flush(trace);
+
+	uint8_t *p = trace->buffer + trace->used;
+
+	rec->I = cpu->I;
+	rec->vmask = 0;
+
+	for (i = 0; i < 16; i++)
+		if (cpu->V[i] != trace->V[i])
+			rec->vmask |= 1 << i;
+
+	put(&p, &rec->cycle, 8);
+	put(&p, &rec->pc, 2);
+	put(&p, &rec->opcode, 2);
+	put(&p, &rec->I, 2);
+	put(&p, &rec->vmask, 2);
+	put(&p, &rec->mem_len, 1);
+
+	if (rec->mem_len) {
+		put(&p, &rec->mem_addr, 2);
+		put(&p, rec->mem, rec->mem_len);
+	}
+
+	for (i = 0; i < 16; i++)
+		if (rec->vmask & (1 << i))
+			*p++ = cpu->V[i];
+
+	trace->used = p - trace->buffer;
+}
+
+static void get(const uint8_t **p, void *data, size_t size)
+{
+	memcpy(data, *p, size);
+	*p += size;
+}
+
+/* Decode the record at p. Returns the start of the next record, or NULL if
+ * there's no complete record before end */
+const uint8_t *trace_decode(const uint8_t *p, const uint8_t *end,
+		trace_rec_t *rec)
+{
+	int i;
+
+	if (end - p < 17)
+		return NULL;
+
+	get(&p, &rec->cycle, 8);
+	get(&p, &rec->pc, 2);
+	get(&p, &rec->opcode, 2);
+	get(&p, &rec->I, 2);
+	get(&p, &rec->vmask, 2);
+	get(&p, &rec->mem_len, 1);
+
+	if (rec->mem_len > 16)
+		return NULL;
+
+	if (rec->mem_len) {
+		if (end - p < 2 + rec->mem_len)
+			return NULL;
+
+		get(&p, &rec->mem_addr, 2);
+		get(&p, rec->mem, rec->mem_len);
+	}
+
+	for (i = 0; i < 16; i++) {
+		if (!(rec->vmask & (1 << i)))
+			continue;
+
+		if (p == end)
+			return NULL;
+
+		rec->v[i] = *p++;
+	}
+
+	return p;
+}
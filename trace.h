@@ -0,0 +1,66 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include "chip8.h"
+
+/*
+ * Binary execution traces. A trace file is a header followed by one record
+ * per instruction:
+ *
+ *   uint64_t cycle     instructions run before this one
+ *   uint16_t pc        address of the instruction
+ *   uint16_t opcode
+ *   uint16_t I         value of I after the instruction
+ *   uint16_t vmask     bit n set if Vn was changed
+ *   uint8_t  mem_len   bytes of memory written, at most 16
+ *   uint16_t mem_addr  only if mem_len > 0
+ *   uint8_t  mem[]     mem_len bytes written
+ *   uint8_t  v[]       new value of every register in vmask, V0 first
+ *
+ * Records are collected in a buffer on the thread running the machine and
+ * written out in large blocks.
+ */
+
+#define TRACE_MAGIC "C8TR"
+#define TRACE_VERSION 1
+
+/* The file header */
+typedef struct __attribute__((packed)) {
+	char magic[4];
+	uint16_t version;
+	uint16_t reserved;
+} trace_header_t;
+
+/* One decoded record */
+typedef struct {
+	uint64_t cycle;
+	uint16_t pc;
+	uint16_t opcode;
+	uint16_t I;
+	uint16_t vmask;
+	uint8_t v[16]; // Only the registers in vmask are set
+	uint8_t mem_len;
+	uint16_t mem_addr;
+	uint8_t mem[16];
+} trace_rec_t;
+
+/* Start a trace in the given file, NULL if it couldn't be created */
+trace_t *trace_open(char *);
+
+/* Write out what's buffered and close the file */
+void trace_close(trace_t *);
+
+/* Remember the state before an instruction runs */
+void trace_before(trace_t *, chip8_t *);
+
+/* Note that the instruction wrote len bytes of memory at addr */
+void trace_memory(trace_t *, chip8_t *, uint16_t, uint16_t);
+
+/* Write the record for the instruction which just ran */
+void trace_after(trace_t *, chip8_t *);
+
+/* Decode the record at p. Returns the start of the next record, or NULL if
+ * there's no complete record before end */
+const uint8_t *trace_decode(const uint8_t *, const uint8_t *, trace_rec_t *);
+
+#endif